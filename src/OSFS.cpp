@@ -9,225 +9,3747 @@
 #include "OSFS.h"
 
 #include <Arduino.h>
+#include <limits.h>
 
 namespace OSFS {
 
-	result getFileInfo(const char* filename, uint16_t& filePointer, uint16_t& fileSize) {
+	namespace {
+
+		// Flags which a file keeps for as long as it exists, rather than
+		// those which mark how far storing or deleting it has got
+		constexpr uint8_t KIND_BITS = 1<<LOGBIT | 1<<COMPBIT;
+
+		// The volume OSFS is working on. This is the default one, which goes
+		// straight to the user-provided functions. With OSFS_VOLUMES, another
+		// takes its place while a Volume's method or a handle opened on it is
+		// running: see volumeScope.
+		volumeState defaultVolume;
+#if OSFS_VOLUMES
+		volumeState* vol = &defaultVolume;
+
+		// Makes OSFS work on the given volume until it goes out of scope
+		class volumeScope {
+		public:
+			explicit volumeScope(volumeState* volume) : previous(vol) {
+				vol = volume;
+			}
+
+			~volumeScope() {
+				vol = previous;
+			}
+
+		private:
+			volumeState* previous;
+		};
+#else
+		volumeState* const vol = &defaultVolume;
+#endif
+
+		// The first and last addresses of the current volume's storage
+		inline address_t storageStart() {
+#if OSFS_VOLUMES
+			if (vol != &defaultVolume)
+				return vol->device.start;
+#endif
+			return startOfEEPROM;
+		}
+
+		inline address_t storageEnd() {
+#if OSFS_VOLUMES
+			if (vol != &defaultVolume)
+				return vol->device.end;
+#endif
+			return endOfEEPROM;
+		}
+
+#if OSFS_BATCH_SIZE > 0
+		typedef volumeState::batchEntry batchEntry;
+#endif
+
+		// Whether written storage can only be changed by setting bits, until
+		// it's erased: see OSFS_FLASH_BLOCK_SIZE
+		constexpr bool flashMode = OSFS_FLASH_BLOCK_SIZE > 0;
+
+#if OSFS_FLASH_BLOCK_SIZE > 0
+		// Writes are inverted a piece at a time: see deviceWrite
+		constexpr unsigned int FLASH_CHUNK = OSFS_PAGE_SIZE > 32 ? OSFS_PAGE_SIZE : 32;
+
+		inline address_t flashHalfSize() {
+			return ((unsigned long)storageEnd() - storageStart() + 1) / 2 / OSFS_FLASH_BLOCK_SIZE * OSFS_FLASH_BLOCK_SIZE;
+		}
+#endif
+
+#if OSFS_WEAR_BUCKETS > 0
+		// Record a write in the histogram, splitting it between buckets as needed
+		void recordWear(address_t address, unsigned int num) {
+			unsigned long regionSize = (unsigned long)storageEnd() - storageStart() + 1;
+
+			for (unsigned int i = 0; i < num; i++) {
+				unsigned long offset = (unsigned long)address + i - storageStart();
+				vol->wearHistogram[offset * OSFS_WEAR_BUCKETS / regionSize]++;
+			}
+		}
+#endif
+
+		// Read straight from the EEPROM, bypassing the page cache
+		inline void deviceRead(address_t address, unsigned int num, byte* output) {
+#if OSFS_INSTRUMENT
+			vol->opCounts.reads++;
+			vol->opCounts.readBytes += num;
+			if (vol->tracer)
+				vol->tracer(traceOp::READ, address, num);
+#endif
+#if OSFS_VOLUMES
+			if (vol != &defaultVolume)
+				vol->device.read(vol->device.context, address, num, output);
+			else
+#endif
+				readNBytes(address, num, output);
+
+#if OSFS_FLASH_BLOCK_SIZE > 0
+			// See deviceWrite
+			for (unsigned int i = 0; i < num; i++)
+				output[i] = ~output[i];
+#endif
+		}
+
+		// Pass a write on to writeNBytes, or to the volume's backend
+		inline void storageWrite(address_t address, unsigned int num, const byte* input) {
+#if OSFS_INSTRUMENT
+			vol->opCounts.writes++;
+			vol->opCounts.writeBytes += num;
+			if (vol->tracer)
+				vol->tracer(traceOp::WRITE, address, num);
+#endif
+
+#if OSFS_VOLUMES
+			if (vol != &defaultVolume)
+				vol->device.write(vol->device.context, address, num, input);
+			else
+#endif
+				writeNBytes(address, num, input);
+
+#if OSFS_WEAR_BUCKETS > 0
+			recordWear(address, num);
+#endif
+		}
+
+#if OSFS_FLASH_BLOCK_SIZE > 0
+		// Erase the block of flash at the given address, bypassing the page
+		// cache
+		inline void deviceErase(address_t address) {
+#if OSFS_INSTRUMENT
+			vol->opCounts.erases++;
+			if (vol->tracer)
+				vol->tracer(traceOp::ERASE, address, OSFS_FLASH_BLOCK_SIZE);
+#endif
+#if OSFS_VOLUMES
+			if (vol != &defaultVolume)
+				vol->device.erase(vol->device.context, address);
+			else
+#endif
+				eraseBlock(address);
+		}
+#endif
+
+		// Write straight to the EEPROM, bypassing the page cache
+		void deviceWrite(address_t address, unsigned int num, const byte* input) {
+#if OSFS_COMPARE_WRITES
+			// Trim the bytes which already hold the right values from each
+			// end. What's left is still written in one go, so that the write
+			// is as atomic as it was.
+			byte existing[16];
+
+			while (num > 0) {
+				unsigned int chunk = num < sizeof(existing) ? num : sizeof(existing);
+				deviceRead(address, chunk, existing);
+
+				unsigned int same = 0;
+				while (same < chunk && existing[same] == input[same])
+					same++;
+
+				address += same;
+				input += same;
+				num -= same;
+				if (same < chunk)
+					break;
+			}
+
+			while (num > 0) {
+				unsigned int chunk = num < sizeof(existing) ? num : sizeof(existing);
+				deviceRead(address + num - chunk, chunk, existing);
+
+				unsigned int same = 0;
+				while (same < chunk && existing[chunk - 1 - same] == input[num - 1 - same])
+					same++;
+
+				num -= same;
+				if (same < chunk)
+					break;
+			}
+
+			if (num == 0)
+				return;
+#endif
+
+#if OSFS_FLASH_BLOCK_SIZE > 0
+			// Erased flash reads as ones, but OSFS takes storage full of
+			// zeros to be blank. So every byte is inverted on its way to and
+			// from the flash, and setting bits, the only change OSFS makes to
+			// anything it has written, clears them in the flash. A write which
+			// fits in a page is passed on in one piece.
+			byte inverted[FLASH_CHUNK];
+
+			while (num > 0) {
+				unsigned int chunk = num < sizeof(inverted) ? num : sizeof(inverted);
+				for (unsigned int i = 0; i < chunk; i++)
+					inverted[i] = ~input[i];
+
+				storageWrite(address, chunk, inverted);
+				address += chunk;
+				input += chunk;
+				num -= chunk;
+			}
+#else
+			storageWrite(address, num, input);
+#endif
+		}
+
+#if OSFS_CACHE_PAGES > 0
+		// See volumeState for the cache's contents
+		typedef volumeState::cachePage cachePage;
+
+		inline bool isDirty(const cachePage& page) {
+			return page.dirtyEnd != page.dirtyStart;
+		}
+
+		// Write back the first count dirty pages
+		void cacheFlush(uint8_t count) {
+			for (uint8_t i = 0; i < count; i++) {
+				cachePage& page = vol->cachePages[vol->cacheDirtyOrder[i]];
+				deviceWrite(page.address + page.dirtyStart, page.dirtyEnd - page.dirtyStart,
+					page.data + page.dirtyStart);
+				page.dirtyStart = page.dirtyEnd = 0;
+				vol->cacheCounts.flushes++;
+			}
+
+			for (uint8_t i = count; i < vol->cacheDirtyCount; i++)
+				vol->cacheDirtyOrder[i - count] = vol->cacheDirtyOrder[i];
+			vol->cacheDirtyCount -= count;
+		}
+
+		void cacheDrop() {
+			for (uint8_t i = 0; i < OSFS_CACHE_PAGES; i++) {
+				vol->cachePages[i].validStart = vol->cachePages[i].validEnd = 0;
+				vol->cachePages[i].dirtyStart = vol->cachePages[i].dirtyEnd = 0;
+			}
+			vol->cacheDirtyCount = 0;
+		}
+
+		// Get the index of the cached copy of the page starting at the given
+		// address, or OSFS_CACHE_PAGES if it isn't cached
+		uint8_t cacheFind(address_t pageAddress) {
+			for (uint8_t i = 0; i < OSFS_CACHE_PAGES; i++) {
+				const cachePage& page = vol->cachePages[i];
+				if (page.validStart != page.validEnd && page.address == pageAddress)
+					return i;
+			}
+			return OSFS_CACHE_PAGES;
+		}
+
+		// Get the index of the cached copy of the page starting at the given
+		// address, making room for it if it isn't cached. The least recently
+		// used page is evicted if there are no empty slots.
+		uint8_t cacheGet(address_t pageAddress, bool& found) {
+			uint8_t slot = 0;
+
+			for (uint8_t i = 0; i < OSFS_CACHE_PAGES; i++) {
+				cachePage& page = vol->cachePages[i];
+				bool empty = page.validStart == page.validEnd;
+
+				if (!empty && page.address == pageAddress) {
+					page.lastUsed = ++vol->cacheClock;
+					found = true;
+					return i;
+				}
+
+				const cachePage& best = vol->cachePages[slot];
+				if (best.validStart != best.validEnd && (empty ||
+						uint16_t(vol->cacheClock - page.lastUsed) > uint16_t(vol->cacheClock - best.lastUsed)))
+					slot = i;
+			}
+
+			cachePage& page = vol->cachePages[slot];
+
+			// Writing back the evicted page means writing back every page
+			// changed before it too
+			if (isDirty(page)) {
+				uint8_t position = 0;
+				while (vol->cacheDirtyOrder[position] != slot)
+					position++;
+				cacheFlush(position + 1);
+			}
+
+			found = false;
+			page.address = pageAddress;
+			page.validStart = page.validEnd = 0;
+			page.lastUsed = ++vol->cacheClock;
+			return slot;
+		}
+
+		// Whether an access lies entirely within one page of the cache
+		inline bool withinPage(address_t address, unsigned int num) {
+			return address / OSFS_CACHE_PAGE_SIZE == (address + num - 1) / OSFS_CACHE_PAGE_SIZE;
+		}
+
+		inline address_t pageOf(address_t address) {
+			return address - address % OSFS_CACHE_PAGE_SIZE;
+		}
+
+		// The offsets within the page starting at pageAddress of the part of
+		// an access which falls in that page
+		inline void pagePart(address_t pageAddress, address_t address, unsigned int num,
+				uint16_t& start, uint16_t& end) {
+			start = address > pageAddress ? address - pageAddress : 0;
+			end = address + num - pageAddress;
+			if (end > OSFS_CACHE_PAGE_SIZE)
+				end = OSFS_CACHE_PAGE_SIZE;
+		}
+
+		// Read through the cache. If any of the bytes aren't known, the whole
+		// read goes to the EEPROM and whatever the cache has room for is kept
+		// for next time, so a miss costs no more than having no cache. Reads
+		// larger than both a page and a header aren't kept, so that they don't
+		// push everything else out of the cache.
+		void cacheRead(address_t address, unsigned int num, byte* output) {
+			bool keep = num <= OSFS_CACHE_PAGE_SIZE || num <= sizeof(fileHeader);
+			address_t firstPage = pageOf(address);
+			address_t lastPage = pageOf(address + num - 1);
+			uint16_t start, end;
+
+			if (keep) {
+				bool known = true;
+				for (address_t pageAddress = firstPage; known; pageAddress += OSFS_CACHE_PAGE_SIZE) {
+					uint8_t slot = cacheFind(pageAddress);
+					pagePart(pageAddress, address, num, start, end);
+					known = slot != OSFS_CACHE_PAGES &&
+						start >= vol->cachePages[slot].validStart && end <= vol->cachePages[slot].validEnd;
+					if (pageAddress == lastPage)
+						break;
+				}
+
+				if (known) {
+					vol->cacheCounts.hits++;
+					for (address_t pageAddress = firstPage; ; pageAddress += OSFS_CACHE_PAGE_SIZE) {
+						cachePage& page = vol->cachePages[cacheFind(pageAddress)];
+						page.lastUsed = ++vol->cacheClock;
+						pagePart(pageAddress, address, num, start, end);
+						memcpy(output + (pageAddress + start - address), page.data + start, end - start);
+						if (pageAddress == lastPage)
+							break;
+					}
+					return;
+				}
+
+				vol->cacheCounts.misses++;
+			}
+
+			deviceRead(address, num, output);
+
+			// Copy any changes over what was read. This is done for all the
+			// pages first, since keeping one page may evict another.
+			for (uint8_t i = 0; i < vol->cacheDirtyCount; i++) {
+				const cachePage& page = vol->cachePages[vol->cacheDirtyOrder[i]];
+				for (uint16_t offset = page.dirtyStart; offset < page.dirtyEnd; offset++) {
+					address_t byteAddress = page.address + offset;
+					if (byteAddress >= address && address_t(byteAddress - address) < num)
+						output[byteAddress - address] = page.data[offset];
+				}
+			}
+
+			if (!keep)
+				return;
+
+			for (address_t pageAddress = firstPage; ; pageAddress += OSFS_CACHE_PAGE_SIZE) {
+				bool found;
+				cachePage& page = vol->cachePages[cacheGet(pageAddress, found)];
+				pagePart(pageAddress, address, num, start, end);
+				memcpy(page.data + start, output + (pageAddress + start - address), end - start);
+
+				// The known bytes must stay in one range
+				if (page.validStart == page.validEnd || (!isDirty(page) &&
+						(start > page.validEnd || end < page.validStart))) {
+					page.validStart = start;
+					page.validEnd = end;
+				} else if (start <= page.validEnd && end >= page.validStart) {
+					if (start < page.validStart)
+						page.validStart = start;
+					if (end > page.validEnd)
+						page.validEnd = end;
+				}
+
+				if (pageAddress == lastPage)
+					break;
+			}
+		}
+
+		// Write through the cache. Writes spanning several pages go straight to
+		// the EEPROM, after everything before them, so that they stay in one
+		// piece.
+		void cacheWrite(address_t address, unsigned int num, const byte* input) {
+			if (!withinPage(address, num)) {
+				cacheFlush(vol->cacheDirtyCount);
+				deviceWrite(address, num, input);
+
+				// Keep any cached copies up to date
+				for (uint8_t i = 0; i < OSFS_CACHE_PAGES; i++) {
+					cachePage& page = vol->cachePages[i];
+					for (uint16_t offset = page.validStart; offset < page.validEnd; offset++) {
+						address_t byteAddress = page.address + offset;
+						if (byteAddress >= address && address_t(byteAddress - address) < num)
+							page.data[offset] = input[byteAddress - address];
+					}
+				}
+				return;
+			}
+
+			bool found;
+			uint8_t slot = cacheGet(pageOf(address), found);
+			cachePage& page = vol->cachePages[slot];
+
+			if (found)
+				vol->cacheCounts.hits++;
+			else
+				vol->cacheCounts.misses++;
+
+			if (isDirty(page) && vol->cacheDirtyOrder[vol->cacheDirtyCount - 1] != slot)
+				cacheFlush(vol->cacheDirtyCount);
+
+			// The known bytes must stay in one range. If this write is apart
+			// from them, either forget them or, if they include changes, read
+			// in the gap between them.
+			uint16_t start = address - page.address;
+			uint16_t end = start + num;
+			if (page.validStart == page.validEnd || (!isDirty(page) &&
+					(start > page.validEnd || end < page.validStart))) {
+				page.validStart = start;
+				page.validEnd = end;
+			} else if (start > page.validEnd) {
+				deviceRead(page.address + page.validEnd, start - page.validEnd, page.data + page.validEnd);
+			} else if (end < page.validStart) {
+				deviceRead(page.address + end, page.validStart - end, page.data + end);
+			}
+
+			memcpy(page.data + start, input, num);
+
+			if (start < page.validStart)
+				page.validStart = start;
+			if (end > page.validEnd)
+				page.validEnd = end;
+
+			if (!isDirty(page)) {
+				page.dirtyStart = start;
+				page.dirtyEnd = end;
+				vol->cacheDirtyOrder[vol->cacheDirtyCount++] = slot;
+			} else {
+				if (start < page.dirtyStart)
+					page.dirtyStart = start;
+				if (end > page.dirtyEnd)
+					page.dirtyEnd = end;
+			}
+		}
+#endif
+
+		inline address_t firstHeaderAddress() {
+#if OSFS_FLASH_BLOCK_SIZE > 0
+			return vol->flashBase + FIRST_HEADER_OFFSET;
+#else
+			return storageStart() + FIRST_HEADER_OFFSET;
+#endif
+		}
+
+		// Files must end before this address: the end of the EEPROM, or of
+		// the half of the flash in use
+		inline address_t endOfFiles() {
+#if OSFS_FLASH_BLOCK_SIZE > 0
+			return vol->flashBase + flashHalfSize() - 1;
+#else
+			return storageEnd();
+#endif
+		}
+
+		// Copy a padded filename without its padding, null terminated
+		void unpadFilename(const char* paddedFilename, char* filenameOut) {
+			unsigned int length = FILE_NAME_LENGTH;
+			while (length > 0 && paddedFilename[length - 1] == ' ')
+				length--;
+			memcpy(filenameOut, paddedFilename, length);
+			filenameOut[length] = '\0';
+		}
+
+		result recover(bool tidy);
+
+		// Confirm that the EEPROM is managed by this version of OSFS, and
+		// recover from any power cut the first time. This is free while
+		// mounted, since mount() already did both.
+		inline result checkSession() {
+			if (vol->session.mounted)
+				return result::NO_ERROR;
+
+			result r = checkLibVersion();
+			if (r != result::NO_ERROR || vol->recovered)
+				return r;
+
+			return recover(false);
+		}
+
+		// A freshly formatted filesystem contains a single "dummy header" with
+		// no name or contents, which is overwritten by the first file
+		inline bool isDummyHeader(address_t address, const fileHeader& header) {
+			if (address != firstHeaderAddress() || header.nextFile != 0 || header.fileSize != 0)
+				return false;
+
+			for (unsigned int i = 0; i < FILE_NAME_LENGTH; i++) {
+				if (header.fileID[i] != ' ')
+					return false;
+			}
+
+			return !isDeletedFile(header);
+		}
+
+		// For readWalkHeader, when no name is wanted
+		constexpr uint16_t NO_NAME = 0x100;
+
+		// Read a header while walking the chain. Only the part from its size
+		// to its hash is read, unless its name might be needed: if it's live
+		// and its hash is nameHash, or if it could be the dummy header.
+		// Otherwise fileID is cleared, so that it matches no name.
+		result readWalkHeader(address_t address, fileHeader& header, uint16_t nameHash = NO_NAME) {
+			result r = readNBytesChk(address + offsetof(fileHeader, fileSize),
+				offsetof(fileHeader, hash) + sizeof(uint8_t) - offsetof(fileHeader, fileSize), &header.fileSize);
+			if (r != result::NO_ERROR)
+				return r;
+
+			bool mayBeDummy = address == firstHeaderAddress() && header.nextFile == 0 && header.fileSize == 0;
+			if ((header.hash == nameHash && !isDeletedFile(header)) || mayBeDummy)
+				return readNBytesChk(address, FILE_NAME_LENGTH, header.fileID);
+
+			memset(header.fileID, 0, FILE_NAME_LENGTH);
+			return result::NO_ERROR;
+		}
+
+		// Number of bytes available to the header at the given address and its
+		// contents before the next header or the end of the EEPROM
+		inline address_t slotSize(address_t address, address_t nextFile) {
+			if (nextFile == 0)
+				return endOfFiles() - address;
+			return nextFile - address;
+		}
+
+		// Whether a free slot is a better home for a new file than another,
+		// according to the allocation policy. Either may be 0 for "none".
+		bool preferSlot(address_t address, address_t nextFile, address_t otherAddress, address_t otherNextFile,
+				address_t sizeRequired) {
+			if (otherAddress == 0)
+				return true;
+
+			if (vol->allocation == allocPolicy::BEST_FIT) {
+				// Slots which are too small to split count as perfect fits
+				address_t waste = slotSize(address, nextFile) - sizeRequired;
+				address_t otherWaste = slotSize(otherAddress, otherNextFile) - sizeRequired;
+				if (waste <= sizeof(fileHeader))
+					waste = 0;
+				if (otherWaste <= sizeof(fileHeader))
+					otherWaste = 0;
+				if (waste != otherWaste)
+					return waste < otherWaste;
+			}
+
+			// Otherwise the first slot after the cursor wins. For FIRST_FIT the
+			// cursor is 0, so this is just the first slot.
+			bool afterCursor = address >= vol->allocCursor;
+			bool otherAfterCursor = otherAddress >= vol->allocCursor;
+			if (afterCursor != otherAfterCursor)
+				return afterCursor;
+
+			return address < otherAddress;
+		}
+
+		// Choose a free slot for a new file if it's large enough and better than
+		// the current choice
+		void considerSlot(address_t address, address_t nextFile, bool deleted, address_t sizeRequired,
+				address_t& writeAddress, address_t& nextAddress, bool& reusingHole) {
+			// Free space in the chain can't be written again until it's erased
+			if (flashMode)
+				return;
+
+#if OSFS_INSTRUMENT
+			if (slotSize(address, nextFile) < sizeRequired)
+				vol->opCounts.allocRetries++;
+#endif
+			if (slotSize(address, nextFile) >= sizeRequired &&
+					preferSlot(address, nextFile, writeAddress, nextAddress, sizeRequired)) {
+				writeAddress = address;
+				nextAddress = nextFile;
+				reusingHole = deleted;
+			}
+		}
+
+		// Whether there's no point looking for a better slot than this one
+		bool goodEnoughSlot(address_t address, address_t nextFile, address_t sizeRequired) {
+			if (vol->allocation == allocPolicy::BEST_FIT)
+				return address_t(slotSize(address, nextFile) - sizeRequired) <= sizeof(fileHeader);
+			return address >= vol->allocCursor;
+		}
+
+		// Address at which a file will be appended after the given last header.
+		// If the last header is free itself, it will be reused, except on flash.
+		inline address_t appendAddress(address_t lastAddress, const fileHeader& lastHeader) {
+			if (!flashMode && (isDeletedFile(lastHeader) || isDummyHeader(lastAddress, lastHeader)))
+				return lastAddress;
+			return lastAddress + sizeof(fileHeader) + lastHeader.fileSize;
+		}
+
+		// Delete the dummy header, if it's at the given address, so that
+		// another header can be written over it safely: see storeFile
+		result hideDummyHeader(address_t address) {
+			if (flashMode || address != firstHeaderAddress())
+				return result::NO_ERROR;
+
+			fileHeader header;
+			result r = readNBytesChk(address, sizeof(fileHeader), &header);
+			if (r != result::NO_ERROR || !isDummyHeader(address, header))
+				return r;
+
+			uint8_t flags = 1<<DELBIT;
+			return writeNBytesChk(address + offsetof(fileHeader, flags), sizeof(uint8_t), &flags);
+		}
+
+		// Point the header at the given address at a different next header
+		inline result writeNextFile(address_t address, address_t nextFile) {
+			return writeNBytesChk(address + offsetof(fileHeader, nextFile), sizeof(address_t), &nextFile);
+		}
+
+		// A burst is a series of writes which are combined into as few page
+		// writes as possible. None of them are certain to reach the EEPROM
+		// until burstEnd() is called, so anything which depends on them, like
+		// a link to a new header, must be written after that.
+		inline void burstBegin() {
+#if OSFS_PAGE_SIZE > 0
+			vol->pendingWrite.length = 0;
+#endif
+		}
+
+		result burstEnd() {
+#if OSFS_PAGE_SIZE > 0
+			unsigned int length = vol->pendingWrite.length;
+			vol->pendingWrite.length = 0;
+			if (length > 0)
+				return writeNBytesChk(vol->pendingWrite.address, length, vol->pendingWrite.data);
+#endif
+			return result::NO_ERROR;
+		}
+
+		result burstWrite(address_t address, unsigned int num, const void* input) {
+#if OSFS_PAGE_SIZE > 0
+			const byte* in = (const byte*)input;
+
+			while (num > 0) {
+				// Carry on with the waiting write if this follows straight on
+				if (vol->pendingWrite.length > 0 && address != vol->pendingWrite.address + vol->pendingWrite.length) {
+					result r = burstEnd();
+					if (r != result::NO_ERROR)
+						return r;
+				}
+
+				if (vol->pendingWrite.length == 0)
+					vol->pendingWrite.address = address;
+
+				unsigned int chunk = OSFS_PAGE_SIZE - address % OSFS_PAGE_SIZE;
+				if (chunk > num)
+					chunk = num;
+
+				memcpy(vol->pendingWrite.data + vol->pendingWrite.length, in, chunk);
+				vol->pendingWrite.length += chunk;
+				address += chunk;
+				in += chunk;
+				num -= chunk;
+
+				// Write out each page as soon as it's complete
+				if (address % OSFS_PAGE_SIZE == 0) {
+					result r = burstEnd();
+					if (r != result::NO_ERROR)
+						return r;
+				}
+			}
+
+			return result::NO_ERROR;
+#else
+			return writeNBytesChk(address, num, input);
+#endif
+		}
+
+		// Copy bytes from one part of the EEPROM to another, a few at a time.
+		// The writes are part of a burst.
+		result copyBytes(address_t from, address_t to, address_t num) {
+			byte buffer[16];
+
+			while (num > 0) {
+				unsigned int chunk = num < sizeof(buffer) ? num : sizeof(buffer);
+
+				result r = readNBytesChk(from, chunk, buffer);
+				if (r != result::NO_ERROR)
+					return r;
+
+				r = burstWrite(to, chunk, buffer);
+				if (r != result::NO_ERROR)
+					return r;
+
+				from += chunk;
+				to += chunk;
+				num -= chunk;
+			}
+
+			return result::NO_ERROR;
+		}
+
+		// Write zeros, a few at a time. The writes are part of a burst.
+		result burstZeros(address_t address, address_t num) {
+			static const byte zeros[16] = {};
+
+			while (num > 0) {
+				unsigned int chunk = num < sizeof(zeros) ? num : sizeof(zeros);
+
+				result r = burstWrite(address, chunk, zeros);
+				if (r != result::NO_ERROR)
+					return r;
+
+				address += chunk;
+				num -= chunk;
+			}
+
+			return result::NO_ERROR;
+		}
+
+#if OSFS_COMPRESS
+		// Compressed contents are a series of tokens, each of which is either
+		// a run of bytes to be copied as they are, or a match: a repeat of
+		// bytes which came earlier in the uncompressed contents, at most
+		// LZ_WINDOW bytes back. A run is a byte n < 0x80 followed by n + 1
+		// bytes. A match is two bytes, most significant first: the top bit is
+		// set, then come the length less LZ_MIN_MATCH in 9 bits and the
+		// distance back less 1 in 6 bits.
+		constexpr address_t LZ_WINDOW = sizeof(lzDecoder::window);
+		constexpr address_t LZ_MIN_MATCH = 3;
+		constexpr address_t LZ_MAX_MATCH = LZ_MIN_MATCH + 511;
+		constexpr address_t LZ_MAX_RUN = 128;
+
+		// Data to be stored compressed: see burstData
+		struct lzSource {
+			const byte* data;
+			address_t size; // Before compression
+#if OSFS_CRC
+			uint16_t crc; // Carried on over the compressed contents by lzSmaller
+#endif
+		};
+
+		// Where lzCompress puts the compressed contents
+		struct lzSink {
+			bool writing; // Write them, as part of a burst, or only count them
+			address_t address; // Where to write them
+			address_t size; // How many bytes there have been so far
+			address_t limit; // How many there may be
+#if OSFS_CRC
+			uint16_t crc; // Carried on over them
+#endif
+		};
+
+		result lzPut(lzSink& sink, const void* bytes, address_t num) {
+			if (num > sink.limit - sink.size)
+				return result::INSUFFICIENT_SPACE;
+
+			if (sink.writing) {
+				result r = burstWrite(sink.address + sink.size, num, bytes);
+				if (r != result::NO_ERROR)
+					return r;
+			}
+
+#if OSFS_CRC
+			sink.crc = crc16(sink.crc, bytes, num);
+#endif
+			sink.size += num;
+			return result::NO_ERROR;
+		}
+
+		// Compress source into sink, after its size. Each match is the
+		// longest in the window, so the same data always comes out the same.
+		// INSUFFICIENT_SPACE if it comes to more than the sink's limit.
+		result lzCompress(const lzSource& source, lzSink& sink) {
+			const byte* data = source.data;
+			address_t size = source.size;
+			result r = lzPut(sink, &size, sizeof(address_t));
+
+			address_t position = 0;
+			address_t run = 0; // Bytes before position which are still to be put in a run
+
+			while (r == result::NO_ERROR && position < size) {
+				address_t maxLength = size - position < LZ_MAX_MATCH ? size - position : LZ_MAX_MATCH;
+				address_t bestLength = 0;
+				address_t bestDistance = 0;
+
+				for (address_t distance = 1; distance <= LZ_WINDOW && distance <= position; distance++) {
+					address_t length = 0;
+					while (length < maxLength && data[position + length - distance] == data[position + length])
+						length++;
+
+					if (length > bestLength) {
+						bestLength = length;
+						bestDistance = distance;
+						if (length == maxLength)
+							break;
+					}
+				}
+
+				bool matched = bestLength >= LZ_MIN_MATCH;
+				if (!matched) {
+					position++;
+					run++;
+				}
+
+				if (run > 0 && (matched || run == LZ_MAX_RUN || position == size)) {
+					byte token = run - 1;
+					r = lzPut(sink, &token, 1);
+					if (r == result::NO_ERROR)
+						r = lzPut(sink, data + position - run, run);
+					run = 0;
+				}
+
+				if (matched && r == result::NO_ERROR) {
+					uint16_t value = 0x8000 | (bestLength - LZ_MIN_MATCH) << 6 | (bestDistance - 1);
+					byte token[2] = {byte(value >> 8), byte(value)};
+					r = lzPut(sink, token, sizeof(token));
+					position += bestLength;
+				}
+			}
+
+			return r;
+		}
+
+		// Find out whether compressing source would make it smaller, and if
+		// so, what size its contents would be. With CRCs, source's CRC is
+		// carried on over them too, so that they needn't be compressed again
+		// to work it out.
+		bool lzSmaller(lzSource& source, address_t& compressedSize) {
+			if (source.size == 0)
+				return false;
+
+			lzSink sink;
+			memset(&sink, 0, sizeof(sink));
+			sink.limit = source.size - 1;
+#if OSFS_CRC
+			sink.crc = source.crc;
+#endif
+			if (lzCompress(source, sink) != result::NO_ERROR)
+				return false;
+
+			compressedSize = sink.size;
+#if OSFS_CRC
+			source.crc = sink.crc;
+#endif
+			return true;
+		}
+
+		// Reads compressed contents from the EEPROM a few bytes at a time
+		struct lzReader {
+			address_t address; // Of the next bytes to load into buffer
+			address_t left; // Bytes still to be loaded
+			uint8_t length; // Bytes in buffer
+			uint8_t position; // Of the next byte in buffer
+			byte buffer[16];
+		};
+
+		result lzGet(lzReader& in, byte& b) {
+			if (in.position == in.length) {
+				// Compressed contents never end part way through a token
+				if (in.left == 0)
+					return result::CORRUPT_FILE;
+
+				in.length = in.left < sizeof(in.buffer) ? in.left : sizeof(in.buffer);
+				result r = readNBytesChk(in.address, in.length, in.buffer);
+				if (r != result::NO_ERROR)
+					return r;
+
+				in.address += in.length;
+				in.left -= in.length;
+				in.position = 0;
+			}
+
+			b = in.buffer[in.position++];
+			return result::NO_ERROR;
+		}
+
+		// Get ready to uncompress the compressed contents at filePointer
+		void lzStart(lzDecoder& decoder, address_t filePointer) {
+			decoder.input = filePointer + sizeof(address_t);
+			decoder.produced = 0;
+			decoder.count = 0;
+			decoder.distance = 0;
+		}
+
+		// Uncompress len bytes of the compressed contents which end at
+		// inputEnd, starting skip bytes in, carrying on from where decoder
+		// got to. skip mustn't be before that. The bytes in between are
+		// uncompressed too, but only the last LZ_WINDOW of them are kept, for
+		// matches to refer back to.
+		result lzUncompress(lzDecoder& decoder, address_t inputEnd, address_t skip, void* output, address_t len) {
+			lzReader in;
+			in.address = decoder.input;
+			in.left = inputEnd - decoder.input;
+			in.length = 0;
+			in.position = 0;
+
+			byte* out = (byte*)output;
+			address_t produced = decoder.produced;
+			address_t count = decoder.count; // Bytes still to come from the current token
+			address_t distance = decoder.distance; // = 0 for a run
+			address_t end = skip + len;
+			result r = result::NO_ERROR;
+
+			while (produced < end) {
+				if (count == 0) {
+					byte token;
+					r = lzGet(in, token);
+					if (r != result::NO_ERROR)
+						return r;
+
+					distance = 0;
+					if (token & 0x80) {
+						byte low;
+						r = lzGet(in, low);
+						if (r != result::NO_ERROR)
+							return r;
+
+						uint16_t value = (token & 0x7F) << 8 | low;
+						count = (value >> 6) + LZ_MIN_MATCH;
+						distance = (value & 0x3F) + 1;
+						if (distance > produced)
+							return result::CORRUPT_FILE;
+					} else {
+						count = token + 1;
+					}
+				}
+
+				for (; count > 0 && produced < end; count--) {
+					byte b;
+					if (distance > 0) {
+						b = decoder.window[(produced - distance) % LZ_WINDOW];
+					} else {
+						r = lzGet(in, b);
+						if (r != result::NO_ERROR)
+							return r;
+					}
+
+					decoder.window[produced % LZ_WINDOW] = b;
+					if (produced >= skip)
+						out[produced - skip] = b;
+					produced++;
+				}
+			}
+
+			// Leave out whatever is still in the reader's buffer, so that the
+			// next call reads it again
+			decoder.input = in.address - (in.length - in.position);
+			decoder.produced = produced;
+			decoder.count = count;
+			decoder.distance = distance;
+			return result::NO_ERROR;
+		}
+
+		// Find out whether the file with contents at filePointer is
+		// compressed, and if so, its size once uncompressed
+		result lzFileSize(address_t filePointer, bool& compressed, address_t& size) {
+			uint8_t flags;
+			result r = readNBytesChk(filePointer - sizeof(fileHeader) + offsetof(fileHeader, flags), sizeof(uint8_t), &flags);
+			compressed = flags & 1<<COMPBIT;
+			if (r != result::NO_ERROR || !compressed)
+				return r;
+
+			return readNBytesChk(filePointer, sizeof(address_t), &size);
+		}
+#endif
+
+		// Write dataSize bytes of a file's contents from data, as part of a
+		// burst. If kind has COMPBIT, data is an lzSource and they're its
+		// compressed form.
+		result burstData(address_t address, const void* data, unsigned int dataSize, uint8_t kind) {
+#if OSFS_COMPRESS
+			if (kind & 1<<COMPBIT) {
+				lzSink sink;
+				memset(&sink, 0, sizeof(sink));
+				sink.writing = true;
+				sink.address = address;
+				sink.limit = dataSize;
+				return lzCompress(*(const lzSource*)data, sink);
+			}
+#else
+			(void)kind;
+#endif
+			return burstWrite(address, dataSize, data);
+		}
+
+		// Write the contents of a file: the first copySize bytes are copied
+		// from elsewhere in the EEPROM, then dataSize bytes come from data, or
+		// are zeros if data is null, then tailSize more are copied from after
+		// the ones data replaces. kind is as for burstData. The writes are
+		// part of a burst.
+		result writeContents(address_t headerAddress, address_t copyFrom, address_t copySize,
+				const void* data, unsigned int dataSize, address_t tailSize, uint8_t kind) {
+			address_t contentsAddress = headerAddress + sizeof(fileHeader);
+
+			if (copyFrom != contentsAddress) {
+				result r = copyBytes(copyFrom, contentsAddress, copySize);
+				if (r != result::NO_ERROR)
+					return r;
+			}
+
+			result r = data ? burstData(contentsAddress + copySize, data, dataSize, kind) :
+				burstZeros(contentsAddress + copySize, dataSize);
+			if (r != result::NO_ERROR || copyFrom == contentsAddress)
+				return r;
+
+			address_t tailOffset = copySize + dataSize;
+			return copyBytes(copyFrom + tailOffset, contentsAddress + tailOffset, tailSize);
+		}
+
+#if OSFS_CRC
+		// Add num bytes of the EEPROM to a CRC, a few at a time
+		result crcBytes(address_t address, address_t num, uint16_t& crc) {
+			byte buffer[16];
+
+			while (num > 0) {
+				unsigned int chunk = num < sizeof(buffer) ? num : sizeof(buffer);
+
+				result r = readNBytesChk(address, chunk, buffer);
+				if (r != result::NO_ERROR)
+					return r;
+
+				crc = crc16(crc, buffer, chunk);
+				address += chunk;
+				num -= chunk;
+			}
+
+			return result::NO_ERROR;
+		}
+
+		// Work out the CRC which the header at the given address should hold
+		result fileCrc(address_t headerAddress, const fileHeader& header, uint16_t& crc) {
+			crc = crc16(CRC_INIT, header.fileID, FILE_NAME_LENGTH);
+			return crcBytes(headerAddress + sizeof(fileHeader), header.fileSize, crc);
+		}
+
+		// Write a file's size and CRC in one go, along with the rest of the
+		// header between them
+		inline result writeSizeAndCrc(address_t headerAddress, const fileHeader& header) {
+			return writeNBytesChk(headerAddress + offsetof(fileHeader, fileSize),
+				sizeof(fileHeader) - offsetof(fileHeader, fileSize), &header.fileSize);
+		}
+
+		// Add the dataSize bytes which burstData writes from data to a CRC
+		uint16_t crcData(uint16_t crc, const void* data, unsigned int dataSize, uint8_t kind) {
+#if OSFS_COMPRESS
+			if (kind & 1<<COMPBIT) {
+				// lzSmaller has already carried the CRC of the name on over
+				// the compressed contents, which always follow it directly
+				(void)crc;
+				return ((const lzSource*)data)->crc;
+			}
+#else
+			(void)kind;
+#endif
+			return crc16(crc, data, dataSize);
+		}
+#endif
+
+		// Set the deleted flag of the header at the given address
+		result markDeleted(address_t address) {
+			uint8_t flags;
+			result r = readNBytesChk(address + offsetof(fileHeader, flags), sizeof(uint8_t), &flags);
+			if (r != result::NO_ERROR)
+				return r;
+
+			flags |= 1<<DELBIT;
+			return writeNBytesChk(address + offsetof(fileHeader, flags), sizeof(uint8_t), &flags);
+		}
+
+		// Clear some of the flags of the header at the given address, given
+		// what they all are now. On flash, PENDBIT and BATCHBIT are cancelled
+		// instead.
+		result clearFlags(address_t address, uint8_t& flags, uint8_t clear) {
+#if OSFS_FLASH_BLOCK_SIZE > 0
+			if (clear & 1<<PENDBIT)
+				flags |= 1<<PENDDONEBIT;
+			if (clear & 1<<BATCHBIT)
+				flags |= 1<<BATCHDONEBIT;
+#else
+			flags &= ~clear;
+#endif
+			return writeNBytesChk(address + offsetof(fileHeader, flags), sizeof(uint8_t), &flags);
+		}
+
+		inline bool startsBatch(const fileHeader& header) {
+			return (header.flags & (1<<BATCHBIT)) && !(header.flags & (1<<BATCHDONEBIT));
+		}
+
+		// Point the last header in the chain at a file appended after it. A
+		// dummy header becomes a deleted file in the same write, since it
+		// isn't free once it's no longer at the end.
+		result linkAfter(address_t lastAddress, fileHeader lastHeader, address_t address) {
+			if (!isDummyHeader(lastAddress, lastHeader))
+				return writeNextFile(lastAddress, address);
+
+			lastHeader.nextFile = address;
+			lastHeader.flags = 1<<DELBIT;
+			return writeNBytesChk(lastAddress + offsetof(fileHeader, nextFile),
+				offsetof(fileHeader, flags) + sizeof(uint8_t) - offsetof(fileHeader, nextFile), &lastHeader.nextFile);
+		}
+
+		// On flash, check that nothing has been written to num bytes since
+		// they were last erased, so that a file can be written there. Anything
+		// left at the end of the chain by a power cut, or by an abandoned
+		// batch, must be erased by compact() first.
+		result checkBlank(address_t address, address_t num) {
+#if OSFS_FLASH_BLOCK_SIZE > 0
+			if (vol->blankFrom != 0 && address >= vol->blankFrom)
+				return result::NO_ERROR;
+
+			byte buffer[16];
+			while (num > 0) {
+				unsigned int chunk = num < sizeof(buffer) ? num : sizeof(buffer);
+
+				result r = readNBytesChk(address, chunk, buffer);
+				if (r != result::NO_ERROR)
+					return r;
+
+				for (unsigned int i = 0; i < chunk; i++) {
+					if (buffer[i] != 0)
+						return result::INSUFFICIENT_SPACE;
+				}
+
+				address += chunk;
+				num -= chunk;
+			}
+#else
+			(void)address;
+			(void)num;
+#endif
+			return result::NO_ERROR;
+		}
+
+		// On flash, record that num bytes at the given address have been
+		// written
+		inline void usedFlash(address_t address, address_t num) {
+#if OSFS_FLASH_BLOCK_SIZE > 0
+			if (vol->blankFrom != 0 && address + num > vol->blankFrom)
+				vol->blankFrom = address + num;
+#else
+			(void)address;
+			(void)num;
+#endif
+		}
+
+		result scanChain();
+	}
+
+#if OSFS_DIR_CACHE_SIZE > 0
+	namespace {
+
+		// The directory cache remembers where the headers of live files are, so
+		// that lookups don't have to walk the header chain in storage. Each
+		// entry keeps the whole padded name, so a hit doesn't touch storage.
+		typedef volumeState::dirCacheEntry dirCacheEntry;
+		typedef volumeState::cacheState cacheState;
+
+		void dirCacheClear() {
+			for (unsigned int i = 0; i < OSFS_DIR_CACHE_SIZE; i++)
+				vol->dirCache[i].headerAddress = 0;
+		}
+
+		void dirCacheRemove(address_t headerAddress) {
+			for (unsigned int i = 0; i < OSFS_DIR_CACHE_SIZE; i++) {
+				if (vol->dirCache[i].headerAddress == headerAddress)
+					vol->dirCache[i].headerAddress = 0;
+			}
+		}
+
+		void dirCacheResize(address_t headerAddress, address_t fileSize) {
+			for (unsigned int i = 0; i < OSFS_DIR_CACHE_SIZE; i++) {
+				if (vol->dirCache[i].headerAddress == headerAddress)
+					vol->dirCache[i].fileSize = fileSize;
+			}
+		}
+
+		void dirCacheInsert(address_t headerAddress, address_t fileSize, const char* fileID, uint8_t hash) {
+			if (vol->dirCacheState == cacheState::UNLOADED)
+				return;
+
+			// Replace any existing entry for this header, else take the first free one
+			dirCacheEntry* slot = nullptr;
+			for (unsigned int i = 0; i < OSFS_DIR_CACHE_SIZE; i++) {
+				if (vol->dirCache[i].headerAddress == headerAddress) {
+					slot = &vol->dirCache[i];
+					break;
+				}
+				if (!slot && vol->dirCache[i].headerAddress == 0)
+					slot = &vol->dirCache[i];
+			}
+
+			if (!slot) {
+				// No room: the cache can no longer vouch for misses
+				vol->dirCacheState = cacheState::PARTIAL;
+				return;
+			}
+
+			slot->headerAddress = headerAddress;
+			slot->fileSize = fileSize;
+			memcpy(slot->fileID, fileID, FILE_NAME_LENGTH);
+			slot->hash = hash;
+		}
+
+		// Look up a file in the cache. Returns false if the cache can't answer,
+		// in which case the header chain must be searched instead. Otherwise, r
+		// is set to NO_ERROR or FILE_NOT_FOUND and, if found, headerAddress and
+		// fileSize are filled.
+		bool dirCacheLookup(const paddedName& filename, result& r, address_t& headerAddress, address_t& fileSize) {
+
+			if (vol->dirCacheState == cacheState::UNLOADED && scanChain() != result::NO_ERROR)
+				return false;
+
+			for (unsigned int i = 0; i < OSFS_DIR_CACHE_SIZE; i++) {
+				const dirCacheEntry& entry = vol->dirCache[i];
+				if (entry.headerAddress != 0 && entry.hash == filename.hash &&
+						0 == strncmp(entry.fileID, filename.id, FILE_NAME_LENGTH)) {
+					r = result::NO_ERROR;
+					headerAddress = entry.headerAddress;
+					fileSize = entry.fileSize;
+					return true;
+				}
+			}
+
+			if (vol->dirCacheState == cacheState::COMPLETE) {
+				r = result::FILE_NOT_FOUND;
+				return true;
+			}
+
+			return false;
+		}
+	}
+#endif
+
+#if OSFS_DIR_INDEX_SIZE > 0
+	namespace {
+
+		// The directory index is a hash table in the EEPROM, just after the
+		// FSInfo, pointing to the header of each file. It uses open addressing:
+		// a file's slot is the first usable one at or after its home slot,
+		// wrapping around at the end of the table. Like the directory cache,
+		// it only keeps a one-byte hash of each name, and a hit is confirmed by
+		// reading the header.
+		//
+		// The header chain is always the authority. The index is updated just
+		// after each change to the chain, so a power cut can leave it behind:
+		// mount() puts that right. A search which reaches an empty slot shows
+		// that the file doesn't exist. Deleted files leave their slot marked
+		// as removed rather than empty, and slots only become empty again when
+		// the whole index is cleared, so a file which was left out because the
+		// index was full will never be ruled out by a search. It's found by
+		// walking the chain instead.
+		constexpr address_t INDEX_EMPTY = 0;
+		constexpr address_t INDEX_REMOVED = 1;
+
+		inline address_t indexSlotAddress(unsigned int slot) {
+			return storageStart() + sizeof(FSInfo) + slot * sizeof(dirIndexEntry);
+		}
+
+		inline unsigned int indexNextSlot(unsigned int slot) {
+			return (slot + 1) & (OSFS_DIR_INDEX_SIZE - 1);
+		}
+
+		// The slot at which the search for a file starts. This is a different
+		// hash from hashFilename, so that the hashes kept in the slots can tell
+		// apart files with the same home slot.
+		unsigned int indexHomeSlot(const char* paddedFilename) {
+			uint32_t hash = 2166136261UL;
+			for (unsigned int i = 0; i < FILE_NAME_LENGTH; i++)
+				hash = (hash ^ (uint8_t)paddedFilename[i]) * 16777619UL;
+			// The upper bits are the best mixed
+			return (hash >> 16) & (OSFS_DIR_INDEX_SIZE - 1);
+		}
+
+		inline result indexRead(unsigned int slot, dirIndexEntry& entry) {
+			return readNBytesChk(indexSlotAddress(slot), sizeof(dirIndexEntry), &entry);
+		}
+
+		result indexWrite(unsigned int slot, address_t headerAddress, uint8_t hash) {
+			dirIndexEntry entry;
+			memset(&entry, 0, sizeof(dirIndexEntry));
+			entry.headerAddress = headerAddress;
+			entry.hash = hash;
+			return writeNBytesChk(indexSlotAddress(slot), sizeof(dirIndexEntry), &entry);
+		}
+
+		// Empty every slot
+		result dirIndexClear() {
+			byte zeros[16] = {};
+			address_t address = indexSlotAddress(0);
+			address_t num = OSFS_DIR_INDEX_SIZE * sizeof(dirIndexEntry);
+
+			burstBegin();
+			while (num > 0) {
+				unsigned int chunk = num < sizeof(zeros) ? num : sizeof(zeros);
+				result r = burstWrite(address, chunk, zeros);
+				if (r != result::NO_ERROR)
+					return r;
+
+				address += chunk;
+				num -= chunk;
+			}
+			return burstEnd();
+		}
+
+		// Look up a file in the index. Returns false if the index can't
+		// answer, because the search went through every slot without finding
+		// the file or an empty slot. Otherwise, as dirCacheLookup.
+		bool dirIndexLookup(const paddedName& filename, result& r, address_t& headerAddress, address_t& fileSize) {
+			unsigned int slot = indexHomeSlot(filename.id);
+
+			for (unsigned int i = 0; i < OSFS_DIR_INDEX_SIZE; i++) {
+				dirIndexEntry entry;
+				r = indexRead(slot, entry);
+				if (r != result::NO_ERROR)
+					return true;
+
+				if (entry.headerAddress == INDEX_EMPTY) {
+					r = result::FILE_NOT_FOUND;
+					return true;
+				}
+
+				if (entry.headerAddress != INDEX_REMOVED && entry.hash == filename.hash) {
+					// Confirm that this isn't a hash collision
+					fileHeader header;
+					r = readNBytesChk(entry.headerAddress, sizeof(fileHeader), &header);
+					if (r != result::NO_ERROR)
+						return true;
+
+					if (!isDeletedFile(header) && 0 == strncmp(header.fileID, filename.id, FILE_NAME_LENGTH)) {
+						headerAddress = entry.headerAddress;
+						fileSize = header.fileSize;
+						return true;
+					}
+				}
+
+				slot = indexNextSlot(slot);
+			}
+
+			return false;
+		}
+
+		// Point a file's slot at a different header. oldAddress is the header
+		// it pointed to, or 0 if the file is new, and newAddress is
+		// INDEX_REMOVED if the file has been deleted. A file which isn't in the
+		// index yet is added to it if there's room.
+		result dirIndexUpdate(const char* paddedFilename, address_t oldAddress, address_t newAddress) {
+			uint8_t hash = hashFilename(paddedFilename);
+			unsigned int slot = indexHomeSlot(paddedFilename);
+			unsigned int freeSlot = OSFS_DIR_INDEX_SIZE;
+
+			for (unsigned int i = 0; i < OSFS_DIR_INDEX_SIZE; i++) {
+				dirIndexEntry entry;
+				result r = indexRead(slot, entry);
+				if (r != result::NO_ERROR)
+					return r;
+
+				if (oldAddress != 0 && entry.headerAddress == oldAddress && entry.hash == hash)
+					return indexWrite(slot, newAddress, hash);
+
+				bool usable = entry.headerAddress == INDEX_EMPTY || entry.headerAddress == INDEX_REMOVED;
+				if (usable && freeSlot == OSFS_DIR_INDEX_SIZE)
+					freeSlot = slot;
+
+				// A new file takes the first usable slot, and an existing one
+				// can't be past an empty slot
+				if (entry.headerAddress == INDEX_EMPTY || (usable && oldAddress == 0))
+					break;
+
+				slot = indexNextSlot(slot);
+			}
+
+			if (newAddress == INDEX_REMOVED || freeSlot == OSFS_DIR_INDEX_SIZE)
+				return result::NO_ERROR;
+
+			return indexWrite(freeSlot, newAddress, hash);
+		}
+
+		// Whether the header at the given address is part of the chain
+		result inChain(address_t address, bool& found) {
+			fileHeader header;
+			address_t workingAddress = firstHeaderAddress();
+			found = false;
+
+			while (workingAddress != address) {
+				result r = readWalkHeader(workingAddress, header);
+				if (r != result::NO_ERROR)
+					return r;
+
+				if (header.nextFile == 0)
+					return result::NO_ERROR;
+
+				workingAddress = header.nextFile;
+			}
+
+			found = true;
+			return result::NO_ERROR;
+		}
+
+		// Make sure that a file in the chain can be found through the index.
+		// After a power cut, its slot may be missing or may still point to a
+		// copy of its header which has since been abandoned, e.g. by compact().
+		result dirIndexCheck(address_t headerAddress, const fileHeader& header) {
+			uint8_t hash = header.hash;
+			unsigned int slot = indexHomeSlot(header.fileID);
+			unsigned int freeSlot = OSFS_DIR_INDEX_SIZE;
+
+			for (unsigned int i = 0; i < OSFS_DIR_INDEX_SIZE; i++) {
+				dirIndexEntry entry;
+				result r = indexRead(slot, entry);
+				if (r != result::NO_ERROR)
+					return r;
+
+				if (entry.headerAddress == headerAddress && entry.hash == hash)
+					return result::NO_ERROR;
+
+				if (entry.headerAddress == INDEX_EMPTY || entry.headerAddress == INDEX_REMOVED) {
+					if (freeSlot == OSFS_DIR_INDEX_SIZE)
+						freeSlot = slot;
+					if (entry.headerAddress == INDEX_EMPTY)
+						break;
+				} else if (entry.hash == hash) {
+					// Lookups will stop at another header with the same name.
+					// That's fine if it's a duplicate in the chain, left by a
+					// newFile which was cut short, but not if it's been
+					// abandoned.
+					fileHeader other;
+					r = readNBytesChk(entry.headerAddress, sizeof(fileHeader), &other);
+					if (r != result::NO_ERROR)
+						return r;
+
+					if (!isDeletedFile(other) && 0 == strncmp(other.fileID, header.fileID, FILE_NAME_LENGTH)) {
+						bool found;
+						r = inChain(entry.headerAddress, found);
+						if (r != result::NO_ERROR || found)
+							return r;
+
+						return indexWrite(slot, headerAddress, hash);
+					}
+				}
+
+				slot = indexNextSlot(slot);
+			}
+
+			if (freeSlot == OSFS_DIR_INDEX_SIZE)
+				return result::NO_ERROR;
+
+			return indexWrite(freeSlot, headerAddress, hash);
+		}
+
+		// Bring the index up to date with the chain. A power cut can leave a
+		// slot pointing at a deleted header, which is harmless until its space
+		// is reused and it no longer looks deleted, so those slots are marked
+		// as removed. If tidy is set and more than a quarter of the slots are
+		// marked as removed, which makes searches for missing files slow, the
+		// index is cleared and rebuilt. Until that's finished, files may be
+		// missing from the index.
+		result dirIndexRecover(bool tidy) {
+			unsigned int removed = 0;
+			for (unsigned int slot = 0; slot < OSFS_DIR_INDEX_SIZE; slot += 4) {
+				dirIndexEntry entries[4];
+				unsigned int count = OSFS_DIR_INDEX_SIZE < 4 ? OSFS_DIR_INDEX_SIZE : 4;
+				result r = readNBytesChk(indexSlotAddress(slot), count * sizeof(dirIndexEntry), entries);
+				if (r != result::NO_ERROR)
+					return r;
+
+				for (unsigned int i = 0; i < count; i++) {
+					if (entries[i].headerAddress != INDEX_EMPTY && entries[i].headerAddress != INDEX_REMOVED) {
+						fileHeader header;
+						r = readNBytesChk(entries[i].headerAddress, sizeof(fileHeader), &header);
+						if (r == result::NO_ERROR && isDeletedFile(header)) {
+							r = indexWrite(slot + i, INDEX_REMOVED, entries[i].hash);
+							entries[i].headerAddress = INDEX_REMOVED;
+						}
+						if (r != result::NO_ERROR)
+							return r;
+					}
+
+					if (entries[i].headerAddress == INDEX_REMOVED)
+						removed++;
+				}
+			}
+
+			if (tidy && removed > OSFS_DIR_INDEX_SIZE / 4) {
+				result r = dirIndexClear();
+				if (r != result::NO_ERROR)
+					return r;
+			}
+
+			fileHeader workingHeader;
+			address_t workingAddress = firstHeaderAddress();
+
+			while (true) {
+				result r = readNBytesChk(workingAddress, sizeof(fileHeader), &workingHeader);
+				if (r != result::NO_ERROR)
+					return r;
+
+				if (!isDeletedFile(workingHeader) && !isDummyHeader(workingAddress, workingHeader)) {
+					r = dirIndexCheck(workingAddress, workingHeader);
+					if (r != result::NO_ERROR)
+						return r;
+				}
+
+				if (workingHeader.nextFile == 0)
+					return result::NO_ERROR;
+
+				workingAddress = workingHeader.nextFile;
+			}
+		}
+	}
+#endif
+
+#if OSFS_FREE_INDEX_SIZE > 0
+	namespace {
+
+		// The free index remembers where the deleted files are, so that newFile
+		// can choose a slot without searching the chain. It's loaded along with
+		// the directory cache but only used while mounted. Deleted headers stay
+		// in storage, so nothing extra is written to persist it: mount()
+		// rebuilds it from them.
+		//
+		// Each entry covers a whole run of neighbouring deleted headers, whether
+		// or not they've been merged in storage yet, so newFile merges a run
+		// before writing anything inside it.
+		typedef volumeState::freeIndexEntry freeIndexEntry;
+
+		void freeIndexClear() {
+			for (unsigned int i = 0; i < OSFS_FREE_INDEX_SIZE; i++)
+				vol->freeIndex[i].address = 0;
+			vol->freeIndexOverflowed = false;
+		}
+
+		void freeIndexRemove(address_t address) {
+			for (unsigned int i = 0; i < OSFS_FREE_INDEX_SIZE; i++) {
+				if (vol->freeIndex[i].address == address)
+					vol->freeIndex[i].address = 0;
+			}
+		}
+
+		void freeIndexInsert(address_t address, address_t nextFile) {
+			// Replace any existing entry for this header, else take the first free one
+			freeIndexEntry* slot = nullptr;
+			for (unsigned int i = 0; i < OSFS_FREE_INDEX_SIZE; i++) {
+				if (vol->freeIndex[i].address == address) {
+					slot = &vol->freeIndex[i];
+					break;
+				}
+				if (!slot && vol->freeIndex[i].address == 0)
+					slot = &vol->freeIndex[i];
+			}
+
+			if (!slot) {
+				vol->freeIndexOverflowed = true;
+				return;
+			}
+
+			slot->address = address;
+			slot->nextFile = nextFile;
+		}
+
+		// A deleted header has been merged into the one before it in storage,
+		// so it no longer starts or ends a run of its own
+		void freeIndexMerged(address_t address, address_t nextFile) {
+			for (unsigned int i = 0; i < OSFS_FREE_INDEX_SIZE; i++) {
+				if (vol->freeIndex[i].address == address)
+					vol->freeIndex[i].address = 0;
+				else if (vol->freeIndex[i].address != 0 && vol->freeIndex[i].nextFile == address)
+					vol->freeIndex[i].nextFile = nextFile;
+			}
+		}
+
+		// Add a newly deleted header, joining it to any runs on either side.
+		// Returns the number of runs it was joined to.
+		uint8_t freeIndexAdd(address_t address, address_t nextFile) {
+			freeIndexEntry* before = nullptr;
+			freeIndexEntry* after = nullptr;
+			for (unsigned int i = 0; i < OSFS_FREE_INDEX_SIZE; i++) {
+				if (vol->freeIndex[i].address == 0)
+					continue;
+				if (vol->freeIndex[i].nextFile == address)
+					before = &vol->freeIndex[i];
+				if (nextFile != 0 && vol->freeIndex[i].address == nextFile)
+					after = &vol->freeIndex[i];
+			}
+
+			uint8_t joined = 0;
+			if (after) {
+				nextFile = after->nextFile;
+				after->address = 0;
+				joined++;
+			}
+
+			if (before) {
+				before->nextFile = nextFile;
+				joined++;
+			} else {
+				freeIndexInsert(address, nextFile);
+			}
+
+			return joined;
+		}
+	}
+#endif
+
+	namespace {
+
+		// Whether we know where every free slot is without searching the chain
+		inline bool freeSlotsKnown() {
+			if (!vol->session.mounted)
+				return false;
+#if OSFS_FREE_INDEX_SIZE > 0
+			return vol->session.holes == 0 || !vol->freeIndexOverflowed;
+#else
+			return vol->session.holes == 0;
+#endif
+		}
+
+		// Look up a file without walking the header chain, through the
+		// directory cache or the directory index. Returns false if neither of
+		// them can answer, otherwise as dirCacheLookup.
+		inline bool quickLookup(const paddedName& filename, result& r, address_t& headerAddress, address_t& fileSize) {
+#if OSFS_DIR_CACHE_SIZE > 0
+			if (dirCacheLookup(filename, r, headerAddress, fileSize))
+				return true;
+#endif
+#if OSFS_DIR_INDEX_SIZE > 0
+			if (dirIndexLookup(filename, r, headerAddress, fileSize))
+				return true;
+#endif
+#if OSFS_DIR_CACHE_SIZE == 0 && OSFS_DIR_INDEX_SIZE == 0
+			(void)filename;
+			(void)r;
+			(void)headerAddress;
+			(void)fileSize;
+#endif
+			return false;
+		}
+
+		// Forget everything remembered about the header chain
+		void forgetChain() {
+#if OSFS_DIR_CACHE_SIZE > 0
+			vol->dirCacheState = cacheState::UNLOADED;
+#endif
+#if OSFS_FREE_INDEX_SIZE > 0
+			vol->freeIndexOverflowed = true;
+#endif
+		}
+
+		// Walk the whole header chain once, loading the directory cache, the
+		// free index and the session's record of the end of the chain
+		result scanChain() {
+#if OSFS_DIR_CACHE_SIZE > 0
+			dirCacheClear();
+			vol->dirCacheState = cacheState::COMPLETE;
+#endif
+#if OSFS_FREE_INDEX_SIZE > 0
+			freeIndexClear();
+#endif
+			vol->session.holes = 0;
+
+			fileHeader workingHeader;
+			address_t workingAddress = firstHeaderAddress();
+			address_t runStart = 0; // Start of the current run of deleted headers
+
+			while (true) {
+#if OSFS_DIR_CACHE_SIZE > 0
+				// The cache keeps the names of live files, so read whole headers
+				result r = readNBytesChk(workingAddress, sizeof(fileHeader), &workingHeader);
+#else
+				result r = readWalkHeader(workingAddress, workingHeader);
+#endif
+
+				if (r != result::NO_ERROR) {
+					forgetChain();
+					return r;
+				}
+
+				if (isDeletedFile(workingHeader)) {
+					if (runStart == 0) {
+						runStart = workingAddress;
+						vol->session.holes++;
+					}
+#if OSFS_FREE_INDEX_SIZE > 0
+					freeIndexInsert(runStart, workingHeader.nextFile);
+#endif
+				} else {
+					runStart = 0;
+#if OSFS_DIR_CACHE_SIZE > 0
+					dirCacheInsert(workingAddress, workingHeader.fileSize, workingHeader.fileID, workingHeader.hash);
+#endif
+				}
+
+				if (workingHeader.nextFile == 0) {
+					vol->session.lastHeader = workingAddress;
+					vol->session.chainEnd = appendAddress(workingAddress, workingHeader);
+					return result::NO_ERROR;
+				}
+
+				workingAddress = workingHeader.nextFile;
+			}
+		}
+
+		// Delete any live file with the given name, and its hash, before the
+		// given address in the chain
+		result deleteEarlierCopies(const char* paddedFilename, uint8_t hash, address_t before) {
+			fileHeader workingHeader;
+			address_t workingAddress = firstHeaderAddress();
+
+			while (workingAddress != before) {
+				result r = readWalkHeader(workingAddress, workingHeader, hash);
+				if (r != result::NO_ERROR)
+					return r;
+
+				if (!isDeletedFile(workingHeader) &&
+						0 == strncmp(workingHeader.fileID, paddedFilename, FILE_NAME_LENGTH)) {
+					r = markDeleted(workingAddress);
+					if (r != result::NO_ERROR)
+						return r;
+				}
+
+				if (workingHeader.nextFile == 0)
+					break;
+
+				workingAddress = workingHeader.nextFile;
+			}
+
+			return result::NO_ERROR;
+		}
+
+		// Finish or undo a batch which was cut short by a power cut. Nothing
+		// can have been added to the chain since, so the batch is the rest of
+		// the chain from its first file. If that's still pending, the batch
+		// never took effect and all of it is deleted. Otherwise the files it
+		// replaces are deleted. See commit().
+		result recoverBatch(address_t batchAddress, const fileHeader& batchHeader) {
+			bool committed = !isPendingFile(batchHeader);
+			fileHeader workingHeader;
+			address_t workingAddress = batchAddress;
+
+			while (workingAddress != 0) {
+				result r = readNBytesChk(workingAddress, sizeof(fileHeader), &workingHeader);
+				if (r != result::NO_ERROR)
+					return r;
+
+				if (!committed)
+					r = markDeleted(workingAddress);
+				else if (!isDeletedFile(workingHeader))
+					r = deleteEarlierCopies(workingHeader.fileID, workingHeader.hash, batchAddress);
+				if (r != result::NO_ERROR)
+					return r;
+
+				workingAddress = workingHeader.nextFile;
+			}
+
+			uint8_t flags = batchHeader.flags;
+			if (!committed)
+				flags |= 1<<DELBIT;
+			return clearFlags(batchAddress, flags, 1<<PENDBIT | 1<<BATCHBIT);
+		}
+
+		// Deal with anything left unfinished by a power cut. A file which was
+		// replacing another is still marked as pending: if the original is
+		// still there, the replacement never took effect and is deleted.
+		// Otherwise it's complete and the mark is cleared. The same goes for
+		// a batch of files, all together. Then the directory index is brought
+		// up to date, tidying it if tidy is set.
+		result recover(bool tidy) {
+			fileHeader workingHeader;
+			address_t workingAddress = firstHeaderAddress();
+
+			while (true) {
+				result r = readWalkHeader(workingAddress, workingHeader);
+				if (r != result::NO_ERROR)
+					return r;
+
+				if (startsBatch(workingHeader)) {
+					r = recoverBatch(workingAddress, workingHeader);
+					if (r != result::NO_ERROR)
+						return r;
+				} else if (isPendingFile(workingHeader) && !isDeletedFile(workingHeader)) {
+					r = readNBytesChk(workingAddress, FILE_NAME_LENGTH, workingHeader.fileID);
+					if (r != result::NO_ERROR)
+						return r;
+
+					// Look for the original. The hash comes after the flags,
+					// so the power cut may have stopped it from being written.
+					// It's worked out from the name instead.
+					bool originalFound = false;
+					uint8_t nameHash = hashFilename(workingHeader.fileID);
+					fileHeader otherHeader;
+					address_t otherAddress = firstHeaderAddress();
+
+					while (!originalFound) {
+						r = readWalkHeader(otherAddress, otherHeader, nameHash);
+						if (r != result::NO_ERROR)
+							return r;
+
+						originalFound = otherAddress != workingAddress &&
+							!isDeletedFile(otherHeader) && !isPendingFile(otherHeader) &&
+							0 == strncmp(otherHeader.fileID, workingHeader.fileID, FILE_NAME_LENGTH);
+
+						if (otherHeader.nextFile == 0)
+							break;
+						otherAddress = otherHeader.nextFile;
+					}
+
+					uint8_t flags = workingHeader.flags;
+					if (originalFound)
+						flags |= 1<<DELBIT;
+
+					r = clearFlags(workingAddress, flags, 1<<PENDBIT);
+					if (r != result::NO_ERROR)
+						return r;
+				}
+
+				if (workingHeader.nextFile == 0)
+					break;
+
+				workingAddress = workingHeader.nextFile;
+			}
+
+#if OSFS_DIR_INDEX_SIZE > 0
+			result r = dirIndexRecover(tidy);
+			if (r != result::NO_ERROR)
+				return r;
+#else
+			(void)tidy;
+#endif
+
+			vol->recovered = true;
+			return result::NO_ERROR;
+		}
+	}
+
+	result mount() {
+		vol->session.mounted = false;
+
+		result r = checkLibVersion();
+
+		if (r != result::NO_ERROR)
+			return r;
+
+		r = recover(true);
+
+		if (r != result::NO_ERROR)
+			return r;
+
+		r = scanChain();
+
+		if (r != result::NO_ERROR)
+			return r;
+
+		vol->session.mounted = true;
+
+		// Carry on from the end of the chain, since we can't know where the
+		// last session left off
+		if (vol->allocation == allocPolicy::WEAR_LEVELING)
+			vol->allocCursor = vol->session.chainEnd;
+
+		return result::NO_ERROR;
+	}
+
+	void unmount() {
+		sync();
+		vol->session.mounted = false;
+	}
+
+	bool isMounted() {
+		return vol->session.mounted;
+	}
+
+	void setAllocPolicy(allocPolicy policy) {
+		vol->allocation = policy;
+		vol->allocCursor = 0;
+	}
+
+	void setOverwriteInPlace(bool allow) {
+		vol->overwriteInPlace = allow;
+	}
+
+	const uint32_t* getWearHistogram() {
+#if OSFS_WEAR_BUCKETS > 0
+		return vol->wearHistogram;
+#else
+		return nullptr;
+#endif
+	}
+
+	void clearWearHistogram() {
+#if OSFS_WEAR_BUCKETS > 0
+		for (unsigned int i = 0; i < OSFS_WEAR_BUCKETS; i++)
+			vol->wearHistogram[i] = 0;
+#endif
+	}
+
+	result sync() {
+#if OSFS_CACHE_PAGES > 0
+		cacheFlush(vol->cacheDirtyCount);
+#endif
+		return result::NO_ERROR;
+	}
+
+	cacheStats getCacheStats() {
+#if OSFS_CACHE_PAGES > 0
+		return vol->cacheCounts;
+#else
+		return cacheStats{};
+#endif
+	}
+
+	void clearCacheStats() {
+#if OSFS_CACHE_PAGES > 0
+		vol->cacheCounts = {};
+#endif
+	}
+
+	opStats getOpStats() {
+#if OSFS_INSTRUMENT
+		return vol->opCounts;
+#else
+		return opStats{};
+#endif
+	}
+
+	void clearOpStats() {
+#if OSFS_INSTRUMENT
+		vol->opCounts = {};
+#endif
+	}
+
+	void setTraceCallback(traceCallback callback) {
+#if OSFS_INSTRUMENT
+		vol->tracer = callback;
+#else
+		(void)callback;
+#endif
+	}
+
+	void invalidateDirCache() {
+		forgetChain();
+		vol->recovered = false;
+		abortBatch();
+#if OSFS_FLASH_BLOCK_SIZE > 0
+		vol->flashBaseKnown = false;
+		vol->blankFrom = 0;
+#endif
+#if OSFS_CACHE_PAGES > 0
+		cacheDrop();
+#endif
+	}
+
+	result getFileInfo(const paddedName& filename, address_t& filePointer, address_t& fileSize) {
+
+		// Confirm that the EEPROM is managed by this version of OSFS
+		result r = checkSession();
+
+		if (r != result::NO_ERROR)
+			return r;
+
+		// Try the directory cache and index first
+		address_t knownHeader;
+		if (quickLookup(filename, r, knownHeader, fileSize)) {
+			if (r == result::NO_ERROR)
+				filePointer = knownHeader + sizeof(fileHeader);
+			return r;
+		}
+
+		// Search the header chain, starting from the first file header
+		fileHeader workingHeader;
+		address_t workingAddress = firstHeaderAddress();
+#if OSFS_INSTRUMENT
+		vol->opCounts.lookups++;
+#endif
+
+		// Loop through checking the file header until
+		// 	a) we reach a NULL pointer,
+		// 	b) we find a deleted file that can be overwritten
+		// 	c) we get an OOL pointer somehow
+		while (true) {
+
+			// Load the next header, with its name only if the hash matches
+			result r = readWalkHeader(workingAddress, workingHeader, filename.hash);
+#if OSFS_INSTRUMENT
+			vol->opCounts.chainHops++;
+#endif
+
+			// Quit if we're out of bounds
+			if (r != result::NO_ERROR)
+				return r;
+
+			// Is this the right file? Deleted files don't count.
+			if (!isDeletedFile(workingHeader) && 0 == strncmp(workingHeader.fileID, filename.id, FILE_NAME_LENGTH)) {
+				// We found it! Load the data into the receiving variables
+				filePointer = workingAddress + sizeof(fileHeader);
+				fileSize = workingHeader.fileSize;
+
+				return result::NO_ERROR;
+			}
+
+			// If there's no next file
+			if (workingHeader.nextFile == 0) {
+
+				return result::FILE_NOT_FOUND;
+			}
+
+			// Keep going
+			workingAddress = workingHeader.nextFile;
+		}
+
+		return result::UNDEFINED_ERROR;
+	}
+
+	result verifyContents(address_t filePointer, const void* contents, address_t size) {
+#if OSFS_CRC
+		fileHeader header;
+		result r = readNBytesChk(filePointer - sizeof(fileHeader), sizeof(fileHeader), &header);
+		if (r != result::NO_ERROR)
+			return r;
+
+		// A log's CRC isn't kept up to date
+		if (header.flags & 1<<LOGBIT)
+			return result::NO_ERROR;
+
+		uint16_t crc = crc16(CRC_INIT, header.fileID, FILE_NAME_LENGTH);
+#if OSFS_COMPRESS
+		// The CRC is of compressed contents as they're stored, so they're
+		// read back
+		if (header.flags & 1<<COMPBIT)
+			r = crcBytes(filePointer, header.fileSize, crc);
+		else
+#endif
+			crc = crc16(crc, contents, size);
+		if (r != result::NO_ERROR)
+			return r;
+		if (crc != header.crc)
+			return result::CORRUPT_FILE;
+#else
+		(void)filePointer;
+		(void)contents;
+		(void)size;
+#endif
+		return result::NO_ERROR;
+	}
+
+	result getFile(const paddedName& filename, void* buf, unsigned int size, bool verify) {
+		address_t add, storedSize;
+		result r = getFileInfo(filename, add, storedSize);
+
+		if (r != result::NO_ERROR)
+			return r;
+
+#if OSFS_COMPRESS
+		bool compressed;
+		address_t uncompressedSize;
+		r = lzFileSize(add, compressed, uncompressedSize);
+		if (r != result::NO_ERROR)
+			return r;
+
+		if (compressed) {
+			if (size != uncompressedSize)
+				return result::BUFFER_WRONG_SIZE;
+
+			lzDecoder decoder;
+			lzStart(decoder, add);
+			r = lzUncompress(decoder, add + storedSize, 0, buf, size);
+		} else
+#endif
+		{
+			if (size != storedSize)
+				return result::BUFFER_WRONG_SIZE;
+
+			r = readNBytesChk(add, size, buf);
+		}
+
+		if (r != result::NO_ERROR || !verify)
+			return r;
+
+		return verifyContents(add, buf, size);
+	}
+
+	// Store a file, as newFile does. Its contents are the copySize bytes
+	// at copyFrom in the EEPROM followed by dataSize bytes of data, so that
+	// a File can be moved along with new data. On flash, where a File can't
+	// be changed where it is, tailSize more bytes are copied from after the
+	// ones data replaces. If data is null, dataSize zeros are stored instead.
+	// kind holds any flags which the file keeps for good, i.e. LOGBIT or
+	// COMPBIT, in which case data is as for burstData. On success,
+	// headerAddress is set to the location of the file's header.
+	static result storeFile(const paddedName& filename, address_t copyFrom, address_t copySize,
+			const void* data, unsigned int dataSize, bool overwrite, address_t& headerAddress,
+			address_t tailSize = 0, uint8_t kind = 0) {
+
+		address_t size = copySize + dataSize + tailSize;
+
+		// Header for new file. Clear it so that any padding is written as zeros
+		fileHeader newHeader;
+		memset(&newHeader, 0, sizeof(fileHeader));
+
+		// Store padded filename and its hash in newHeader
+		memcpy(newHeader.fileID, filename.id, FILE_NAME_LENGTH);
+		newHeader.hash = filename.hash;
+
+		// Confirm that the EEPROM is managed by this version of OSFS
+		result r = checkSession();
+
+		if (r != result::NO_ERROR)
+			return r;
+
+#if OSFS_CRC
+		// Any contents being copied are read now, before anything can
+		// overwrite them
+		newHeader.crc = crc16(CRC_INIT, newHeader.fileID, FILE_NAME_LENGTH);
+		r = crcBytes(copyFrom, copySize, newHeader.crc);
+		if (r != result::NO_ERROR)
+			return r;
+		if (data)
+			newHeader.crc = crcData(newHeader.crc, data, dataSize, kind);
+		r = crcBytes(copyFrom + copySize + dataSize, tailSize, newHeader.crc);
+		if (r != result::NO_ERROR)
+			return r;
+#endif
+
+		// It is! Now work out where to put the file
+		address_t sizeRequired = sizeof(fileHeader) + size;
+
+		// Everything we need to know about the chain is gathered in a single
+		// pass:
+		// 	a) the header of an existing file with this name, if any
+		// 	b) the first free slot which is large enough for the new file
+		// 	c) failing that, the last header in the chain, to append after
+		// A free slot is a deleted file or the dummy header.
+		//
+		// Which free slot is chosen depends on the allocation policy: see
+		// preferSlot. Files are only overwritten in place if
+		// setOverwriteInPlace() allows it, since a power cut part way through
+		// would leave a mixture of the old and new contents. When wear
+		// leveling, the first free slot after allocCursor is preferred, then
+		// the end of the chain, then the first free slot before allocCursor.
+		// If overwriting in place is allowed, the slot of the file being
+		// overwritten counts as free, as a last resort.
+		bool wearLeveling = (vol->allocation == allocPolicy::WEAR_LEVELING);
+		bool mayOverwrite = !flashMode && vol->overwriteInPlace;
+#if OSFS_INSTRUMENT
+		vol->opCounts.allocations++;
+#endif
+
+		fileHeader workingHeader;
+		address_t workingAddress = firstHeaderAddress();
+		address_t previousAddress = 0;
+		bool previousDeleted = false;
+
+		address_t existingAddress = 0;
+		address_t existingSize = 0;
+		address_t existingNext = 0;
+		bool existenceKnown = false;
+
+		address_t writeAddress = 0;
+		address_t nextAddress = 0;
+		bool inPlace = false;
+		bool reusingHole = false;
+		bool appending = false;
+#if OSFS_FREE_INDEX_SIZE > 0
+		bool fromFreeIndex = false;
+#endif
+
+		address_t lastAddress = 0;
+		address_t appendAt = 0;
+
+		// The directory cache or index might already know whether the file
+		// exists
+		if (quickLookup(filename, r, existingAddress, existingSize)) {
+			if (r == result::FILE_NOT_FOUND)
+				existingAddress = 0;
+			else if (r != result::NO_ERROR)
+				return r;
+			else if (!overwrite)
+				return result::FILE_ALREADY_EXISTS;
+
+			existenceKnown = true;
+		}
+
+		// If so, see if the new contents fit in its space
+		if (existingAddress != 0) {
+			r = readNBytesChk(existingAddress, sizeof(fileHeader), &workingHeader);
+			if (r != result::NO_ERROR)
+				return r;
+
+			existingNext = workingHeader.nextFile;
+			inPlace = mayOverwrite && !wearLeveling && slotSize(existingAddress, existingNext) >= sizeRequired &&
+				(workingHeader.flags & KIND_BITS) == kind;
+		}
+
+		if (inPlace) {
+			// There's nothing else to find
+		} else if (existenceKnown && freeSlotsKnown()) {
+			// We already know where all the free slots and the end of the
+			// chain are, so there's no need to search
+#if OSFS_FREE_INDEX_SIZE > 0
+			for (unsigned int i = 0; i < OSFS_FREE_INDEX_SIZE; i++) {
+				if (vol->freeIndex[i].address != 0)
+					considerSlot(vol->freeIndex[i].address, vol->freeIndex[i].nextFile, true, sizeRequired,
+						writeAddress, nextAddress, reusingHole);
+			}
+			fromFreeIndex = reusingHole;
+#endif
+
+			if (wearLeveling && mayOverwrite && existingAddress != 0)
+				considerSlot(existingAddress, existingNext, false, sizeRequired, writeAddress, nextAddress, reusingHole);
+
+			lastAddress = vol->session.lastHeader;
+			appendAt = vol->session.chainEnd;
+		} else {
+#if OSFS_INSTRUMENT
+			vol->opCounts.lookups++;
+#endif
+			while (true) {
+
+				// Load the next header, with its name only if the hash matches
+				// and the file hasn't been found already
+				r = readWalkHeader(workingAddress, workingHeader, existingAddress == 0 ? newHeader.hash : NO_NAME);
+#if OSFS_INSTRUMENT
+				vol->opCounts.chainHops++;
+#endif
+
+				// Quit if we're out of bounds
+				if (r != result::NO_ERROR)
+					return r;
+
+				bool isDeleted = isDeletedFile(workingHeader);
+
+				// If this and the previous file are both deleted, merge them
+				// into one larger free slot and carry on from the previous one
+				if (previousDeleted && isDeleted && !flashMode) {
+					r = writeNextFile(previousAddress, workingHeader.nextFile);
+					if (r != result::NO_ERROR)
+						return r;
+
+#if OSFS_FREE_INDEX_SIZE > 0
+					freeIndexMerged(workingAddress, workingHeader.nextFile);
+#endif
+					workingAddress = previousAddress;
+				}
+
+				// A run of deleted files is only considered as a free slot once
+				// we know where it ends
+				if (previousDeleted && !isDeleted)
+					considerSlot(previousAddress, workingAddress, true, sizeRequired, writeAddress, nextAddress, reusingHole);
+
+				bool isFree = isDeleted || isDummyHeader(workingAddress, workingHeader);
+
+				// Is this the file we're looking for?
+				if (!isFree && existingAddress == 0 &&
+						0 == strncmp(workingHeader.fileID, newHeader.fileID, FILE_NAME_LENGTH)) {
+					if (!overwrite)
+						return result::FILE_ALREADY_EXISTS;
+
+					existingAddress = workingAddress;
+					existingSize = workingHeader.fileSize;
+					existingNext = workingHeader.nextFile;
+					existenceKnown = true;
+
+					// If the new contents fit in its space, and it's the same
+					// kind of file, that's where they go
+					if (mayOverwrite && !wearLeveling && slotSize(workingAddress, workingHeader.nextFile) >= sizeRequired &&
+							(workingHeader.flags & KIND_BITS) == kind) {
+						inPlace = true;
+						break;
+					}
+				}
+
+				if (workingAddress == existingAddress && wearLeveling && mayOverwrite)
+					isFree = true;
+
+				if (isFree && (!isDeleted || workingHeader.nextFile == 0))
+					considerSlot(workingAddress, workingHeader.nextFile, isDeleted, sizeRequired,
+						writeAddress, nextAddress, reusingHole);
+
+				// If there's no next file, calculate the start of the spare space and break the loop
+				if (workingHeader.nextFile == 0) {
+					lastAddress = workingAddress;
+					appendAt = appendAddress(workingAddress, workingHeader);
+					break;
+				}
+
+				// If we've found both the file and somewhere to put it, we're done
+				if (existenceKnown && writeAddress != 0 && goodEnoughSlot(writeAddress, nextAddress, sizeRequired))
+					break;
+
+				// Continue the search
+				previousAddress = workingAddress;
+				previousDeleted = isDeleted;
+				workingAddress = workingHeader.nextFile;
+			}
+		}
+
+		if (inPlace) {
+			// Overwrite the contents of the existing file, then its size if
+			// that changed. Nothing else about the chain needs to change.
+			burstBegin();
+			r = writeContents(existingAddress, copyFrom, copySize, data, dataSize, tailSize, kind);
+			if (r == result::NO_ERROR)
+				r = burstEnd();
+			if (r != result::NO_ERROR)
+				return r;
+
+#if OSFS_CRC
+			// The size is written along with the CRC. Since they're written
+			// last, a power cut part way through shows up as a corrupt file.
+			// workingHeader still holds the existing header.
+			workingHeader.fileSize = size;
+			workingHeader.crc = newHeader.crc;
+			r = writeSizeAndCrc(existingAddress, workingHeader);
+			if (r != result::NO_ERROR)
+				return r;
+#else
+			if (size != existingSize) {
+				address_t newSize = size;
+				r = writeNBytesChk(existingAddress + offsetof(fileHeader, fileSize), sizeof(address_t), &newSize);
+				if (r != result::NO_ERROR)
+					return r;
+			}
+#endif
+
+			if (size != existingSize && vol->session.mounted && existingAddress == vol->session.lastHeader)
+				vol->session.chainEnd = existingAddress + sizeRequired;
+
+#if OSFS_DIR_CACHE_SIZE > 0
+			dirCacheInsert(existingAddress, size, newHeader.fileID, newHeader.hash);
+#endif
+
+			headerAddress = existingAddress;
+			return result::NO_ERROR;
+		}
+
+		// When wear leveling, appending is preferred over going back to a slot
+		// before the cursor
+		if (writeAddress != 0 && writeAddress < vol->allocCursor &&
+				appendAt != lastAddress && appendAt + sizeRequired <= endOfFiles()) {
+			writeAddress = 0;
+			reusingHole = false;
+		}
+
+		// If no free slot was found, append the file to the end of the chain.
+		// If the last header is free itself then it was already considered
+		// above, so it's too small.
+		if (writeAddress == 0) {
+			if (appendAt + sizeRequired > endOfFiles())
+				return result::INSUFFICIENT_SPACE;
+
+			writeAddress = appendAt;
+			nextAddress = 0;
+			appending = (appendAt != lastAddress);
+		}
+
+		if (wearLeveling)
+			vol->allocCursor = writeAddress + sizeRequired;
+
+#if OSFS_FREE_INDEX_SIZE > 0
+		// A run of deleted files from the free index might not be merged in
+		// storage yet, in which case the headers inside it are still part of
+		// the chain. Merge it before anything is written over them.
+		if (fromFreeIndex) {
+			address_t storedNext;
+			r = readNBytesChk(writeAddress + offsetof(fileHeader, nextFile), sizeof(address_t), &storedNext);
+			if (r == result::NO_ERROR && storedNext != nextAddress)
+				r = writeNextFile(writeAddress, nextAddress);
+			if (r != result::NO_ERROR)
+				return r;
+		}
+#endif
+
+		// A header can take more than one write, so a power cut part way
+		// through writing one over a free slot mustn't leave it looking like
+		// a file. A deleted file keeps its flags until the new ones are
+		// written, but the dummy header is live, so it's deleted first.
+		if (!reusingHole) {
+			r = hideDummyHeader(writeAddress);
+			if (r != result::NO_ERROR)
+				return r;
+		}
+
+		// If we're reusing a free slot which is larger than we need, split the
+		// rest of it off into a new free slot so that it can be reused too.
+		// The new free slot is linked in before the new header is written,
+		// so that the link in the slot's header stays the same while the rest
+		// of it changes.
+		bool splitting = nextAddress != 0 && address_t(nextAddress - (writeAddress + sizeRequired)) > sizeof(fileHeader);
+#if OSFS_FREE_INDEX_SIZE > 0
+		address_t remainderNext = nextAddress;
+#endif
+		if (splitting) {
+			fileHeader remainderHeader;
+			memset(&remainderHeader, 0, sizeof(fileHeader));
+			padFilename("", remainderHeader.fileID);
+			remainderHeader.hash = hashFilename(remainderHeader.fileID);
+			remainderHeader.nextFile = nextAddress;
+			remainderHeader.flags = 1<<DELBIT;
+
+			nextAddress = writeAddress + sizeRequired;
+			r = writeNBytesChk(nextAddress, sizeof(fileHeader), &remainderHeader);
+			if (r == result::NO_ERROR)
+				r = writeNextFile(writeAddress, nextAddress);
+			if (r != result::NO_ERROR)
+				return r;
+		}
+
+		// Construct a header for this file
+		newHeader.fileSize = size;
+		newHeader.nextFile = nextAddress;
+		newHeader.flags = kind;
+
+		// The new file mustn't be seen until it's complete. A replacement is
+		// marked as pending until the original has been deleted, which is the
+		// moment it takes effect: see recover(). A new file written over free
+		// space in the chain is marked as deleted until it's complete. An
+		// appended file needs neither, since it's only linked in at the end.
+		bool deletedExisting = existingAddress != 0 && existingAddress != writeAddress;
+		if (deletedExisting)
+			newHeader.flags |= 1<<PENDBIT;
+		else if (existingAddress == 0 && !appending)
+			newHeader.flags |= 1<<DELBIT;
+
+		r = checkBlank(writeAddress, sizeRequired);
+		if (r != result::NO_ERROR)
+			return r;
+
+		// Write the header and the data, combined into as few writes as
+		// possible
+		burstBegin();
+		r = burstWrite(writeAddress, sizeof(fileHeader), &newHeader);
+		if (r == result::NO_ERROR)
+			r = writeContents(writeAddress, copyFrom, copySize, data, dataSize, tailSize, kind);
+		if (r == result::NO_ERROR)
+			r = burstEnd();
+		if (r != result::NO_ERROR)
+			return r;
+
+		usedFlash(writeAddress, sizeRequired);
+
+		// If the file was appended after the last header, alter the last
+		// header to point to it. This is done last so that the new file only
+		// becomes part of the chain once it's complete.
+		// On flash, where the dummy header isn't reused, that could be it.
+		if (appending) {
+			fileHeader lastHeader = {};
+			if (flashMode && lastAddress == firstHeaderAddress())
+				r = readNBytesChk(lastAddress, sizeof(fileHeader), &lastHeader);
+			if (r == result::NO_ERROR)
+				r = linkAfter(lastAddress, lastHeader, writeAddress);
+			if (r != result::NO_ERROR)
+				return r;
+		}
+
+		// If we're replacing a file, delete the original now that the new one
+		// is in place
+		if (deletedExisting) {
+			r = markDeleted(existingAddress);
+			if (r != result::NO_ERROR)
+				return r;
+		}
+
+		// Then the new file is complete. This is the only write which a new
+		// file costs on top of its header and contents.
+		if (newHeader.flags & (1<<PENDBIT | 1<<DELBIT)) {
+			r = clearFlags(writeAddress, newHeader.flags, 1<<PENDBIT | 1<<DELBIT);
+			if (r != result::NO_ERROR)
+				return r;
+		}
+
+#if OSFS_DIR_INDEX_SIZE > 0
+		// A power cut before this leaves the index out of date, which recover()
+		// puts right
+		if (existingAddress != writeAddress) {
+			r = dirIndexUpdate(newHeader.fileID, existingAddress, writeAddress);
+			if (r != result::NO_ERROR)
+				return r;
+		}
+#endif
+
+#if OSFS_FREE_INDEX_SIZE > 0
+		// The original's slot now runs up to the new file if that was appended
+		// after it, and either slot left free may join the runs around it
+		uint8_t joined = 0;
+		if (appending && lastAddress == existingAddress)
+			existingNext = writeAddress;
+		if (reusingHole)
+			freeIndexRemove(writeAddress);
+		if (splitting)
+			joined += freeIndexAdd(newHeader.nextFile, remainderNext);
+		if (deletedExisting)
+			joined += freeIndexAdd(existingAddress, existingNext);
+#endif
+
+		if (vol->session.mounted) {
+			if (reusingHole)
+				vol->session.holes--;
+			if (splitting)
+				vol->session.holes++;
+			if (deletedExisting)
+				vol->session.holes++;
+#if OSFS_FREE_INDEX_SIZE > 0
+			vol->session.holes -= joined;
+#endif
+
+			if (newHeader.nextFile == 0) {
+				vol->session.lastHeader = writeAddress;
+				vol->session.chainEnd = appendAddress(writeAddress, newHeader);
+			} else if (deletedExisting && existingAddress == vol->session.lastHeader) {
+				vol->session.chainEnd = existingAddress;
+			}
+		}
+
+#if OSFS_DIR_CACHE_SIZE > 0
+		if (deletedExisting)
+			dirCacheRemove(existingAddress);
+		dirCacheInsert(writeAddress, size, newHeader.fileID, newHeader.hash);
+#endif
+
+		headerAddress = writeAddress;
+		return result::NO_ERROR;
+	}
+
+	// Store a file as storeFile does. On flash, if there isn't room, compact()
+	// is called to make some and the file is stored again. Any contents being
+	// copied are found again by name, since compact() moves them.
+	static result storeFileOrCompact(const paddedName& filename, address_t copyFrom, address_t copySize,
+			const void* data, unsigned int dataSize, bool overwrite, address_t& headerAddress,
+			address_t tailSize = 0, uint8_t kind = 0) {
+		result r = storeFile(filename, copyFrom, copySize, data, dataSize, overwrite, headerAddress, tailSize, kind);
+		if (!flashMode || r != result::INSUFFICIENT_SPACE)
+			return r;
+
+		r = compact();
+		if (r != result::NO_ERROR)
+			return r;
+
+		if (copySize + tailSize > 0) {
+			address_t size;
+			r = getFileInfo(filename, copyFrom, size);
+			if (r != result::NO_ERROR)
+				return r;
+		}
+
+		return storeFile(filename, copyFrom, copySize, data, dataSize, overwrite, headerAddress, tailSize, kind);
+	}
+
+#if OSFS_BATCH_SIZE > 0
+	namespace {
+
+		// Find the last header in the chain
+		result findLastHeader(address_t& lastAddress, fileHeader& lastHeader) {
+			lastAddress = vol->session.mounted ? vol->session.lastHeader : firstHeaderAddress();
+
+			while (true) {
+				result r = readNBytesChk(lastAddress, sizeof(fileHeader), &lastHeader);
+				if (r != result::NO_ERROR || lastHeader.nextFile == 0)
+					return r;
+
+				lastAddress = lastHeader.nextFile;
+			}
+		}
+
+		// Store a file as part of the batch. Each file's header points to
+		// where the next will go, except on flash, and the first is marked as
+		// the start of a batch which is pending. kind is as for storeFile.
+		result batchFile(const paddedName& filename, const void* data, unsigned int size, bool overwrite, uint8_t kind) {
+			fileHeader newHeader;
+			memset(&newHeader, 0, sizeof(fileHeader));
+			memcpy(newHeader.fileID, filename.id, FILE_NAME_LENGTH);
+			newHeader.hash = filename.hash;
+			uint8_t hash = filename.hash;
+
+			for (unsigned int i = 0; i < vol->batchCount; i++) {
+				if (vol->batchFiles[i].hash != hash)
+					continue;
+
+				char batchName[FILE_NAME_LENGTH];
+				result r = readNBytesChk(vol->batchFiles[i].headerAddress, FILE_NAME_LENGTH, batchName);
+				if (r != result::NO_ERROR)
+					return r;
+
+				if (0 == strncmp(batchName, newHeader.fileID, FILE_NAME_LENGTH))
+					return result::FILE_ALREADY_EXISTS;
+			}
+
+			address_t sizeRequired = sizeof(fileHeader) + size;
+			if (vol->batchCount == OSFS_BATCH_SIZE || vol->batchEnd + sizeRequired > endOfFiles())
+				return result::INSUFFICIENT_SPACE;
+
+			result r = checkBlank(vol->batchEnd, sizeRequired);
+			if (r != result::NO_ERROR)
+				return r;
+
+			newHeader.fileSize = size;
+			newHeader.nextFile = flashMode ? 0 : vol->batchEnd + sizeRequired;
+			newHeader.flags = kind;
+			if (vol->batchCount == 0)
+				newHeader.flags |= 1<<PENDBIT | 1<<BATCHBIT;
+#if OSFS_CRC
+			newHeader.crc = crc16(CRC_INIT, newHeader.fileID, FILE_NAME_LENGTH);
+			newHeader.crc = crcData(newHeader.crc, data, size, kind);
+#endif
+
+			burstBegin();
+			r = burstWrite(vol->batchEnd, sizeof(fileHeader), &newHeader);
+			if (r == result::NO_ERROR)
+				r = burstData(vol->batchEnd + sizeof(fileHeader), data, size, kind);
+			if (r == result::NO_ERROR)
+				r = burstEnd();
+			if (r != result::NO_ERROR)
+				return r;
+
+			// On flash, where commit() couldn't end the chain at the last
+			// file, each file is pointed at the next as it's written
+			usedFlash(vol->batchEnd, sizeRequired);
+			if (flashMode && vol->batchCount > 0) {
+				r = writeNextFile(vol->batchFiles[vol->batchCount - 1].headerAddress, vol->batchEnd);
+				if (r != result::NO_ERROR)
+					return r;
+			}
+
+			vol->batchFiles[vol->batchCount].headerAddress = vol->batchEnd;
+			vol->batchFiles[vol->batchCount].originalAddress = 0;
+			vol->batchFiles[vol->batchCount].hash = hash;
+			vol->batchFiles[vol->batchCount].overwrite = overwrite;
+			vol->batchCount++;
+			vol->batchEnd += sizeRequired;
+			return result::NO_ERROR;
+		}
+	}
+#endif
+
+	result newFile(const paddedName& filename, void* data, unsigned int size, bool overwrite, bool compress) {
+		const void* contents = data;
+		uint8_t kind = 0;
+
+#if OSFS_COMPRESS
+		// Store the data compressed if that takes less space
+		lzSource source;
+		source.data = (const byte*)data;
+		source.size = size;
+#if OSFS_CRC
+		source.crc = crc16(CRC_INIT, filename.id, FILE_NAME_LENGTH);
+#endif
+		address_t compressedSize;
+		if (compress && size <= endOfFiles() && lzSmaller(source, compressedSize)) {
+			contents = &source;
+			size = compressedSize;
+			kind = 1<<COMPBIT;
+		}
+#else
+		(void)compress;
+#endif
+
+#if OSFS_BATCH_SIZE > 0
+		if (vol->batchOpen)
+			return batchFile(filename, contents, size, overwrite, kind);
+#endif
+
+		address_t headerAddress;
+		return storeFileOrCompact(filename, 0, 0, contents, size, overwrite, headerAddress, 0, kind);
+	}
+
+	result beginBatch() {
+#if OSFS_BATCH_SIZE > 0
+		abortBatch();
+
+		// Confirm that the EEPROM is managed by this version of OSFS
+		result r = checkSession();
+
+		if (r != result::NO_ERROR)
+			return r;
+
+		// The batch goes after the contents of the last file, even if it's
+		// free, so that none of the batch is part of the chain until commit()
+		address_t lastAddress;
+		fileHeader lastHeader;
+		r = findLastHeader(lastAddress, lastHeader);
+		if (r != result::NO_ERROR)
+			return r;
+
+		vol->batchEnd = lastAddress + sizeof(fileHeader) + lastHeader.fileSize;
+		vol->batchOpen = true;
+#endif
+		return result::NO_ERROR;
+	}
+
+	result commit() {
+#if OSFS_BATCH_SIZE > 0
+		// Whatever happens, the batch is finished
+		if (!vol->batchOpen || vol->batchCount == 0) {
+			abortBatch();
+			return result::NO_ERROR;
+		}
+		vol->batchOpen = false;
+
+		// One walk of the chain finds the files which the batch replaces, and
+		// the last header
+		fileHeader workingHeader;
+		address_t workingAddress = firstHeaderAddress();
+		char batchName[FILE_NAME_LENGTH];
+
+		while (true) {
+			result r = readNBytesChk(workingAddress, sizeof(fileHeader), &workingHeader);
+			if (r != result::NO_ERROR)
+				return r;
+
+			uint8_t hash = workingHeader.hash;
+			for (unsigned int i = 0; i < vol->batchCount && !isDeletedFile(workingHeader); i++) {
+				if (vol->batchFiles[i].hash != hash || vol->batchFiles[i].originalAddress != 0)
+					continue;
+
+				r = readNBytesChk(vol->batchFiles[i].headerAddress, FILE_NAME_LENGTH, batchName);
+				if (r != result::NO_ERROR)
+					return r;
+
+				if (0 == strncmp(batchName, workingHeader.fileID, FILE_NAME_LENGTH)) {
+					if (!vol->batchFiles[i].overwrite)
+						return result::FILE_ALREADY_EXISTS;
+
+					vol->batchFiles[i].originalAddress = workingAddress;
+					break;
+				}
+			}
+
+			if (workingHeader.nextFile == 0)
+				break;
+
+			workingAddress = workingHeader.nextFile;
+		}
+
+		// End the batch's part of the chain, unless that was done as it was
+		// written, then link it onto the end. It's now part of the chain but
+		// still pending, so a power cut from here on leaves recover() to
+		// delete it.
+		address_t firstAddress = vol->batchFiles[0].headerAddress;
+		result r = result::NO_ERROR;
+		if (!flashMode)
+			r = writeNextFile(vol->batchFiles[vol->batchCount - 1].headerAddress, 0);
+		if (r == result::NO_ERROR)
+			r = linkAfter(workingAddress, workingHeader, firstAddress);
+		if (r != result::NO_ERROR)
+			return r;
+
+		// This is the moment the batch takes effect. A power cut from here on
+		// leaves recover() to finish it.
+		uint8_t flags;
+		r = readNBytesChk(firstAddress + offsetof(fileHeader, flags), sizeof(uint8_t), &flags);
+		if (r == result::NO_ERROR)
+			r = clearFlags(firstAddress, flags, 1<<PENDBIT);
+		if (r != result::NO_ERROR)
+			return r;
+
+		for (unsigned int i = 0; i < vol->batchCount; i++) {
+			if (vol->batchFiles[i].originalAddress == 0)
+				continue;
+
+			r = markDeleted(vol->batchFiles[i].originalAddress);
+			if (r != result::NO_ERROR)
+				return r;
+		}
+
+		r = clearFlags(firstAddress, flags, 1<<BATCHBIT);
+		if (r != result::NO_ERROR)
+			return r;
+
+#if OSFS_DIR_INDEX_SIZE > 0
+		for (unsigned int i = 0; i < vol->batchCount; i++) {
+			r = readNBytesChk(vol->batchFiles[i].headerAddress, FILE_NAME_LENGTH, batchName);
+			if (r == result::NO_ERROR)
+				r = dirIndexUpdate(batchName, vol->batchFiles[i].originalAddress, vol->batchFiles[i].headerAddress);
+			if (r != result::NO_ERROR)
+				return r;
+		}
+#endif
+
+		vol->batchCount = 0;
+
+		// Reload everything we know about the chain
+		if (vol->session.mounted)
+			return scanChain();
+
+		forgetChain();
+#endif
+		return result::NO_ERROR;
+	}
+
+	void abortBatch() {
+#if OSFS_BATCH_SIZE > 0
+		vol->batchOpen = false;
+		vol->batchCount = 0;
+#endif
+	}
+
+	result deleteFile(const paddedName& filename) {
 
 		// Confirm that the EEPROM is managed by this version of OSFS
-		result r = checkLibVersion();
+		result r = checkSession();
+
+		if (r != result::NO_ERROR)
+			return r;
+
+		// Get the first header
+		fileHeader workingHeader;
+		address_t workingAddress = firstHeaderAddress();
+
+		// If the directory cache or index knows where the file is, start the
+		// search there
+		address_t knownSize;
+		if (quickLookup(filename, r, workingAddress, knownSize)) {
+			if (r != result::NO_ERROR)
+				return r;
+		}
+
+		address_t previousAddress = 0;
+		bool previousDeleted = false;
+#if OSFS_INSTRUMENT
+		vol->opCounts.lookups++;
+#endif
+
+		// Loop through checking the file header until
+		// 	a) we reach a NULL pointer,
+		// 	b) we find our file and it's not deleted
+		// 	c) we get an OOL pointer somehow
+		while (true) {
+
+			// Load the next header, with its name only if the hash matches
+			result r = readWalkHeader(workingAddress, workingHeader, filename.hash);
+#if OSFS_INSTRUMENT
+			vol->opCounts.chainHops++;
+#endif
+
+			// Quit if we're out of bounds
+			if (r != result::NO_ERROR)
+				return r;
+
+			// Delete the file if it has the same name and isn't already deleted
+			if (!isDeletedFile(workingHeader) && 0 == strncmp(workingHeader.fileID, filename.id, FILE_NAME_LENGTH)) {
+				workingHeader.flags = workingHeader.flags | 1<<DELBIT;
+				r = writeNBytesChk(workingAddress + offsetof(fileHeader, flags), sizeof(uint8_t), &workingHeader.flags);
+
+				if (r != result::NO_ERROR)
+					return r;
+
+				vol->session.holes++;
+
+#if OSFS_DIR_CACHE_SIZE > 0
+				dirCacheRemove(workingAddress);
+#endif
+#if OSFS_DIR_INDEX_SIZE > 0
+				r = dirIndexUpdate(filename.id, workingAddress, INDEX_REMOVED);
+				if (r != result::NO_ERROR)
+					return r;
+#endif
+
+				// Merge the new free slot with any free neighbours, so that
+				// their space can be reused together. Each merge is a single
+				// write of a nextFile field, so the chain is always intact.
+				// There's no point on flash, where only compact() reuses space.
+				address_t nextFile = workingHeader.nextFile;
+
+#if OSFS_FREE_INDEX_SIZE > 0
+				freeIndexAdd(workingAddress, nextFile);
+#endif
+
+				if (nextFile != 0 && !flashMode) {
+					fileHeader nextHeader;
+					r = readWalkHeader(nextFile, nextHeader);
+					if (r != result::NO_ERROR)
+						return r;
+
+					if (isDeletedFile(nextHeader)) {
+						nextFile = nextHeader.nextFile;
+						r = writeNextFile(workingAddress, nextFile);
+						if (r != result::NO_ERROR)
+							return r;
+
+						vol->session.holes--;
+					}
+				}
+
+				if (previousDeleted && !flashMode) {
+					r = writeNextFile(previousAddress, nextFile);
+					if (r != result::NO_ERROR)
+						return r;
+
+					vol->session.holes--;
+					workingAddress = previousAddress;
+				}
+
+				if (nextFile == 0) {
+					vol->session.lastHeader = workingAddress;
+					vol->session.chainEnd = flashMode ? appendAddress(workingAddress, workingHeader) : workingAddress;
+				}
+
+				return result::NO_ERROR;
+			}
+
+			// Quit if we get a NULL pointer
+			if (workingHeader.nextFile == 0)
+				return result::FILE_NOT_FOUND;
+
+			// Next file
+			previousAddress = workingAddress;
+			previousDeleted = isDeletedFile(workingHeader);
+			workingAddress = workingHeader.nextFile;
+		}
+
+		// We will never get here
+		return result::UNDEFINED_ERROR;
+	}
+
+	namespace {
+
+		// Try to make the slot of the file at the given address large enough
+		// for sizeRequired bytes, including its header, by taking over the run
+		// of deleted files after it. Up to sizeWanted bytes are taken, to leave
+		// room for the file to grow further, and the rest of the run is split
+		// off into a new free slot. Sets extended to false, and writes
+		// nothing, if there isn't enough free space after the file.
+		result extendSlot(address_t address, address_t sizeRequired, address_t sizeWanted, bool& extended) {
+			fileHeader header;
+			result r = readWalkHeader(address, header);
+			if (r != result::NO_ERROR)
+				return r;
+
+			extended = slotSize(address, header.nextFile) >= sizeRequired;
+			if (extended || header.nextFile == 0)
+				return result::NO_ERROR;
+
+			// Find the end of the run of deleted files after this one, and
+			// whether it's been merged in storage
+			address_t runStart = header.nextFile;
+			address_t runEnd = runStart;
+			address_t runStartNext = 0;
+			while (runEnd != 0) {
+				fileHeader nextHeader;
+				r = readWalkHeader(runEnd, nextHeader);
+				if (r != result::NO_ERROR)
+					return r;
+
+				if (!isDeletedFile(nextHeader))
+					break;
+
+				if (runEnd == runStart)
+					runStartNext = nextHeader.nextFile;
+				runEnd = nextHeader.nextFile;
+			}
+
+			if (runEnd == runStart || slotSize(address, runEnd) < sizeRequired)
+				return result::NO_ERROR;
+
+			// Split off any space that isn't wanted into a new free slot, as
+			// newFile does
+			if (sizeWanted < sizeRequired)
+				sizeWanted = sizeRequired;
+			if (slotSize(address, runEnd) < sizeWanted)
+				sizeWanted = slotSize(address, runEnd);
+
+			address_t nextFile = runEnd;
+			bool splitting = runEnd != 0 && address_t(runEnd - (address + sizeWanted)) > sizeof(fileHeader);
+			if (splitting) {
+				// The new free slot's header mustn't be written over one which
+				// is still in the chain. Unless the run is merged and it starts
+				// after the run's first header, the file's slot takes over the
+				// whole run first.
+				if (runStartNext != runEnd || address + sizeWanted < runStart + sizeof(fileHeader)) {
+					r = writeNextFile(address, runEnd);
+					if (r != result::NO_ERROR)
+						return r;
+				}
+
+				fileHeader remainderHeader;
+				memset(&remainderHeader, 0, sizeof(fileHeader));
+				padFilename("", remainderHeader.fileID);
+				remainderHeader.hash = hashFilename(remainderHeader.fileID);
+				remainderHeader.nextFile = runEnd;
+				remainderHeader.flags = 1<<DELBIT;
+
+				nextFile = address + sizeWanted;
+				r = writeNBytesChk(nextFile, sizeof(fileHeader), &remainderHeader);
+				if (r != result::NO_ERROR)
+					return r;
+			}
+
+			r = writeNextFile(address, nextFile);
+			if (r != result::NO_ERROR)
+				return r;
+
+#if OSFS_FREE_INDEX_SIZE > 0
+			freeIndexRemove(runStart);
+			if (splitting)
+				freeIndexInsert(nextFile, runEnd);
+#endif
+
+			if (vol->session.mounted) {
+				if (!splitting)
+					vol->session.holes--;
+				if (runEnd == 0) {
+					vol->session.lastHeader = address;
+					vol->session.chainEnd = address + sizeRequired;
+				}
+			}
+
+			extended = true;
+			return result::NO_ERROR;
+		}
+	}
+
+	result File::open(const paddedName& filename, bool create) {
+		close();
+#if OSFS_VOLUMES
+		volume = vol;
+#endif
+
+		address_t filePointer, size;
+		result r = getFileInfo(filename, filePointer, size);
+
+		if (r == result::FILE_NOT_FOUND && create) {
+			size = 0;
+			r = storeFileOrCompact(filename, 0, 0, nullptr, 0, false, filePointer);
+			filePointer += sizeof(fileHeader);
+		}
+
+		if (r != result::NO_ERROR)
+			return r;
+
+#if OSFS_COMPRESS
+		bool compressed;
+		address_t uncompressedSize;
+		r = lzFileSize(filePointer, compressed, uncompressedSize);
+		if (r != result::NO_ERROR)
+			return r;
+
+		if (compressed) {
+			compressedSize = size;
+			size = uncompressedSize;
+			lzStart(decoder, filePointer);
+		}
+#endif
+
+		headerAddress = filePointer - sizeof(fileHeader);
+		fileSize = size;
+		return result::NO_ERROR;
+	}
+
+	void File::close() {
+		headerAddress = 0;
+		fileSize = 0;
+		filePosition = 0;
+#if OSFS_COMPRESS
+		compressedSize = 0;
+#endif
+	}
+
+	result File::seek(address_t position) {
+		if (!isOpen())
+			return result::FILE_NOT_FOUND;
+
+		if (position > fileSize)
+			return result::END_OF_FILE;
+
+		filePosition = position;
+		return result::NO_ERROR;
+	}
+
+	result File::read(void* buf, unsigned int len) {
+		if (!isOpen())
+			return result::FILE_NOT_FOUND;
+
+		if (len > address_t(fileSize - filePosition))
+			return result::END_OF_FILE;
+
+#if OSFS_VOLUMES
+		volumeScope scope(volume);
+#endif
+		address_t filePointer = headerAddress + sizeof(fileHeader);
+		result r;
+#if OSFS_COMPRESS
+		if (compressedSize > 0) {
+			// Carry on from the last read, unless this goes back before it
+			if (filePosition < decoder.produced)
+				lzStart(decoder, filePointer);
+			r = lzUncompress(decoder, filePointer + compressedSize, filePosition, buf, len);
+			if (r != result::NO_ERROR)
+				lzStart(decoder, filePointer);
+		} else
+#endif
+			r = readNBytesChk(filePointer + filePosition, len, buf);
+		if (r != result::NO_ERROR)
+			return r;
+
+		filePosition += len;
+		return result::NO_ERROR;
+	}
+
+	result File::read(address_t offset, void* buf, unsigned int len) {
+		result r = seek(offset);
+		if (r != result::NO_ERROR)
+			return r;
+
+		return read(buf, len);
+	}
+
+	result File::write(const void* data, unsigned int len) {
+		if (!isOpen())
+			return result::FILE_NOT_FOUND;
+
+#if OSFS_COMPRESS
+		if (compressedSize > 0)
+			return result::READ_ONLY;
+#endif
+
+#if OSFS_VOLUMES
+		volumeScope scope(volume);
+#endif
+		if (len > address_t(endOfFiles() - filePosition))
+			return result::INSUFFICIENT_SPACE;
+
+		address_t end = filePosition + len;
+
+		if (end > fileSize || flashMode) {
+			bool extended = false;
+			if (!flashMode) {
+				// Take twice the space needed if possible, so that a file which
+				// is appended to often doesn't need its slot extended every time
+				address_t sizeWanted = end <= endOfFiles() / 2 ? sizeof(fileHeader) + 2 * end : endOfFiles();
+				result r = extendSlot(headerAddress, sizeof(fileHeader) + end, sizeWanted, extended);
+				if (r != result::NO_ERROR)
+					return r;
+			}
+
+			if (!extended) {
+				// Move the file somewhere larger, taking the new data with it.
+				// On flash, this is the only way to change it at all. The
+				// original stays put until the copy is complete.
+				char filename[FILE_NAME_LENGTH];
+				result r = readNBytesChk(headerAddress, FILE_NAME_LENGTH, filename);
+				if (r != result::NO_ERROR)
+					return r;
+
+				address_t tailSize = end < fileSize ? fileSize - end : 0;
+				r = storeFileOrCompact(padName(filename), headerAddress + sizeof(fileHeader), filePosition, data, len,
+					true, headerAddress, tailSize);
+				if (r != result::NO_ERROR)
+					return r;
+
+				fileSize = end + tailSize;
+				filePosition = end;
+				return result::NO_ERROR;
+			}
+		}
+
+		// Write the data, then the new size if the file grew, so that the
+		// file only grows once the data is in place
+		result r = writeNBytesChk(headerAddress + sizeof(fileHeader) + filePosition, len, data);
+		if (r != result::NO_ERROR)
+			return r;
+
+#if OSFS_CRC
+		// With CRCs, the size is written along with the new CRC. Appending
+		// carries on from the old one, but anything else means reading back
+		// the whole file.
+		fileHeader header;
+		r = readNBytesChk(headerAddress, sizeof(fileHeader), &header);
+		if (r != result::NO_ERROR)
+			return r;
+
+		if (filePosition == fileSize) {
+			header.fileSize = end;
+			header.crc = crc16(header.crc, data, len);
+		} else {
+			if (end > fileSize)
+				header.fileSize = end;
+			r = fileCrc(headerAddress, header, header.crc);
+			if (r != result::NO_ERROR)
+				return r;
+		}
+
+		r = writeSizeAndCrc(headerAddress, header);
+		if (r != result::NO_ERROR)
+			return r;
+#endif
+
+		if (end > fileSize) {
+#if !OSFS_CRC
+			address_t newSize = end;
+			r = writeNBytesChk(headerAddress + offsetof(fileHeader, fileSize), sizeof(address_t), &newSize);
+			if (r != result::NO_ERROR)
+				return r;
+#endif
+
+			fileSize = end;
+
+			if (vol->session.mounted && headerAddress == vol->session.lastHeader)
+				vol->session.chainEnd = headerAddress + sizeof(fileHeader) + fileSize;
+
+#if OSFS_DIR_CACHE_SIZE > 0
+			dirCacheResize(headerAddress, fileSize);
+#endif
+		}
+
+		filePosition = end;
+		return result::NO_ERROR;
+	}
+
+	result File::append(const void* data, unsigned int len) {
+		result r = seek(fileSize);
+		if (r != result::NO_ERROR)
+			return r;
+
+		return write(data, len);
+	}
+
+	result Dir::next(dirEntry& entry) {
+#if OSFS_VOLUMES
+		if (nextHeader == 0)
+			volume = vol;
+
+		volumeScope scope(volume);
+#endif
+		if (nextHeader == 0) {
+			// Confirm that the EEPROM is managed by this version of OSFS
+			result r = checkSession();
+
+			if (r != result::NO_ERROR)
+				return r;
+
+			nextHeader = firstHeaderAddress();
+		}
+
+		while (nextHeader != 1) {
+			fileHeader header;
+			address_t address = nextHeader;
+			result r = readNBytesChk(address, sizeof(fileHeader), &header);
+			if (r != result::NO_ERROR)
+				return r;
+
+			nextHeader = header.nextFile == 0 ? 1 : header.nextFile;
+
+			if (!isDeletedFile(header) && !isDummyHeader(address, header)) {
+				unpadFilename(header.fileID, entry.name);
+				entry.size = header.fileSize;
+				entry.filePointer = address + sizeof(fileHeader);
+#if OSFS_COMPRESS
+				if (header.flags & 1<<COMPBIT)
+					return readNBytesChk(entry.filePointer, sizeof(address_t), &entry.size);
+#endif
+				return result::NO_ERROR;
+			}
+		}
+
+		return result::END_OF_FILE;
+	}
+
+#if OSFS_FLASH_BLOCK_SIZE == 0
+	namespace {
+
+		// Sequence numbers of log records count up from 1, skipping 0, which
+		// marks a slot which has never been written
+		inline uint16_t nextSequence(uint16_t seq) {
+			return seq == 0xFFFF ? 1 : seq + 1;
+		}
+	}
+
+	result Log::open(const paddedName& filename, uint8_t recordSize, address_t capacity) {
+		close();
+#if OSFS_VOLUMES
+		volume = vol;
+#endif
+
+		if (recordSize == 0 || capacity == 0 || capacity >= 0xFFFE)
+			return result::BUFFER_WRONG_SIZE;
+
+		address_t slotBytes = recordSize + sizeof(uint16_t);
+		address_t filePointer, size;
+		result r = getFileInfo(filename, filePointer, size);
+
+		if (r == result::FILE_NOT_FOUND) {
+			// All zeros, so that every slot is empty. The record size is
+			// written afterwards: a log which was cut short before that is
+			// finished below.
+			uint32_t newSize = 1 + uint32_t(capacity + 1) * slotBytes;
+			if (newSize > endOfFiles() || newSize > UINT_MAX)
+				return result::INSUFFICIENT_SPACE;
+
+			address_t newHeaderAddress;
+			r = storeFile(filename, 0, 0, nullptr, newSize, false, newHeaderAddress, 0, 1<<LOGBIT);
+			filePointer = newHeaderAddress + sizeof(fileHeader);
+			size = newSize;
+		}
+
+		if (r != result::NO_ERROR)
+			return r;
+
+		uint8_t flags;
+		r = readNBytesChk(filePointer - sizeof(fileHeader) + offsetof(fileHeader, flags), sizeof(uint8_t), &flags);
+		if (r != result::NO_ERROR)
+			return r;
+
+		if (!(flags & 1<<LOGBIT))
+			return result::FILE_ALREADY_EXISTS;
+
+		uint8_t storedSize;
+		r = readNBytesChk(filePointer, sizeof(uint8_t), &storedSize);
+		if (r != result::NO_ERROR)
+			return r;
+
+		if (storedSize == 0) {
+			r = writeNBytesChk(filePointer, sizeof(uint8_t), &recordSize);
+			if (r != result::NO_ERROR)
+				return r;
+		} else if (storedSize != recordSize) {
+			return result::BUFFER_WRONG_SIZE;
+		}
+
+		address_t numSlots = (size - 1) / slotBytes;
+		if (numSlots < 2)
+			return result::CORRUPT_FILE;
+
+		// The newest record is the last before a slot which is empty or
+		// doesn't follow on from it. Once the log is full, that's the spare
+		// slot, which holds the record the next one replaces.
+		address_t headSlot = 0;
+		uint16_t newestSeq = 0;
+		bool full = true;
+
+		for (address_t i = 0; i < numSlots; i++) {
+			uint16_t seq;
+			r = readNBytesChk(filePointer + 1 + i * slotBytes + recordSize, sizeof(uint16_t), &seq);
+			if (r != result::NO_ERROR)
+				return r;
+
+			if (seq == 0 || (i > 0 && seq != nextSequence(newestSeq))) {
+				headSlot = i;
+				full = (seq != 0);
+				break;
+			}
+
+			newestSeq = seq;
+		}
+
+		headerAddress = filePointer - sizeof(fileHeader);
+		this->recordSize = recordSize;
+		slots = numSlots;
+		head = headSlot;
+		records = full ? numSlots - 1 : headSlot;
+		nextSeq = nextSequence(newestSeq);
+		return result::NO_ERROR;
+	}
+
+	void Log::close() {
+		headerAddress = 0;
+		slots = 0;
+		recordSize = 0;
+		head = 0;
+		records = 0;
+		nextSeq = 0;
+		readPosition = 0;
+	}
+
+	result Log::append(const void* record) {
+		if (!isOpen())
+			return result::FILE_NOT_FOUND;
 
+		// The sequence number goes last, so that the slot only counts once
+		// the record is complete
+#if OSFS_VOLUMES
+		volumeScope scope(volume);
+#endif
+		address_t slotAddress = headerAddress + sizeof(fileHeader) + 1 + head * (recordSize + sizeof(uint16_t));
+		burstBegin();
+		result r = burstWrite(slotAddress, recordSize, record);
+		if (r == result::NO_ERROR)
+			r = burstWrite(slotAddress + recordSize, sizeof(uint16_t), &nextSeq);
+		if (r == result::NO_ERROR)
+			r = burstEnd();
 		if (r != result::NO_ERROR)
 			return r;
 
-		// It is! Now get the first file header
-		fileHeader workingHeader;
-		uint16_t workingAddress = startOfEEPROM + sizeof(FSInfo);
+		head = (head + 1) % slots;
+		nextSeq = nextSequence(nextSeq);
 
-		char paddedFilename[FILE_NAME_LENGTH];
-		padFilename(filename, paddedFilename);
+		// Once full, the oldest record is dropped, along with its place in
+		// the reading
+		if (records < slots - 1)
+			records++;
+		else if (readPosition > 0)
+			readPosition--;
 
-		// Loop through checking the file header until
-		// 	a) we reach a NULL pointer,
-		// 	b) we find a deleted file that can be overwritten
-		// 	c) we get an OOL pointer somehow
-		while (true) {
+		return result::NO_ERROR;
+	}
 
-			// Load the next header
-			result r = readNBytesChk(workingAddress, sizeof(fileHeader), &workingHeader);
+	result Log::read(void* record) {
+		if (!isOpen())
+			return result::FILE_NOT_FOUND;
 
-			// Quit if we're out of bounds
+		if (readPosition >= records)
+			return result::END_OF_FILE;
+
+#if OSFS_VOLUMES
+		volumeScope scope(volume);
+#endif
+		address_t slot = (head + slots - records + readPosition) % slots;
+		result r = readNBytesChk(headerAddress + sizeof(fileHeader) + 1 + slot * (recordSize + sizeof(uint16_t)),
+			recordSize, record);
+		if (r != result::NO_ERROR)
+			return r;
+
+		readPosition++;
+		return result::NO_ERROR;
+	}
+#endif
+
+	result getFsStats(fsStats& stats) {
+		memset(&stats, 0, sizeof(fsStats));
+
+		// Confirm that the EEPROM is managed by this version of OSFS
+		result r = checkSession();
+
+		if (r != result::NO_ERROR)
+			return r;
+
+		fileHeader workingHeader;
+		address_t workingAddress = firstHeaderAddress();
+		address_t runStart = 0; // Start of the current run of deleted headers
+
+		while (true) {
+			r = readWalkHeader(workingAddress, workingHeader);
 			if (r != result::NO_ERROR)
 				return r;
 
-			// Is this the right file?
-			// Check the file ID
-			if (0 == strncmp(workingHeader.fileID, paddedFilename, FILE_NAME_LENGTH)) {
-				// We found it!
-				// Is it marked as deleted?
-				if (isDeletedFile(workingHeader)) {
-					// File is deleted. :( continue onwards...
-				} else {
-					// Load the data into the receiving variables
-					filePointer = workingAddress + sizeof(fileHeader);
-					fileSize = workingHeader.fileSize;
+			stats.chainLength++;
 
-					return result::NO_ERROR;
+			// Free space is a run of deleted files, a dummy header or the
+			// space after the end of the chain, as newFile sees it. On flash,
+			// only the space after the end can be used until compact() runs.
+			address_t freeSlot = 0;
+
+			if (isDeletedFile(workingHeader)) {
+				stats.deletedFiles++;
+				if (runStart == 0)
+					runStart = workingAddress;
+				if (workingHeader.nextFile == 0)
+					freeSlot = slotSize(flashMode ? appendAddress(workingAddress, workingHeader) : runStart, 0);
+			} else {
+				if (runStart != 0 && !flashMode)
+					freeSlot = slotSize(runStart, workingAddress);
+				runStart = 0;
+
+				if (!isDummyHeader(workingAddress, workingHeader)) {
+					stats.files++;
+					stats.used += sizeof(fileHeader) + workingHeader.fileSize;
+				}
+
+				if (workingHeader.nextFile == 0) {
+					address_t tail = slotSize(appendAddress(workingAddress, workingHeader), 0);
+					if (tail > freeSlot)
+						freeSlot = tail;
 				}
 			}
 
-			// If there's no next file
-			if (workingHeader.nextFile == 0) {
+			if (freeSlot > stats.largestFree)
+				stats.largestFree = freeSlot;
 
-				return result::FILE_NOT_FOUND;
-			}
+			if (workingHeader.nextFile == 0)
+				break;
 
-			// Keep going
 			workingAddress = workingHeader.nextFile;
 		}
 
-		return result::UNDEFINED_ERROR;
+		stats.free = slotSize(firstHeaderAddress(), 0) - stats.used;
+		return result::NO_ERROR;
 	}
 
-	result newFile(const char* filename, void* data, unsigned int size, bool overwrite) {
-
-		// Header for new file
-		fileHeader newHeader;
+#if OSFS_FLASH_BLOCK_SIZE > 0
+	namespace {
 
-		// Store padded filename in newHeader
-		padFilename(filename, newHeader.fileID);
+		// Find which half of the flash holds the files: the one with valid
+		// identifying info. If both have it, compact() was cut short after
+		// finishing its copy, which has the later generation.
+		void findFlashBase() {
+			FSInfo lower, upper;
+			readNBytesChk(storageStart(), sizeof(FSInfo), &lower);
+			readNBytesChk(storageStart() + flashHalfSize(), sizeof(FSInfo), &upper);
 
-		// Confirm that the EEPROM is managed by this version of OSFS
-		result r = checkLibVersion();
+			bool lowerValid = 0 == strncmp(lower.idStr, OSFS_ID_STR, 4);
+			bool upperValid = 0 == strncmp(upper.idStr, OSFS_ID_STR, 4);
 
-		if (r != result::NO_ERROR)
-			return r;
+			vol->flashBase = storageStart();
+			if (upperValid && (!lowerValid || int8_t(upper.generation - lower.generation) > 0))
+				vol->flashBase += flashHalfSize();
+			vol->flashBaseKnown = true;
+		}
 
-		// It is! Now get the first file header
-		unsigned int sizeRequired = sizeof(fileHeader) + size;
+		// Erase the half of the flash starting at the given address
+		result eraseHalf(address_t base) {
+			result r = sync();
+			if (r != result::NO_ERROR)
+				return r;
 
-		// If we're overwriting an existing file, delete the existing file (if it
-		// exists)
-		if (overwrite) {
-			result r_delete = deleteFile(filename);
-			if (r_delete != result::NO_ERROR && r_delete != result::FILE_NOT_FOUND)
-				return r_delete;
-		} else {
-			// If we're not, check if it already exists
-			uint16_t checkFilePointer, checkFileSize;
-			result r_check = getFileInfo(filename, checkFilePointer, checkFileSize);
+			for (address_t address = base; address - base < flashHalfSize(); address += OSFS_FLASH_BLOCK_SIZE)
+				deviceErase(address);
 
-			if (r_check == result::NO_ERROR)
-				return result::FILE_ALREADY_EXISTS;
-			if (r_check != result::FILE_NOT_FOUND)
-				return r_check;
-			// r_check == FILE_NOT_FOUND
+#if OSFS_CACHE_PAGES > 0
+			cacheDrop();
+#endif
+			return result::NO_ERROR;
 		}
 
-		fileHeader workingHeader;
-		uint16_t workingAddress = startOfEEPROM + sizeof(FSInfo);
-		uint16_t writeAddress;
-
-		// Loop through checking the file header until
-		// 	a) we reach a NULL pointer (i.e. the end of the current files)
-		// 	b) we find a deleted file that can be overwritten
-		// 	c) we run out of space
-		while (true) {
-
-			// Load the next header
-			result r = readNBytesChk(workingAddress, sizeof(fileHeader), &workingHeader);
+		// Copy the live files into the other half of the flash, one after
+		// another, then switch to it. Each copy is pointed at by the one
+		// before once it's complete. Until the new half's identifying info is
+		// written, a power cut leaves the old half in use.
+		result collectGarbage() {
+			address_t from = vol->flashBase;
+			address_t to = from == storageStart() ? storageStart() + flashHalfSize() : storageStart();
 
-			// Quit if we're out of bounds
+			FSInfo info;
+			result r = readNBytesChk(from, sizeof(FSInfo), &info);
+			if (r == result::NO_ERROR)
+				r = eraseHalf(to);
 			if (r != result::NO_ERROR)
 				return r;
 
+			fileHeader workingHeader;
+			address_t workingAddress = firstHeaderAddress();
+			address_t writeAddress = to + FIRST_HEADER_OFFSET;
+			address_t lastCopy = 0;
 
-			// If there's no next file, calculate the start of the spare space and break the loop
-			// Note that we might find a file header with fileSize == 0 if there are no files on
-			// the filesystem at all. In this case, overwrite this "dummy header".
-			if (workingHeader.nextFile == 0) {
-				if (workingHeader.fileSize != 0)
-					writeAddress = workingAddress + sizeof(workingHeader) + workingHeader.fileSize;
-				else
-					writeAddress = workingAddress;
+			while (true) {
+				r = readNBytesChk(workingAddress, sizeof(fileHeader), &workingHeader);
+				if (r != result::NO_ERROR)
+					return r;
 
-				break;
-			}
+				address_t nextFile = workingHeader.nextFile;
 
-			// If this is a deleted file, see if we can fit our file here
-			if (isDeletedFile(workingHeader)) {
-				// It is. Is the space large enough for us?
-				unsigned int deletedSpace = workingHeader.nextFile - workingAddress;
-				if (deletedSpace >= sizeRequired) {
-					// Save the location for writing and quit the loop
-					writeAddress = workingAddress;
-					break;
+				if (!isDeletedFile(workingHeader) && !isDummyHeader(workingAddress, workingHeader)) {
+					workingHeader.nextFile = 0;
+					workingHeader.flags &= KIND_BITS;
+
+					burstBegin();
+					r = burstWrite(writeAddress, sizeof(fileHeader), &workingHeader);
+					if (r == result::NO_ERROR)
+						r = copyBytes(workingAddress + sizeof(fileHeader), writeAddress + sizeof(fileHeader), workingHeader.fileSize);
+					if (r == result::NO_ERROR)
+						r = burstEnd();
+					if (r == result::NO_ERROR && lastCopy != 0)
+						r = writeNextFile(lastCopy, writeAddress);
+					if (r != result::NO_ERROR)
+						return r;
+
+					lastCopy = writeAddress;
+					writeAddress += sizeof(fileHeader) + workingHeader.fileSize;
 				}
-			}
 
-			// None of the conditions match: continue the search
-			workingAddress = workingHeader.nextFile;
-		}
+				if (nextFile == 0)
+					break;
 
-		// See if there's enough space in the EEPROM to fit our file in
-		if (writeAddress + sizeRequired - 1 > endOfEEPROM)
-			return result::INSUFFICIENT_SPACE;
+				workingAddress = nextFile;
+			}
 
-		// We have a pointer to an address that has sufficient space to store our
-		// data, in writeAddress.
-		//
-		// We have a pointer to the previous header in workingAddress
-		//
-		// We have a copy of the previous header in workingHeader
-		//
-		// First, constuct a header for this file:
+			// With no files, the chain is just a dummy header
+			if (lastCopy == 0) {
+				memset(&workingHeader, 0, sizeof(fileHeader));
+				padFilename("", workingHeader.fileID);
+				workingHeader.hash = hashFilename(workingHeader.fileID);
+				r = writeNBytesChk(writeAddress, sizeof(fileHeader), &workingHeader);
+				if (r != result::NO_ERROR)
+					return r;
+				writeAddress += sizeof(fileHeader);
+			}
 
-		newHeader.fileSize = size;
-		if (workingHeader.nextFile == 0)
-			newHeader.nextFile = 0;
-		else
-			newHeader.nextFile = workingHeader.nextFile;
-		newHeader.flags = 0;
+			// Switch halves, then spoil the old half's identifying info. Until
+			// that's done, the later generation wins.
+			info.generation++;
+			r = writeNBytesChk(to, sizeof(FSInfo), &info);
+			if (r != result::NO_ERROR)
+				return r;
 
-		// Now, alter the previous file's header to point to this new file
-		workingHeader.nextFile = writeAddress;
+			char spoilt[4];
+			memset(spoilt, 0xFF, sizeof(spoilt));
+			r = writeNBytesChk(from, sizeof(spoilt), spoilt);
+			if (r != result::NO_ERROR)
+				return r;
 
-		// Write the headers and the data
-		writeNBytesChk(workingAddress, sizeof(fileHeader), &workingHeader);
-		writeNBytesChk(writeAddress, sizeof(fileHeader), &newHeader);
-		return writeNBytesChk(writeAddress + sizeof(fileHeader), size, data);
+			vol->flashBase = to;
+			vol->blankFrom = writeAddress;
+			return result::NO_ERROR;
+		}
 	}
+#endif
 
-	result deleteFile(const char * filename) {
+	result compact() {
 
 		// Confirm that the EEPROM is managed by this version of OSFS
-		result r = checkLibVersion();
+		result r = checkSession();
 
 		if (r != result::NO_ERROR)
 			return r;
 
-		// Store padded filename in filenamePadded
-		char filenamePadded[FILE_NAME_LENGTH];
-		padFilename(filename, filenamePadded);
+#if OSFS_FLASH_BLOCK_SIZE > 0
+		r = collectGarbage();
+		if (r != result::NO_ERROR)
+			return r;
+#else
 
-		// Get the first header
+		// Walk the chain, moving each live file down into the free space
+		// before it. Free space starts either at a deleted header, which the
+		// moved file's header replaces, or after the contents of a live file,
+		// which must then be pointed at the moved file. Either way, we call
+		// that header the owner of the free space.
+		//
+		// Every step is a single write which leaves the chain intact:
+		// 	1) The owner is pointed straight at the file to be moved, so that
+		// 	   any deleted headers in between can be overwritten
+		// 	2) The file's contents are copied into the free space
+		// 	3) If the owner is a live file, the file's header is copied
+		// 	   after it, and then the owner is pointed at the copy
+		// 	4) If the owner is a deleted header, it's still in the chain, so
+		// 	   the copy's header goes over it as a deleted file which still
+		// 	   links to the original. A write cut short there changes neither
+		// 	   its flags nor its link. The copy is then made a pending
+		// 	   replacement for the original, linked past it and completed:
+		// 	   recover() keeps exactly one of the two if the power fails
+		// 	   in between.
+		// The original is only abandoned once the copy is complete. Files
+		// which would overlap their own copy aren't moved.
 		fileHeader workingHeader;
-		uint16_t workingAddress = startOfEEPROM + sizeof(FSInfo);
+		address_t workingAddress = firstHeaderAddress();
+
+		address_t freeStart = 0; // = 0 if there's no free space before workingAddress
+		address_t owner = 0;
+		address_t ownerNext = 0;
 
-		// Loop through checking the file header until
-		// 	a) we reach a NULL pointer,
-		// 	b) we find our file and it's not deleted
-		// 	c) we get an OOL pointer somehow
 		while (true) {
 
 			// Load the next header
-			result r = readNBytesChk(workingAddress, sizeof(fileHeader), &workingHeader);
+			r = readNBytesChk(workingAddress, sizeof(fileHeader), &workingHeader);
 
 			// Quit if we're out of bounds
 			if (r != result::NO_ERROR)
 				return r;
 
-			// Delete the file if it has the same name and isn't already deleted
-			if (!isDeletedFile(workingHeader) && 0 == strncmp(workingHeader.fileID, filenamePadded, FILE_NAME_LENGTH)) {
-				workingHeader.flags = workingHeader.flags | 1<<DELBIT;
-				r = writeNBytesChk(workingAddress, sizeof(fileHeader), &workingHeader);
+			address_t nextFile = workingHeader.nextFile;
 
-				if (r != result::NO_ERROR)
-					return r;
+			if (isDeletedFile(workingHeader) || isDummyHeader(workingAddress, workingHeader)) {
+				// Start some free space here, unless we're in some already
+				if (freeStart == 0) {
+					freeStart = workingAddress;
+					owner = workingAddress;
+					ownerNext = nextFile;
+				}
+			} else {
+				address_t fileLength = sizeof(fileHeader) + workingHeader.fileSize;
 
-				return result::NO_ERROR;
+				if (freeStart != 0) {
+					// Skip any deleted headers between the owner and this file
+					if (ownerNext != workingAddress) {
+						r = writeNextFile(owner, workingAddress);
+						if (r != result::NO_ERROR)
+							return r;
+					}
+
+					// Move the file down, if it doesn't overlap itself
+					if (freeStart + fileLength <= workingAddress) {
+						burstBegin();
+						r = copyBytes(workingAddress + sizeof(fileHeader), freeStart + sizeof(fileHeader), workingHeader.fileSize);
+						if (r == result::NO_ERROR)
+							r = burstEnd();
+						if (r != result::NO_ERROR)
+							return r;
+
+						if (owner != freeStart) {
+							r = writeNBytesChk(freeStart, sizeof(fileHeader), &workingHeader);
+							if (r == result::NO_ERROR)
+								r = writeNextFile(owner, freeStart);
+						} else {
+							fileHeader copyHeader = workingHeader;
+							copyHeader.nextFile = workingAddress;
+							copyHeader.flags |= 1<<DELBIT | 1<<PENDBIT;
+							r = writeNBytesChk(freeStart, sizeof(fileHeader), &copyHeader);
+							if (r == result::NO_ERROR)
+								r = clearFlags(freeStart, copyHeader.flags, 1<<DELBIT);
+							if (r == result::NO_ERROR)
+								r = writeNextFile(freeStart, workingHeader.nextFile);
+							if (r == result::NO_ERROR)
+								r = clearFlags(freeStart, copyHeader.flags, 1<<PENDBIT);
+						}
+						if (r != result::NO_ERROR)
+							return r;
+
+#if OSFS_DIR_INDEX_SIZE > 0
+						r = dirIndexUpdate(workingHeader.fileID, workingAddress, freeStart);
+						if (r != result::NO_ERROR)
+							return r;
+#endif
+
+						workingAddress = freeStart;
+					}
+				}
+
+				// Any space left after this file's contents is free
+				freeStart = workingAddress + fileLength;
+				owner = workingAddress;
+				ownerNext = nextFile;
+
+				if (freeStart == nextFile)
+					freeStart = 0;
 			}
 
-			// Quit if we get a NULL pointer
-			if (workingHeader.nextFile == 0)
-				return result::FILE_NOT_FOUND;
+			if (nextFile == 0)
+				break;
 
-			// Next file
-			workingAddress = workingHeader.nextFile;
+			workingAddress = nextFile;
 		}
 
-		// We will never get here
-		return result::UNDEFINED_ERROR;
+		// If the chain ends in free space, end it at the owner instead
+		if (freeStart != 0 && ownerNext != 0) {
+			r = writeNextFile(owner, 0);
+			if (r != result::NO_ERROR)
+				return r;
+		}
+
+#if OSFS_DIR_INDEX_SIZE > 0
+		// Check the index against the chain, in case an earlier compact() was
+		// cut short after moving a file but before updating its slot
+		r = dirIndexRecover(false);
+		if (r != result::NO_ERROR)
+			return r;
+#endif
+#endif
+
+		// Files have moved, so reload everything we know about the chain
+		if (vol->session.mounted)
+			return scanChain();
+
+		forgetChain();
+		return result::NO_ERROR;
 	}
 
 	result checkLibVersion(uint16_t& ver) {
@@ -235,7 +3757,13 @@ namespace OSFS {
 		// Load the identifying info
 		FSInfo theROMInfo;
 
-		readNBytesChk(startOfEEPROM, sizeof(FSInfo), &theROMInfo);
+#if OSFS_FLASH_BLOCK_SIZE > 0
+		if (!vol->flashBaseKnown)
+			findFlashBase();
+		readNBytesChk(vol->flashBase, sizeof(FSInfo), &theROMInfo);
+#else
+		readNBytesChk(storageStart(), sizeof(FSInfo), &theROMInfo);
+#endif
 
 		// Check for the ID string
 		if (0 != strncmp(theROMInfo.idStr, OSFS_ID_STR, 4)) {
@@ -253,46 +3781,174 @@ namespace OSFS {
 		return result::NO_ERROR;
 	}
 
+	result scrub(unsigned int maxFiles, bool& passComplete, char* corruptFilename) {
+		passComplete = false;
+
+		// Confirm that the EEPROM is managed by this version of OSFS
+		result r = checkSession();
+
+		if (r != result::NO_ERROR)
+			return r;
+
+#if OSFS_CRC
+		fileHeader workingHeader;
+		address_t workingAddress = firstHeaderAddress();
+		address_t resumeAfter = vol->scrubAddress; // Files up to here were checked by earlier calls
+		unsigned int checked = 0;
+
+		// Carry on from the file the last call stopped at, if it's unchanged.
+		// Otherwise it's been rewritten, deleted or moved, so walk the chain
+		// from the start to the first header after it.
+		if (resumeAfter != 0) {
+			r = readNBytesChk(resumeAfter, sizeof(fileHeader), &workingHeader);
+			if (r != result::NO_ERROR)
+				return r;
+
+			if (!isDeletedFile(workingHeader) && workingHeader.crc == vol->scrubCrc &&
+					workingHeader.nextFile > resumeAfter) {
+				workingAddress = workingHeader.nextFile;
+				resumeAfter = 0;
+			}
+		}
+
+		while (checked < maxFiles) {
+			r = readNBytesChk(workingAddress, sizeof(fileHeader), &workingHeader);
+			if (r != result::NO_ERROR)
+				return r;
+
+			// Logs are passed over, since their CRCs aren't kept up to date
+			if (workingAddress > resumeAfter && !isDeletedFile(workingHeader) &&
+					!isDummyHeader(workingAddress, workingHeader) && !(workingHeader.flags & 1<<LOGBIT)) {
+				// A size which runs past the next header is corrupt, whatever
+				// the CRC says
+				bool corrupt = sizeof(fileHeader) + workingHeader.fileSize >
+					slotSize(workingAddress, workingHeader.nextFile);
+				if (!corrupt) {
+					uint16_t crc;
+					r = fileCrc(workingAddress, workingHeader, crc);
+					if (r != result::NO_ERROR)
+						return r;
+					corrupt = crc != workingHeader.crc;
+				}
+
+				checked++;
+				vol->scrubAddress = workingAddress;
+				vol->scrubCrc = workingHeader.crc;
+
+				if (corrupt) {
+					if (corruptFilename)
+						unpadFilename(workingHeader.fileID, corruptFilename);
+					r = result::CORRUPT_FILE;
+				}
+			}
+
+			if (workingHeader.nextFile == 0) {
+				vol->scrubAddress = 0;
+				passComplete = true;
+				return r;
+			}
+
+			if (r != result::NO_ERROR)
+				return r;
+
+			workingAddress = workingHeader.nextFile;
+		}
+
+		return result::NO_ERROR;
+#else
+		(void)maxFiles;
+		(void)corruptFilename;
+		passComplete = true;
+		return result::NO_ERROR;
+#endif
+	}
+
 	result format() {
 
+		// Formatting ends any session, since all state is thrown away
+		unmount();
+		forgetChain();
+		abortBatch();
+		vol->recovered = true;
+#if OSFS_CRC
+		vol->scrubAddress = 0;
+#endif
+
 		// Create identifying info for this version
 		FSInfo thisInfo;
+		memset(&thisInfo, 0, sizeof(FSInfo));
 
 		strncpy(thisInfo.idStr, OSFS_ID_STR, 4);
 		thisInfo.version = OSFS_VER;
 
+#if OSFS_FLASH_BLOCK_SIZE > 0
+		// Start with both halves erased, using the first
+		thisInfo.generation = 0;
+		result r = eraseHalf(storageStart());
+		if (r == result::NO_ERROR)
+			r = eraseHalf(storageStart() + flashHalfSize());
+		if (r != result::NO_ERROR)
+			return r;
+
+		vol->flashBase = storageStart();
+		vol->flashBaseKnown = true;
+		vol->blankFrom = firstHeaderAddress() + sizeof(fileHeader);
+
+		r = writeNBytesChk(storageStart(), sizeof(FSInfo), &thisInfo);
+#else
 		// Write this to the FS
-		result r = writeNBytesChk(startOfEEPROM, sizeof(FSInfo), &thisInfo);
+		result r = writeNBytesChk(storageStart(), sizeof(FSInfo), &thisInfo);
+#endif
+
+		if (r != result::NO_ERROR)
+			return r;
+
+#if OSFS_DIR_INDEX_SIZE > 0
+		r = dirIndexClear();
 
 		if (r != result::NO_ERROR)
 			return r;
+#endif
 
 		// Create a dummy file header, marking where the next file will go
 		fileHeader dummyHeader;
+		memset(&dummyHeader, 0, sizeof(fileHeader));
 		padFilename("", dummyHeader.fileID);
-		dummyHeader.fileSize = 0;
-		dummyHeader.nextFile = 0;
-		dummyHeader.flags = 0;
+		dummyHeader.hash = hashFilename(dummyHeader.fileID);
 
 		// Store this after the FS identifying info
-		return writeNBytesChk(startOfEEPROM + sizeof(FSInfo), sizeof(fileHeader), &dummyHeader);
+		return writeNBytesChk(firstHeaderAddress(), sizeof(fileHeader), &dummyHeader);
 	}
 
-	result writeNBytesChk(uint16_t address, unsigned int num, const void* input) {
-		if (address < startOfEEPROM || address > endOfEEPROM) return result::UNCAUGHT_OOR;
-		if (address + num < startOfEEPROM || address + num > endOfEEPROM) return result::UNCAUGHT_OOR;
+	result writeNBytesChk(address_t address, unsigned int num, const void* input) {
+		if (address < storageStart() || address > storageEnd()) return result::UNCAUGHT_OOR;
+		if (address + num < storageStart() || address + num > storageEnd()) return result::UNCAUGHT_OOR;
+
+		if (num == 0)
+			return result::NO_ERROR;
 
-		writeNBytes(address, num, (byte*)input);
+#if OSFS_CACHE_PAGES > 0
+		cacheWrite(address, num, (const byte*)input);
+#else
+		deviceWrite(address, num, (const byte*)input);
+#endif
 
 		return result::NO_ERROR;
 	}
 
-	result readNBytesChk(uint16_t address, unsigned int num, void* output) {
+	result readNBytesChk(address_t address, unsigned int num, void* output) {
 
-		if (address < startOfEEPROM || address > endOfEEPROM) return result::UNCAUGHT_OOR;
-		if (address + num < startOfEEPROM || address + num > endOfEEPROM) return result::UNCAUGHT_OOR;
+		if (address < storageStart() || address > storageEnd()) return result::UNCAUGHT_OOR;
+		if (address + num < storageStart() || address + num > storageEnd()) return result::UNCAUGHT_OOR;
 
-		readNBytes(address, num, (byte*)output);
+		if (num == 0)
+			return result::NO_ERROR;
+
+#if OSFS_CACHE_PAGES > 0
+		cacheRead(address, num, (byte*)output);
+#else
+		deviceRead(address, num, (byte*)output);
+#endif
 
 		return result::NO_ERROR;
 	}
@@ -316,4 +3972,190 @@ namespace OSFS {
 		}
 	}
 
+	paddedName padName(const char* filename) {
+		paddedName name;
+		padFilename(filename, name.id);
+		name.hash = hashFilename(name.id);
+		return name;
+	}
+
+	uint8_t hashFilename(const char * paddedFilename) {
+		uint8_t hash = 0;
+		for (unsigned int i = 0; i < FILE_NAME_LENGTH; i++)
+			hash = hash * 31 + (uint8_t)paddedFilename[i];
+		return hash;
+	}
+
+	uint16_t crc16(uint16_t crc, const void* data, unsigned int num) {
+		static const uint16_t table[16] = {
+			0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+			0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef
+		};
+
+		const uint8_t* bytes = (const uint8_t*)data;
+		for (unsigned int i = 0; i < num; i++) {
+			crc = (crc << 4) ^ table[(crc >> 12) ^ (bytes[i] >> 4)];
+			crc = (crc << 4) ^ table[(crc >> 12) ^ (bytes[i] & 0x0F)];
+		}
+		return crc;
+	}
+
+#if OSFS_VOLUMES
+	// Each of the methods of a volume makes it the current one, then does the
+	// same as the function of its name
+
+	result VolumeBase::getFileInfo(const paddedName& filename, address_t& filePointer, address_t& fileSize) {
+		volumeScope scope(&state);
+		return OSFS::getFileInfo(filename, filePointer, fileSize);
+	}
+
+	result VolumeBase::verifyContents(address_t filePointer, const void* contents, address_t size) {
+		volumeScope scope(&state);
+		return OSFS::verifyContents(filePointer, contents, size);
+	}
+
+	result VolumeBase::getFile(const paddedName& filename, void* buf, unsigned int size, bool verify) {
+		volumeScope scope(&state);
+		return OSFS::getFile(filename, buf, size, verify);
+	}
+
+	result VolumeBase::newFile(const paddedName& filename, void* data, unsigned int size, bool overwrite,
+			bool compress) {
+		volumeScope scope(&state);
+		return OSFS::newFile(filename, data, size, overwrite, compress);
+	}
+
+	result VolumeBase::deleteFile(const paddedName& filename) {
+		volumeScope scope(&state);
+		return OSFS::deleteFile(filename);
+	}
+
+	result VolumeBase::beginBatch() {
+		volumeScope scope(&state);
+		return OSFS::beginBatch();
+	}
+
+	result VolumeBase::commit() {
+		volumeScope scope(&state);
+		return OSFS::commit();
+	}
+
+	void VolumeBase::abortBatch() {
+		volumeScope scope(&state);
+		OSFS::abortBatch();
+	}
+
+	result VolumeBase::open(File& file, const paddedName& filename, bool create) {
+		volumeScope scope(&state);
+		return file.open(filename, create);
+	}
+
+	result VolumeBase::next(Dir& dir, dirEntry& entry) {
+		volumeScope scope(&state);
+		return dir.next(entry);
+	}
+
+#if OSFS_FLASH_BLOCK_SIZE == 0
+	result VolumeBase::open(Log& log, const paddedName& filename, uint8_t recordSize, address_t capacity) {
+		volumeScope scope(&state);
+		return log.open(filename, recordSize, capacity);
+	}
+#endif
+
+	result VolumeBase::getFsStats(fsStats& stats) {
+		volumeScope scope(&state);
+		return OSFS::getFsStats(stats);
+	}
+
+	result VolumeBase::compact() {
+		volumeScope scope(&state);
+		return OSFS::compact();
+	}
+
+	result VolumeBase::scrub(unsigned int maxFiles, bool& passComplete, char* corruptFilename) {
+		volumeScope scope(&state);
+		return OSFS::scrub(maxFiles, passComplete, corruptFilename);
+	}
+
+	result VolumeBase::format() {
+		volumeScope scope(&state);
+		return OSFS::format();
+	}
+
+	result VolumeBase::mount() {
+		volumeScope scope(&state);
+		return OSFS::mount();
+	}
+
+	void VolumeBase::unmount() {
+		volumeScope scope(&state);
+		OSFS::unmount();
+	}
+
+	bool VolumeBase::isMounted() {
+		volumeScope scope(&state);
+		return OSFS::isMounted();
+	}
+
+	result VolumeBase::checkLibVersion(uint16_t& ver) {
+		volumeScope scope(&state);
+		return OSFS::checkLibVersion(ver);
+	}
+
+	void VolumeBase::setAllocPolicy(allocPolicy policy) {
+		volumeScope scope(&state);
+		OSFS::setAllocPolicy(policy);
+	}
+
+	void VolumeBase::setOverwriteInPlace(bool allow) {
+		volumeScope scope(&state);
+		OSFS::setOverwriteInPlace(allow);
+	}
+
+	const uint32_t* VolumeBase::getWearHistogram() {
+		volumeScope scope(&state);
+		return OSFS::getWearHistogram();
+	}
+
+	void VolumeBase::clearWearHistogram() {
+		volumeScope scope(&state);
+		OSFS::clearWearHistogram();
+	}
+
+	result VolumeBase::sync() {
+		volumeScope scope(&state);
+		return OSFS::sync();
+	}
+
+	cacheStats VolumeBase::getCacheStats() {
+		volumeScope scope(&state);
+		return OSFS::getCacheStats();
+	}
+
+	void VolumeBase::clearCacheStats() {
+		volumeScope scope(&state);
+		OSFS::clearCacheStats();
+	}
+
+	opStats VolumeBase::getOpStats() {
+		volumeScope scope(&state);
+		return OSFS::getOpStats();
+	}
+
+	void VolumeBase::clearOpStats() {
+		volumeScope scope(&state);
+		OSFS::clearOpStats();
+	}
+
+	void VolumeBase::setTraceCallback(traceCallback callback) {
+		volumeScope scope(&state);
+		OSFS::setTraceCallback(callback);
+	}
+
+	void VolumeBase::invalidateDirCache() {
+		volumeScope scope(&state);
+		OSFS::invalidateDirCache();
+	}
+#endif
+
 }
@@ -15,12 +15,19 @@
  * -----------------------
  * HEADER
  * 	File ID and extension (8+3 bytes)
- * 	Size of file (uint16_t = 2 bytes)
- * 	Pointer to start of next file's header (uint16_t = 2 bytes)
- * 	Flags (uint8_t = 1 bytes. MSB = 1 for deleted file, 0 for valid. Other bits reserved)
+ * 	Size of file (address_t = 2 bytes, or 4 if OSFS_ADDRESS_BITS is 32)
+ * 	Pointer to start of next file's header (address_t = 2 or 4 bytes)
+ * 	Flags (uint8_t = 1 bytes. MSB = 1 for deleted file, 0 for valid. Bit 6 = 1
+ * 	while the file is replacing another of the same name. Bit 5 = 1 on the
+ * 	first file of a batch until the batch is complete. Bit 2 = 1 for a log.
+ * 	Bit 1 = 1 if the contents are compressed. Other bits reserved)
+ * 	Hash of the file ID (uint8_t = 1 byte, so that searches can skip most
+ * 	files without reading their IDs)
+ * 	CRC-16 of the file's name and contents (uint16_t, only if OSFS_CRC is set)
  * -----------------------
  * FILE CONTENTS
- * 	Binary data with no restrictions (<Size of file> bytes)
+ * 	Binary data with no restrictions (<Size of file> bytes). If compressed,
+ * 	the size of the data (address_t) followed by the data compressed.
  * -----------------------
  *
  * <Size of file> and <pointer to next> are both present because a file may not
@@ -35,36 +42,285 @@
  *
  * Unless these 6 bytes match their expected values, this library will consider
  * the EEPROM to be unformatted and will refuse to work with it until format() is called.
+ *
+ * If OSFS_DIR_INDEX_SIZE is set, these are followed by the directory index: a
+ * hash table of OSFS_DIR_INDEX_SIZE dirIndexEntry structs, each pointing to the
+ * header of a file. The first file header comes after it.
  */
 
 #pragma once
 
 #include <Arduino.h>
 
+/*
+ * Compile-time options
+ *
+ * These may be overridden by defining them before this file is compiled, e.g.
+ * with -D flags. All of them default to the smallest possible footprint.
+ */
+
+// Number of files to remember in a RAM-resident directory cache. Each entry
+// holds the file's name, so costs 16 bytes of RAM, or 20 with 32 bit
+// addresses. Set to 0 to disable the cache entirely.
+#ifndef OSFS_DIR_CACHE_SIZE
+	#define OSFS_DIR_CACHE_SIZE 0
+#endif
+
+// Number of buckets in a histogram of bytes written to each part of the
+// EEPROM, for checking how evenly it's being worn. Each bucket costs 4 bytes of
+// RAM. Set to 0 to disable the histogram.
+#ifndef OSFS_WEAR_BUCKETS
+	#define OSFS_WEAR_BUCKETS 0
+#endif
+
+// Number of deleted files to remember in a RAM-resident index of free space,
+// so that newFile can choose where to put a file without searching the EEPROM.
+// Only used while mounted. Each entry costs 4 bytes of RAM, or 8 with 32 bit
+// addresses. Set to 0 to disable the index.
+#ifndef OSFS_FREE_INDEX_SIZE
+	#define OSFS_FREE_INDEX_SIZE 0
+#endif
+
+// Size in bytes of the pages of the EEPROM, if it's written a page at a time.
+// When set, newFile combines a file's header and contents into as few calls to
+// writeNBytes as possible, none of which crosses the boundary between two pages.
+// Smaller writes, of a few bytes of a header or of a slot of the directory
+// index, may still cross a boundary. Costs a buffer of this many bytes of RAM.
+// Set to 0 if the EEPROM is written a byte at a time.
+#ifndef OSFS_PAGE_SIZE
+	#define OSFS_PAGE_SIZE 0
+#endif
+
+// Number of pages of the EEPROM to hold in a RAM-resident write-back cache.
+// Reads and writes within a page are served from the cache, and changes only
+// reach the EEPROM when their page is evicted or sync() is called. Each page
+// costs OSFS_CACHE_PAGE_SIZE + 12 bytes of RAM. Set to 0 to disable the cache.
+#ifndef OSFS_CACHE_PAGES
+	#define OSFS_CACHE_PAGES 0
+#endif
+
+// Size in bytes of each page of the cache. Defaults to OSFS_PAGE_SIZE, if
+// that's set, so that pages of the cache line up with pages of the EEPROM.
+#ifndef OSFS_CACHE_PAGE_SIZE
+	#if OSFS_PAGE_SIZE > 0
+		#define OSFS_CACHE_PAGE_SIZE OSFS_PAGE_SIZE
+	#else
+		#define OSFS_CACHE_PAGE_SIZE 16
+	#endif
+#endif
+
+// Set to 1 if writing to the EEPROM costs more than reading from it. Before
+// each write, OSFS will then read back what's already there and leave out any
+// bytes at either end which wouldn't change, skipping the write entirely if
+// none would. Leave at 0 if writeNBytes already does this, e.g. by calling
+// EEPROM.update.
+#ifndef OSFS_COMPARE_WRITES
+	#define OSFS_COMPARE_WRITES 0
+#endif
+
+// Number of slots in a directory index kept in the EEPROM, so that files can
+// be found without walking the header chain. Must be a power of two, and
+// should be comfortably more than the number of files expected: once the index
+// is full, lookups of files left out of it walk the chain as usual. Each slot
+// costs 3 bytes of EEPROM, or 5 with 32 bit addresses. Storage formatted with
+// a different size of index is reported as WRONG_VERSION. Set to 0 to disable
+// the index.
+#ifndef OSFS_DIR_INDEX_SIZE
+	#define OSFS_DIR_INDEX_SIZE 0
+#endif
+
+// Width in bits of addresses and file sizes: 16 or 32. 16 bits can address up
+// to 64 KB. 32 bits are needed for larger storage, such as SPI flash, at the
+// cost of 4 more bytes in each file header and a little more code and RAM.
+// The two layouts are incompatible, so storage formatted with one is reported
+// as WRONG_VERSION by the other.
+#ifndef OSFS_ADDRESS_BITS
+	#define OSFS_ADDRESS_BITS 16
+#endif
+
+// Set to 1 to store a CRC of each file's name and contents in its header, so
+// that corruption of the EEPROM can be detected: see getFile's verify parameter
+// and scrub(). Costs 2 bytes of EEPROM per file. Rewriting part of a file
+// through File, other than at its end, then reads back the whole file to
+// update its CRC. Storage formatted with a different setting is reported as
+// WRONG_VERSION.
+#ifndef OSFS_CRC
+	#define OSFS_CRC 0
+#endif
+
+// Number of files which can be stored in one batch, between beginBatch() and
+// commit(). Each costs 6 bytes of RAM, or 10 with 32 bit addresses. Set to 0
+// to disable batches, in which case newFile always stores files straight away.
+#ifndef OSFS_BATCH_SIZE
+	#define OSFS_BATCH_SIZE 0
+#endif
+
+// Set to 1 to count what OSFS does with the storage, for finding out why an
+// operation is slow: see getOpStats() and setTraceCallback(). Costs 38 bytes
+// of RAM on AVR. When 0, none of the counting is compiled in.
+#ifndef OSFS_INSTRUMENT
+	#define OSFS_INSTRUMENT 0
+#endif
+
+// Size in bytes of the erase blocks of NOR flash, or 0 for EEPROM and other
+// storage which can be rewritten a byte at a time. On flash, OSFS only ever
+// clears bits, except when it erases whole blocks with the user-provided
+// eraseBlock. The storage is split into two halves of whole blocks, one of
+// which holds the files. New files always go at the end of the chain, and
+// the space of deleted files is only reclaimed by compact(), which copies the
+// live files into the other half. newFile calls it when it runs out of room.
+// startOfEEPROM must be the start of a block. The directory index isn't
+// available on flash.
+#ifndef OSFS_FLASH_BLOCK_SIZE
+	#define OSFS_FLASH_BLOCK_SIZE 0
+#endif
+
+// Set to 1 to let newFile store files compressed: see the compress parameter
+// of the form which takes a size. getFile, File and Dir uncompress them as
+// they read them. The codec needs no heap: it looks for repeats at most 64
+// bytes back, so reading a compressed file takes about 100 bytes of stack, and
+// each File costs about 80 more bytes of RAM, to carry on from where the last
+// read stopped. Reading back before that starts again from the beginning of
+// the file. Files which are stored compressed can't be written to through
+// File. Storage
+// formatted with a different setting is reported as WRONG_VERSION.
+#ifndef OSFS_COMPRESS
+	#define OSFS_COMPRESS 0
+#endif
+
+// Set to 1 to allow Volume, which keeps files on storage devices of their own
+// alongside the default one. OSFS then reaches the state of the volume it's
+// working on through a pointer, and checks on every access to the storage
+// whether that's the default one, which slows down every call a little. File,
+// Dir and Log each cost another pointer of RAM. When 0, the default volume is
+// reached directly, as if there were no volumes.
+#ifndef OSFS_VOLUMES
+	#define OSFS_VOLUMES 0
+#endif
+
 namespace OSFS {
+	// Type of addresses in the EEPROM and of file sizes
+#if OSFS_ADDRESS_BITS == 16
+	typedef uint16_t address_t;
+#elif OSFS_ADDRESS_BITS == 32
+	typedef uint32_t address_t;
+#else
+	#error "OSFS_ADDRESS_BITS must be 16 or 32"
+#endif
+
 	// File name lengths
 	constexpr size_t FILE_NAME_LENGTH = 11;
 
+	// Length of a name, up to its null terminator or max chars
+	constexpr size_t nameLength(const char* name, size_t max, size_t i = 0) {
+		return i < max && name[i] != '\0' ? nameLength(name, max, i + 1) : i;
+	}
+
+	// Char i of a name of the given length once padded with spaces
+	constexpr char paddedChar(const char* name, size_t length, size_t i) {
+		return i < length ? name[i] : ' ';
+	}
+
+	// hashFilename of a name once padded, from char i on
+	constexpr uint8_t paddedHash(const char* name, size_t length, size_t i = 0, uint8_t hash = 0) {
+		return i == FILE_NAME_LENGTH ? hash :
+			paddedHash(name, length, i + 1, uint8_t(hash * 31 + (uint8_t)paddedChar(name, length, i)));
+	}
+
+	// A list of the indices 0 to N - 1, for expanding a name char by char
+	template <size_t... I> struct indexList {};
+	template <size_t N, size_t... I> struct makeIndexList : makeIndexList<N - 1, N - 1, I...> {};
+	template <size_t... I> struct makeIndexList<0, I...> { typedef indexList<I...> type; };
+
+	/**
+	 * @brief      A filename, padded to FILE_NAME_LENGTH chars, with its hash
+	 *
+	 *             Every function which takes a filename pads it and hashes
+	 *             it first. A paddedName made from a string literal is worked
+	 *             out at compile time instead, if it's declared constexpr:
+	 *
+	 *             constexpr OSFS::paddedName SETTINGS("settings");
+	 *
+	 *             Other strings are padded at run time by padName.
+	 */
+	struct paddedName {
+		char id[FILE_NAME_LENGTH]; // Not null terminated
+		uint8_t hash; // See hashFilename
+
+		template <size_t N>
+		constexpr paddedName(const char (&name)[N])
+			: paddedName(name, nameLength(name, N), typename makeIndexList<FILE_NAME_LENGTH>::type()) {}
+
+		paddedName() = default;
+
+	private:
+		template <size_t... I>
+		constexpr paddedName(const char* name, size_t length, indexList<I...>)
+			: id{paddedChar(name, length, I)...}, hash(paddedHash(name, length)) {}
+	};
+
+	/**
+	 * @brief      Pad and hash a filename at run time
+	 *
+	 * @param[in]  filename  The filename. More than FILE_NAME_LENGTH chars will
+	 *                       be ignored.
+	 *
+	 * @return     The padded name
+	 */
+	paddedName padName(const char* filename);
+
 	// User provided details about the EEPROM
-	extern uint16_t startOfEEPROM;
-	extern uint16_t endOfEEPROM;
-	extern void readNBytes(uint16_t address, unsigned int num, byte* output);
-	extern void writeNBytes(uint16_t address, unsigned int num, const byte* input);
+	extern address_t startOfEEPROM;
+	extern address_t endOfEEPROM;
+	extern void readNBytes(address_t address, unsigned int num, byte* output);
+	extern void writeNBytes(address_t address, unsigned int num, const byte* input);
+	extern void eraseBlock(address_t address); // Only needed if OSFS_FLASH_BLOCK_SIZE is set
 
 	struct fileHeader {
 		char fileID[FILE_NAME_LENGTH]; // Note that this string is not null terminated
-		uint16_t fileSize;
-		uint16_t nextFile; // = 0 if no next file
-		uint8_t flags; // MSB = 1 for deleted file, 0 for valid. Other bits reserved
+		address_t fileSize;
+		address_t nextFile; // = 0 if no next file
+		uint8_t flags; // See DELBIT, PENDBIT, BATCHBIT, LOGBIT and COMPBIT. Other bits reserved
+		uint8_t hash; // Of fileID: see hashFilename
+#if OSFS_CRC
+		uint16_t crc; // Of fileID then the contents: see crc16
+#endif
 	};
 
 	struct FSInfo {
 		char idStr[4]; // Note that this string is not null terminated
 		uint16_t version;
+#if OSFS_FLASH_BLOCK_SIZE > 0
+		uint8_t generation; // Of the half of the flash in use: see compact()
+#endif
+	};
+
+	// A slot of the directory index
+	struct dirIndexEntry {
+		address_t headerAddress; // = 0 if never used, 1 if the file was deleted
+		uint8_t hash; // Of the file's name: see hashFilename
 	};
 
-	// Flag meaning
-	constexpr int DELBIT = 7;
+	static_assert(OSFS_DIR_INDEX_SIZE != 1 && (OSFS_DIR_INDEX_SIZE & (OSFS_DIR_INDEX_SIZE - 1)) == 0 &&
+		OSFS_DIR_INDEX_SIZE <= 0x4000, "OSFS_DIR_INDEX_SIZE must be 0 or a power of two from 2 to 16384");
+	static_assert(OSFS_FLASH_BLOCK_SIZE == 0 || OSFS_DIR_INDEX_SIZE == 0,
+		"The directory index can't be used with OSFS_FLASH_BLOCK_SIZE");
+
+	// Offset from startOfEEPROM, or from the start of the half in use on
+	// flash, of the first file header
+	constexpr size_t FIRST_HEADER_OFFSET = sizeof(FSInfo) + OSFS_DIR_INDEX_SIZE * sizeof(dirIndexEntry);
+
+	// Flag meanings
+	constexpr int DELBIT = 7; // The file is deleted
+	constexpr int PENDBIT = 6; // The file replaces another, which hasn't been deleted yet
+	constexpr int BATCHBIT = 5; // The file starts a batch which isn't complete: see commit()
+	constexpr int LOGBIT = 2; // The file is a ring buffer: see Log
+	constexpr int COMPBIT = 1; // The file's contents are compressed: see OSFS_COMPRESS
+
+	// Bits can't be cleared on flash, so PENDBIT and BATCHBIT are cancelled
+	// by setting these instead. They're never set otherwise.
+	constexpr int PENDDONEBIT = 4;
+	constexpr int BATCHDONEBIT = 3;
 
 	enum class result {
 		NO_ERROR = 0,
@@ -75,11 +331,93 @@ namespace OSFS {
 		UNFORMATTED,
 		BUFFER_WRONG_SIZE,
 		FILE_ALREADY_EXISTS,
+		END_OF_FILE,
+		CORRUPT_FILE,
+		READ_ONLY,
 		UNDEFINED_ERROR
 	};
 
+	// Counts of how well the page cache is working
+	struct cacheStats {
+		uint32_t hits; // Accesses to pages which were already in the cache
+		uint32_t misses; // Accesses which had to load a page from the EEPROM
+		uint32_t flushes; // Writes of changed pages back to the EEPROM
+	};
+
+	// Counts of what OSFS has done with the storage: see getOpStats
+	struct opStats {
+		uint32_t reads; // Calls to readNBytes
+		uint32_t readBytes;
+		uint32_t writes; // Calls to writeNBytes
+		uint32_t writeBytes;
+		uint32_t lookups; // Searches of the header chain for a file
+		uint32_t chainHops; // Headers read by those searches
+		uint32_t allocations; // Searches for somewhere to put a file
+		uint32_t allocRetries; // Free slots passed over by those searches as too small
+		uint32_t erases; // Calls to eraseBlock
+	};
+
+	// Kinds of storage access reported to a traceCallback
+	enum class traceOp : uint8_t {
+		READ,
+		WRITE,
+		ERASE // Of the block at the address, with OSFS_FLASH_BLOCK_SIZE
+	};
+
+	// Called with each access to the storage: see setTraceCallback
+	typedef void (*traceCallback)(traceOp op, address_t address, unsigned int num);
+
+	// A file found by a Dir
+	struct dirEntry {
+		char name[FILE_NAME_LENGTH + 1]; // Without padding, and null terminated
+		address_t size; // Once uncompressed, if it's compressed
+		address_t filePointer; // Where its contents start, as given by getFileInfo
+	};
+
+	// How the EEPROM is being used: see getFsStats
+	struct fsStats {
+		address_t files; // Number of files
+		address_t deletedFiles; // Number of deleted files still in the chain
+		address_t chainLength; // Number of headers in the chain, of either kind
+		address_t used; // Bytes taken by files, including their headers
+		address_t free; // Bytes not taken by files, wherever they are
+		address_t largestFree; // The most newFile could use for one file, including its header
+	};
+
+	// Strategies for choosing where newFile puts files
+	enum class allocPolicy : uint8_t {
+		// Use the first free space that's large enough, starting from the
+		// beginning of the EEPROM. This keeps files packed together.
+		FIRST_FIT = 0,
+		// Rotate writes through the whole EEPROM: each new file goes in the
+		// first free space after the previous one, wrapping around when the
+		// end is reached, and overwritten files are always moved. This
+		// spreads wear evenly at the cost of some extra writes.
+		WEAR_LEVELING,
+		// Use the smallest free space that's large enough. This leaves the
+		// largest spaces free for large files.
+		BEST_FIT
+	};
+
 	#define OSFS_ID_STR "OSFS"
-	#define OSFS_VER 2
+
+	// Bits 8 to 11 of the version hold the log2 of the size of the directory
+	// index, or 0 if there isn't one
+	constexpr uint16_t dirIndexVersion(unsigned long size) {
+		return size <= 1 ? 0 : 0x100 + dirIndexVersion(size / 2);
+	}
+
+	// The version stored by format(). The 32 bit layout sets the top bit, CRCs
+	// set the next, flash the one after, compression the one after that, and
+	// the size of the directory index is included, so that no layout mistakes
+	// another for its own.
+	#define OSFS_LAYOUT_VER 3
+	#define OSFS_VER ((OSFS_ADDRESS_BITS == 32 ? 0x8000 : 0) | (OSFS_CRC ? 0x4000 : 0) | \
+		(OSFS_FLASH_BLOCK_SIZE > 0 ? 0x2000 : 0) | (OSFS_COMPRESS ? 0x1000 : 0) | \
+		OSFS::dirIndexVersion(OSFS_DIR_INDEX_SIZE) | OSFS_LAYOUT_VER)
+
+	// The value a CRC starts from: see crc16
+	constexpr uint16_t CRC_INIT = 0xFFFF;
 
 	/**
 	 * @brief      Write N bytes to the EEPROM
@@ -93,7 +431,7 @@ namespace OSFS {
 	 *
 	 * @return     Error status.
 	 */
-	result writeNBytesChk(uint16_t address, unsigned int num, const void* input);
+	result writeNBytesChk(address_t address, unsigned int num, const void* input);
 
 	/**
 	 * @brief      Reads N bytes from the EEPROM
@@ -107,13 +445,15 @@ namespace OSFS {
 	 *
 	 * @return     Error status.
 	 */
-	result readNBytesChk(uint16_t address, unsigned int num, void* input);
+	result readNBytesChk(address_t address, unsigned int num, void* input);
 
 	/**
 	 * @brief      Gets a pointer to the given file
 	 *
 	 *             Looks for the file specified by filename. If found, stores a
 	 *             pointer to this file and its size in filePointer and fileSize.
+	 *             For a compressed file, these are of its contents as stored:
+	 *             see OSFS_COMPRESS.
 	 *
 	 * @param      filename     The filename. Should be 11 chars long. More chars
 	 *                          will be ignored, less chars will be padded to 11.
@@ -122,7 +462,50 @@ namespace OSFS {
 	 *
 	 * @return     Error status.
 	 */
-	result getFileInfo(const char* filename, uint16_t& filePointer, uint16_t& fileSize);
+	result getFileInfo(const paddedName& filename, address_t& filePointer, address_t& fileSize);
+
+	inline result getFileInfo(const char* filename, address_t& filePointer, address_t& fileSize) {
+		return getFileInfo(padName(filename), filePointer, fileSize);
+	}
+
+	/**
+	 * @brief      Check the contents of a file against its CRC
+	 *
+	 *             For contents which have already been read, so that they
+	 *             needn't be read again. Always succeeds unless OSFS_CRC is set.
+	 *
+	 * @param[in]  filePointer  The file pointer, as given by getFileInfo
+	 * @param[in]  contents     The whole of the file's contents. Ignored if
+	 *                          the file is compressed, in which case its
+	 *                          contents are read back instead.
+	 * @param[in]  size         The size of contents
+	 *
+	 * @return     Error status. CORRUPT_FILE if they don't match.
+	 */
+	result verifyContents(address_t filePointer, const void* contents, address_t size);
+
+	/**
+	 * @brief      Reads out the given file into an output buffer
+	 *
+	 *             This function will check that the output buffer is of the
+	 *             right size to fit the data, uncompressing it if needed.
+	 *
+	 *             It is recommended to use the other form of this function.
+	 *
+	 * @param[in]  filename  The filename
+	 * @param[out] buf       The output buffer
+	 * @param[in]  size      The size of the output buffer
+	 * @param[in]  verify    Check the contents against the file's CRC. Has no
+	 *                       effect unless OSFS_CRC is set.
+	 *
+	 * @return     Error status. CORRUPT_FILE if verify is set and the check
+	 *             fails, in which case buf holds the corrupt contents.
+	 */
+	result getFile(const paddedName& filename, void* buf, unsigned int size, bool verify = false);
+
+	inline result getFile(const char* filename, void* buf, unsigned int size, bool verify = false) {
+		return getFile(padName(filename), buf, size, verify);
+	}
 
 	/**
 	 * @brief      Reads out the given file into an output buffer
@@ -132,23 +515,22 @@ namespace OSFS {
 	 *
 	 * @param[in]  filename  The filename
 	 * @param[out] buf       The output buffer
+	 * @param[in]  verify    Check the contents against the file's CRC. Has no
+	 *                       effect unless OSFS_CRC is set.
 	 *
 	 * @tparam     T         Type of output buffer: autodetected
 	 *
-	 * @return     Error status.
+	 * @return     Error status. CORRUPT_FILE if verify is set and the check
+	 *             fails, in which case buf holds the corrupt contents.
 	 */
 	template <typename T>
-	inline result getFile(const char* filename, T& buf) {
-		uint16_t add, size;
-		result r = getFileInfo(filename, add, size);
-
-		if (r != result::NO_ERROR)
-			return r;
-
-		if (size != sizeof(buf))
-			return result::BUFFER_WRONG_SIZE;
+	inline result getFile(const paddedName& filename, T& buf, bool verify = false) {
+		return getFile(filename, &buf, sizeof(buf), verify);
+	}
 
-		return readNBytesChk(add, size, &buf);
+	template <typename T>
+	inline result getFile(const char* filename, T& buf, bool verify = false) {
+		return getFile(padName(filename), &buf, sizeof(buf), verify);
 	}
 
 	/**
@@ -164,14 +546,22 @@ namespace OSFS {
 	 *                       be ignored, less chars will be padded to 11.
 	 * @param      data      Pointer to the data to be stored.
 	 * @param      size      Number of bytes to store, starting at `data`.
-	 * @param      overwrite Overwrite the named file is it is present. Note that
-	                         if you attempt to overwrite an existing file with a larger one
-	                         but there is insufficient space, the original file will still
-	                         be deleted.
+	 * @param      overwrite Overwrite the named file is it is present. If the new
+	                         file fits in the space of the original, it is written
+	                         over it in place. If there is insufficient space for
+	                         the new file, the original file is left untouched.
+	 * @param      compress  Store the file compressed, if that makes it smaller.
+	                         Has no effect unless OSFS_COMPRESS is set.
 	 *
 	 * @return     Error status.
 	 */
-	result newFile(const char* filename, void* data, unsigned int size, bool overwrite = false);
+	result newFile(const paddedName& filename, void* data, unsigned int size, bool overwrite = false,
+		bool compress = false);
+
+	inline result newFile(const char* filename, void* data, unsigned int size, bool overwrite = false,
+			bool compress = false) {
+		return newFile(padName(filename), data, size, overwrite, compress);
+	}
 
 	/**
 	 * @brief      Store a new file
@@ -183,20 +573,25 @@ namespace OSFS {
 	 * @param      filename  The filename. Should be 11 chars long. More chars will
 	 *                       be ignored, less chars will be padded to 11.
 	 * @param[in]  buf       The variable to be stored
-	 * @param      overwrite Overwrite the named file is it is present. Note that
-	                         if you attempt to overwrite an existing file with a larger one
-	                         but there is insufficient space, the original file will still
-	                         be deleted.
+	 * @param      overwrite Overwrite the named file is it is present. If the new
+	                         file fits in the space of the original, it is written
+	                         over it in place. If there is insufficient space for
+	                         the new file, the original file is left untouched.
 	 *
 	 * @tparam     T         Type to be stored (autodetected)
 	 *
 	 * @return     Error status.
 	 */
 	template <typename T>
-	inline result newFile(const char* filename, T& buf, bool overwrite = false) {
+	inline result newFile(const paddedName& filename, T& buf, bool overwrite = false) {
 		return newFile(filename, &buf, sizeof(buf), overwrite);
 	}
 
+	template <typename T>
+	inline result newFile(const char* filename, T& buf, bool overwrite = false) {
+		return newFile(padName(filename), &buf, sizeof(buf), overwrite);
+	}
+
 	/**
 	 * @brief      Deletes the file given
 	 *
@@ -206,19 +601,400 @@ namespace OSFS {
 	 *
 	 * @return     Error status
 	 */
-	result deleteFile(const char* filename);
+	result deleteFile(const paddedName& filename);
+
+	inline result deleteFile(const char* filename) {
+		return deleteFile(padName(filename));
+	}
+
+	/**
+	 * @brief      Start a batch of files
+	 *
+	 *             Files stored by newFile after this are written straight
+	 *             away, one after another after the end of the header chain,
+	 *             but can't be found until commit() makes all of them visible
+	 *             at once. This saves a check of the EEPROM, a walk of the
+	 *             chain and an update of the last header for each file. A
+	 *             power cut before commit() has finished leaves either all of
+	 *             the batch or none of it.
+	 *
+	 *             Until commit(), nothing but newFile may change the EEPROM.
+	 *             Each name may only be stored once in a batch, and at most
+	 *             OSFS_BATCH_SIZE files may be: newFile returns
+	 *             FILE_ALREADY_EXISTS or INSUFFICIENT_SPACE otherwise. Files
+	 *             which already exist outside the batch aren't noticed until
+	 *             commit(). Since a batch doesn't reuse the space left by
+	 *             deleted files, it may help to compact() first.
+	 *
+	 *             Any batch which has already been started is abandoned. Does
+	 *             nothing if OSFS_BATCH_SIZE is 0.
+	 *
+	 * @return     Error status.
+	 */
+	result beginBatch();
+
+	/**
+	 * @brief      Make the files of a batch visible
+	 *
+	 *             Files of the batch replace any existing files of the same
+	 *             name. If one of them was stored without overwrite and a file
+	 *             of its name already exists, none of the batch takes effect.
+	 *             Either way, the batch is then finished. Does nothing if
+	 *             there's no batch.
+	 *
+	 * @return     Error status.
+	 */
+	result commit();
+
+	/**
+	 * @brief      Abandon a batch without making any of its files visible
+	 */
+	void abortBatch();
+
+	// Everything OSFS keeps in RAM about one storage device: see Volume
+	struct volumeState;
+
+#if OSFS_COMPRESS
+	// Only for OSFS's own use: how far a File has got through uncompressing
+	// its contents
+	struct lzDecoder {
+		address_t input; // Address of the next compressed byte
+		address_t produced; // Number of bytes uncompressed so far
+		address_t count; // Bytes still to come from the current token
+		address_t distance; // Back to the bytes that token repeats, or 0 for a run
+		byte window[64]; // The last bytes uncompressed, for matches to refer back to
+	};
+#endif
+
+	/**
+	 * @brief      A handle for reading and writing part of a file at a time
+	 *
+	 *             Useful for files which are too large to hold in RAM. Data is
+	 *             read and written at the current position, which starts at 0
+	 *             and moves on past whatever is read or written. Writing past
+	 *             the end of the file grows it: into the free space after it if
+	 *             possible, otherwise by moving the file somewhere larger.
+	 *             Compressed files can only be read: see OSFS_COMPRESS.
+	 *
+	 *             The file must not be changed by other means while it's open.
+	 *             It stays on the volume it was opened on: see Volume.
+	 */
+	class File {
+	public:
+		/**
+		 * @brief      Open a file
+		 *
+		 * @param      filename  The filename
+		 * @param      create    Create an empty file if it doesn't exist
+		 *
+		 * @return     Error status.
+		 */
+		result open(const paddedName& filename, bool create = false);
+
+		result open(const char* filename, bool create = false) {
+			return open(padName(filename), create);
+		}
+
+		/**
+		 * @brief      Finish with the file
+		 */
+		void close();
+
+		bool isOpen() const { return headerAddress != 0; }
+		address_t size() const { return fileSize; }
+		address_t position() const { return filePosition; }
+
+		/**
+		 * @brief      Move the current position
+		 *
+		 * @param[in]  position  The new position. Must not be past the end of
+		 *                       the file.
+		 *
+		 * @return     Error status.
+		 */
+		result seek(address_t position);
+
+		/**
+		 * @brief      Read from the current position
+		 *
+		 * @param[out] buf   The output buffer
+		 * @param[in]  len   Number of bytes to read. If there are fewer than
+		 *                   this left, nothing is read and END_OF_FILE is
+		 *                   returned.
+		 *
+		 * @return     Error status.
+		 */
+		result read(void* buf, unsigned int len);
+
+		/**
+		 * @brief      Read from the given position
+		 *
+		 * @param[in]  offset  The position to read from
+		 * @param[out] buf     The output buffer
+		 * @param[in]  len     Number of bytes to read
+		 *
+		 * @return     Error status.
+		 */
+		result read(address_t offset, void* buf, unsigned int len);
+
+		/**
+		 * @brief      Write at the current position, growing the file if needed
+		 *
+		 * @param[in]  data  The data
+		 * @param[in]  len   Number of bytes to write
+		 *
+		 * @return     Error status. If INSUFFICIENT_SPACE, the file is unchanged.
+		 *             READ_ONLY if the file is compressed.
+		 */
+		result write(const void* data, unsigned int len);
+
+		/**
+		 * @brief      Write at the end of the file
+		 *
+		 * @param[in]  data  The data
+		 * @param[in]  len   Number of bytes to write
+		 *
+		 * @return     Error status. If INSUFFICIENT_SPACE, the file is unchanged.
+		 */
+		result append(const void* data, unsigned int len);
+
+	private:
+#if OSFS_VOLUMES
+		volumeState* volume = nullptr; // The one it was opened on
+#endif
+		address_t headerAddress = 0; // = 0 if not open
+		address_t fileSize = 0;
+		address_t filePosition = 0;
+#if OSFS_COMPRESS
+		address_t compressedSize = 0; // Of the contents as stored, or 0 if they aren't compressed
+		lzDecoder decoder; // How far reading has got through the compressed contents
+#endif
+	};
+
+	/**
+	 * @brief      A handle for listing the files, one at a time
+	 *
+	 *             Reads one header of the chain at a time, so needs no more
+	 *             RAM than this and a dirEntry. Files must not be created or
+	 *             deleted while a Dir is in use. It lists the volume it was
+	 *             on when it found the first file: see Volume.
+	 */
+	class Dir {
+	public:
+		/**
+		 * @brief      Find the next file
+		 *
+		 * @param[out] entry  Details of the file
+		 *
+		 * @return     Error status. END_OF_FILE once there are no more.
+		 */
+		result next(dirEntry& entry);
+
+		/**
+		 * @brief      Start again from the first file
+		 */
+		void rewind() { nextHeader = 0; }
+
+	private:
+#if OSFS_VOLUMES
+		volumeState* volume = nullptr; // The one it's listing
+#endif
+		address_t nextHeader = 0; // = 0 before the first file, 1 after the last
+	};
+
+#if OSFS_FLASH_BLOCK_SIZE == 0
+	/**
+	 * @brief      A handle for a log: a file holding a fixed number of records
+	 *             of a fixed size, where each new record replaces the oldest
+	 *             once it's full
+	 *
+	 *             Appending writes only the record and a 2 byte sequence
+	 *             number into the log's space, never a header, so it costs one
+	 *             write if OSFS_PAGE_SIZE is set and they fit in one page. The
+	 *             sequence numbers are how open() finds the newest record.
+	 *             If the power is cut during append(), the new record is lost
+	 *             but the others are kept.
+	 *
+	 *             A log is stored in a file of the given name, which holds the
+	 *             record size then a slot of recordSize + 2 bytes for each
+	 *             record, plus one spare. Its contents change without its CRC
+	 *             being updated, so it's skipped by scrub() and getFile's
+	 *             verify. It must only be changed through a Log while one has
+	 *             it open. Logs aren't available with OSFS_FLASH_BLOCK_SIZE,
+	 *             since a slot can't be rewritten without erasing it. Like
+	 *             File, it stays on the volume it was opened on.
+	 */
+	class Log {
+	public:
+		/**
+		 * @brief      Open a log, creating an empty one if it doesn't exist
+		 *
+		 * @param      filename    The filename
+		 * @param[in]  recordSize  Size of each record, in bytes
+		 * @param[in]  capacity    The most records the log holds, if it's
+		 *                         created. An existing log keeps its own.
+		 *
+		 * @return     Error status. BUFFER_WRONG_SIZE if an existing log has
+		 *             a different record size, if recordSize or capacity is 0
+		 *             or if capacity is 65534 or more. FILE_ALREADY_EXISTS if a
+		 *             file which isn't a log has the name.
+		 */
+		result open(const paddedName& filename, uint8_t recordSize, address_t capacity);
+
+		result open(const char* filename, uint8_t recordSize, address_t capacity) {
+			return open(padName(filename), recordSize, capacity);
+		}
+
+		/**
+		 * @brief      Finish with the log
+		 */
+		void close();
+
+		bool isOpen() const { return headerAddress != 0; }
+		address_t count() const { return records; }
+		address_t capacity() const { return slots - 1; }
+
+		/**
+		 * @brief      Add a record as the newest, dropping the oldest if full
+		 *
+		 * @param[in]  record  The record, of the log's record size
+		 *
+		 * @return     Error status.
+		 */
+		result append(const void* record);
+
+		/**
+		 * @brief      Read the next record, from oldest to newest
+		 *
+		 *             Records appended since the last rewind() are read too.
+		 *
+		 * @param[out] record  The output buffer, of the log's record size
+		 *
+		 * @return     Error status. END_OF_FILE after the newest record.
+		 */
+		result read(void* record);
+
+		/**
+		 * @brief      Start reading again from the oldest record
+		 */
+		void rewind() { readPosition = 0; }
+
+	private:
+#if OSFS_VOLUMES
+		volumeState* volume = nullptr; // The one it was opened on
+#endif
+		address_t headerAddress = 0; // = 0 if not open
+		address_t slots = 0; // Including the spare
+		uint8_t recordSize = 0;
+		address_t head = 0; // The slot the next record goes in
+		address_t records = 0;
+		uint16_t nextSeq = 0;
+		address_t readPosition = 0; // Records read since rewind()
+	};
+#endif
+
+	/**
+	 * @brief      Find out how the EEPROM is being used
+	 *
+	 *             Reads every header in the chain once.
+	 *
+	 * @param[out] stats  The counts
+	 *
+	 * @return     Error status.
+	 */
+	result getFsStats(fsStats& stats);
+
+	/**
+	 * @brief      Gather free space together
+	 *
+	 *             Moves files towards the start of the EEPROM to fill the
+	 *             space left by deleted files, so that it can be used for larger
+	 *             files. Files are never overwritten before their copy is
+	 *             complete, so this is safe against power loss. Files which
+	 *             are larger than the free space before them stay put.
+	 *
+	 *             On flash, the other half of the flash is erased instead and
+	 *             the live files are copied into it, one after another. It's
+	 *             only used once the copy is complete.
+	 *
+	 * @return     Error status.
+	 */
+	result compact();
+
+	/**
+	 * @brief      Check some files against their CRCs
+	 *
+	 *             Checks up to maxFiles files, carrying on from where the last
+	 *             call left off, so that the whole EEPROM can be checked a little
+	 *             at a time, e.g. once each time round loop(). If the file where
+	 *             the last call stopped has since been rewritten, deleted or
+	 *             moved, the call also reads the header of every file before
+	 *             that point. A file whose size doesn't fit between its header
+	 *             and the next is reported as corrupt. Files which are created or deleted during a pass may be
+	 *             checked twice or missed until the next pass. Does nothing
+	 *             unless OSFS_CRC is set.
+	 *
+	 * @param[in]  maxFiles         The most files to check
+	 * @param[out] passComplete     Set if every file has now been checked, in
+	 *                              which case the next call starts again from
+	 *                              the first file
+	 * @param[out] corruptFilename  If not null, and a corrupt file is found,
+	 *                              its name is written here, without padding
+	 *                              and null terminated. Must have room for
+	 *                              FILE_NAME_LENGTH + 1 chars.
+	 *
+	 * @return     Error status. CORRUPT_FILE if a corrupt file was found, in
+	 *             which case checking stops after it.
+	 */
+	result scrub(unsigned int maxFiles, bool& passComplete, char* corruptFilename = nullptr);
 
 	/**
 	 * @brief      Format the EEPROM
 	 *
 	 *             Clear all data from the EEPROM, readying it for use with this
 	 *             library. This does not actually erase the EEPROM, only writes to
-	 *             the FSInfo header and the first file block.
+	 *             the FSInfo header, the directory index if there is one, and the
+	 *             first file block.
 	 *
 	 * @return     Error status.
 	 */
 	result format();
 
+	/**
+	 * @brief      Start a session with the EEPROM
+	 *
+	 *             Checks once that the EEPROM is managed by this version of OSFS
+	 *             and remembers where the header chain ends. Until unmount() or
+	 *             format() is called, other functions will skip their own checks
+	 *             and OSFS will assume that nothing else modifies the EEPROM.
+	 *
+	 *             Anything left unfinished by a power cut is also dealt with:
+	 *             a file which was being replaced is left with either its old
+	 *             or its new contents, and the directory index is repaired if
+	 *             OSFS_DIR_INDEX_SIZE is set. Without mount(), this happens on
+	 *             the first call after a reset. Slots left in the index by
+	 *             deleted files are cleared out once there are many of them.
+	 *
+	 *             Mounting is optional: without it, every call checks the EEPROM
+	 *             for itself.
+	 *
+	 * @return     Error status.
+	 */
+	result mount();
+
+	/**
+	 * @brief      End a session started by mount(), writing out any changes
+	 *             held in the page cache
+	 */
+	void unmount();
+
+	/**
+	 * @brief      Check whether a session is in progress
+	 *
+	 * @return     True if mount() has succeeded since the last unmount() or format()
+	 */
+	bool isMounted();
+
 	/**
 	 * @brief      Checks that the EEPROM is managed by this library
 	 *
@@ -240,10 +1016,503 @@ namespace OSFS {
 		return checkLibVersion(dummy);
 	}
 
+	/**
+	 * @brief      Choose how newFile decides where to put files
+	 *
+	 * @param[in]  policy  The allocation policy. FIRST_FIT by default.
+	 */
+	void setAllocPolicy(allocPolicy policy);
+
+	/**
+	 * @brief      Choose whether newFile may overwrite a file in place
+	 *
+	 *             By default, a file being replaced is always written
+	 *             somewhere else first, so that a power cut leaves it with
+	 *             either its old or its new contents. Overwriting it in place
+	 *             when its new contents fit saves space and writes, but a power
+	 *             cut part way through leaves it with a mixture of the two.
+	 *             With OSFS_CRC, that shows up as a corrupt file. With
+	 *             WEAR_LEVELING, files are still only overwritten in place when
+	 *             there's no other space for them.
+	 *
+	 * @param[in]  allow  Whether to overwrite files in place. false by default.
+	 */
+	void setOverwriteInPlace(bool allow);
+
+	/**
+	 * @brief      Get the histogram of writes to the EEPROM
+	 *
+	 *             The managed region of the EEPROM is split into
+	 *             OSFS_WEAR_BUCKETS equal parts, and each element counts the
+	 *             bytes written to that part since the histogram was cleared.
+	 *
+	 * @return     Pointer to OSFS_WEAR_BUCKETS counts, or nullptr if
+	 *             OSFS_WEAR_BUCKETS is 0.
+	 */
+	const uint32_t* getWearHistogram();
+
+	/**
+	 * @brief      Reset all counts in the wear histogram to zero
+	 */
+	void clearWearHistogram();
+
+	/**
+	 * @brief      Write all changes held in the page cache to the EEPROM
+	 *
+	 *             Changes are written in the order they were made, so a power
+	 *             cut before or during sync() loses only the most recent of
+	 *             them. Called by unmount(). Does nothing if OSFS_CACHE_PAGES
+	 *             is 0.
+	 *
+	 * @return     Error status.
+	 */
+	result sync();
+
+	/**
+	 * @brief      Get the counts of page cache hits, misses and flushes
+	 *
+	 * @return     The counts since they were last cleared. All zero if
+	 *             OSFS_CACHE_PAGES is 0.
+	 */
+	cacheStats getCacheStats();
+
+	/**
+	 * @brief      Reset the page cache's counts to zero
+	 */
+	void clearCacheStats();
+
+	/**
+	 * @brief      Get the counts of storage accesses, lookups and allocations
+	 *
+	 *             Only calls to the user-provided functions are counted, so
+	 *             accesses answered by the page cache are not. Clear the counts
+	 *             before an operation and get them after it to see what it
+	 *             cost.
+	 *
+	 * @return     The counts since they were last cleared. All zero if
+	 *             OSFS_INSTRUMENT is 0.
+	 */
+	opStats getOpStats();
+
+	/**
+	 * @brief      Reset the counts returned by getOpStats() to zero
+	 */
+	void clearOpStats();
+
+	/**
+	 * @brief      Set a function to be called just before each call to
+	 *             readNBytes, writeNBytes or eraseBlock
+	 *
+	 *             It's given the kind of access, its address and its length
+	 *             in bytes. It mustn't use OSFS itself.
+	 *             Does nothing if OSFS_INSTRUMENT is 0.
+	 *
+	 * @param[in]  callback  The function, or nullptr for none
+	 */
+	void setTraceCallback(traceCallback callback);
+
+	/**
+	 * @brief      Forget the contents of the directory cache
+	 *
+	 *             Only needed if the storage is modified behind OSFS's back. The
+	 *             cache will be reloaded from storage on the next lookup. The
+	 *             free index and the page cache are also dropped, including
+	 *             any changes which haven't been written by sync(). As after a
+	 *             reset, the storage is checked again for anything left
+	 *             unfinished by a power cut.
+	 */
+	void invalidateDirCache();
+
 	void padFilename(const char * filenameIn, char * filenameOut);
 
+	/**
+	 * @brief      Hash a padded filename into a single byte
+	 *
+	 * @param[in]  paddedFilename  The filename, already padded to FILE_NAME_LENGTH
+	 *
+	 * @return     The hash
+	 */
+	uint8_t hashFilename(const char * paddedFilename);
+
+	/**
+	 * @brief      Add some bytes to a CRC
+	 *
+	 *             CRC-16/CCITT-FALSE: polynomial 0x1021, starting from CRC_INIT.
+	 *             Works a nibble at a time from a table of 16 entries, which is
+	 *             small and fast on 8 bit microcontrollers.
+	 *
+	 * @param[in]  crc   The CRC of the bytes so far, or CRC_INIT to start
+	 * @param[in]  data  The bytes
+	 * @param[in]  num   Number of bytes
+	 *
+	 * @return     The CRC including these bytes
+	 */
+	uint16_t crc16(uint16_t crc, const void* data, unsigned int num);
+
 	inline bool isDeletedFile(fileHeader workingHeader) {
 		return workingHeader.flags & (1<<DELBIT);
 	}
 
+	inline bool isPendingFile(fileHeader workingHeader) {
+		return (workingHeader.flags & (1<<PENDBIT)) && !(workingHeader.flags & (1<<PENDDONEBIT));
+	}
+
+#if OSFS_VOLUMES
+	/**
+	 * @brief      How OSFS reaches the storage of a Volume
+	 *
+	 *             Each function is passed context, which points at the
+	 *             volume's backend. start and end are the first and last
+	 *             addresses OSFS may use, as for startOfEEPROM and endOfEEPROM.
+	 */
+	struct storageDevice {
+		void* context;
+		void (*read)(void* context, address_t address, unsigned int num, byte* output);
+		void (*write)(void* context, address_t address, unsigned int num, const byte* input);
+#if OSFS_FLASH_BLOCK_SIZE > 0
+		void (*erase)(void* context, address_t address);
+#endif
+		address_t start;
+		address_t end;
+	};
+#endif
+
+	/**
+	 * @brief      Everything OSFS keeps in RAM about one storage device
+	 *
+	 *             Only for OSFS's own use. The caches, indexes and counts
+	 *             enabled by the options above are all kept here, so each
+	 *             volume costs the RAM they do.
+	 */
+	struct volumeState {
+#if OSFS_VOLUMES
+		storageDevice device; // Unused by the default volume
+#endif
+
+		// State which is only trusted while the filesystem is mounted. Between
+		// mount() and unmount() / format(), OSFS assumes that nobody else is
+		// modifying the storage and keeps this up to date itself.
+		struct sessionInfo {
+			bool mounted;
+			address_t lastHeader; // Address of the last header in the chain
+			address_t chainEnd; // Address at which the next file will be appended
+			address_t holes; // Number of runs of deleted headers in the chain
+		};
+
+		sessionInfo session = {};
+
+		// Whether anything left unfinished by a power cut has been dealt with
+		// since OSFS last lost track of the storage: see recover()
+		bool recovered = false;
+
+#if OSFS_CRC
+		// Header of the last file which scrub() checked in this pass, or 0 at
+		// the start of a pass, and the CRC it held, which shows whether the
+		// file is still there
+		address_t scrubAddress = 0;
+		uint16_t scrubCrc = 0;
+#endif
+
+#if OSFS_BATCH_SIZE > 0
+		// A file stored by newFile since beginBatch()
+		struct batchEntry {
+			address_t headerAddress;
+			address_t originalAddress; // Of the file it replaces, found by commit()
+			uint8_t hash; // Of its name
+			bool overwrite;
+		};
+
+		bool batchOpen = false;
+		unsigned int batchCount = 0;
+		address_t batchEnd = 0; // Where the next file of the batch goes
+		batchEntry batchFiles[OSFS_BATCH_SIZE];
+#endif
+
+		// How newFile chooses where to put files. With WEAR_LEVELING, the search
+		// for free space starts from allocCursor, just after the last file
+		// written, rather than from the start of the chain. With FIRST_FIT,
+		// allocCursor is always 0.
+		allocPolicy allocation = allocPolicy::FIRST_FIT;
+		address_t allocCursor = 0;
+
+		// Whether newFile may overwrite a file in place: see
+		// setOverwriteInPlace()
+		bool overwriteInPlace = false;
+
+#if OSFS_FLASH_BLOCK_SIZE > 0
+		// Start of the half of the flash which holds the files: see
+		// findFlashBase()
+		address_t flashBase = 0;
+		bool flashBaseKnown = false;
+
+		// Everything from here to the end of the half in use is known to be
+		// erased, or 0 if that isn't known
+		address_t blankFrom = 0;
+#endif
+
+#if OSFS_WEAR_BUCKETS > 0
+		uint32_t wearHistogram[OSFS_WEAR_BUCKETS] = {};
+#endif
+
+#if OSFS_INSTRUMENT
+		opStats opCounts = {};
+		traceCallback tracer = nullptr;
+#endif
+
+#if OSFS_CACHE_PAGES > 0
+		// A page of the EEPROM held in RAM. Only the bytes between validStart
+		// and validEnd are known, and the changed ones between dirtyStart and
+		// dirtyEnd always lie within them. A slot is empty if validStart and
+		// validEnd are equal.
+		struct cachePage {
+			address_t address; // Of the start of the page, a multiple of OSFS_CACHE_PAGE_SIZE
+			uint16_t lastUsed; // Value of cacheClock when the page was last accessed
+			uint16_t validStart, validEnd;
+			uint16_t dirtyStart, dirtyEnd;
+			byte data[OSFS_CACHE_PAGE_SIZE];
+		};
+
+		cachePage cachePages[OSFS_CACHE_PAGES] = {};
+		uint16_t cacheClock = 0;
+		cacheStats cacheCounts = {};
+
+		// Indexes of the dirty pages in the order they were first changed. To
+		// keep the writes in the order OSFS made them, they must be written back
+		// in this order, and a page can only take further changes while it's
+		// the last one in the list.
+		uint8_t cacheDirtyOrder[OSFS_CACHE_PAGES];
+		uint8_t cacheDirtyCount = 0;
+#endif
+
+#if OSFS_PAGE_SIZE > 0
+		// Writes waiting to be combined with the ones after them into a single
+		// write to one page
+		struct {
+			address_t address;
+			unsigned int length; // = 0 if nothing is waiting
+			byte data[OSFS_PAGE_SIZE];
+		} pendingWrite = {};
+#endif
+
+#if OSFS_DIR_CACHE_SIZE > 0
+		// The directory cache remembers where the headers of live files are, so
+		// that lookups don't have to walk the header chain in storage. Names
+		// are kept whole, so that a hit doesn't need to read storage.
+		struct dirCacheEntry {
+			address_t headerAddress; // = 0 for an unused entry
+			address_t fileSize;
+			char fileID[FILE_NAME_LENGTH];
+			uint8_t hash;
+		};
+
+		enum class cacheState : uint8_t {
+			UNLOADED,	// Contents are meaningless until loaded from storage
+			COMPLETE,	// Every live file is in the cache, so a miss means FILE_NOT_FOUND
+			PARTIAL		// The cache overflowed, so a miss must be checked in storage
+		};
+
+		dirCacheEntry dirCache[OSFS_DIR_CACHE_SIZE] = {};
+		cacheState dirCacheState = cacheState::UNLOADED;
+#endif
+
+#if OSFS_FREE_INDEX_SIZE > 0
+		// The free index remembers where the deleted files are, so that newFile
+		// can choose a slot without searching the chain. Each entry covers a
+		// whole run of neighbouring deleted headers.
+		struct freeIndexEntry {
+			address_t address; // = 0 for an unused entry
+			address_t nextFile; // End of the run
+		};
+
+		freeIndexEntry freeIndex[OSFS_FREE_INDEX_SIZE] = {};
+		bool freeIndexOverflowed = true;
+#endif
+	};
+
+#if OSFS_VOLUMES
+	/**
+	 * @brief      A filesystem on a storage device of its own
+	 *
+	 *             The functions above all work on the default volume, which
+	 *             uses readNBytes, writeNBytes, eraseBlock, startOfEEPROM and
+	 *             endOfEEPROM. These must still be provided even if only
+	 *             volumes are used. Each method here works as the function of
+	 *             the same name, but on this volume, and each volume keeps its
+	 *             own caches, stats, session and batch. The compile-time
+	 *             options apply to every volume alike. Only available with
+	 *             OSFS_VOLUMES.
+	 *
+	 *             While a method runs, its volume is the one OSFS works on,
+	 *             so OSFS mustn't be called from an interrupt or a trace
+	 *             callback meanwhile.
+	 *
+	 *             Create volumes through Volume, not this class. They can't be
+	 *             copied, since File, Dir and Log keep a pointer to the volume
+	 *             they're on.
+	 */
+	class VolumeBase {
+	public:
+		VolumeBase(const VolumeBase&) = delete;
+		VolumeBase& operator=(const VolumeBase&) = delete;
+
+		result getFileInfo(const paddedName& filename, address_t& filePointer, address_t& fileSize);
+		result getFileInfo(const char* filename, address_t& filePointer, address_t& fileSize) {
+			return getFileInfo(padName(filename), filePointer, fileSize);
+		}
+
+		result verifyContents(address_t filePointer, const void* contents, address_t size);
+
+		result getFile(const paddedName& filename, void* buf, unsigned int size, bool verify = false);
+		result getFile(const char* filename, void* buf, unsigned int size, bool verify = false) {
+			return getFile(padName(filename), buf, size, verify);
+		}
+		template <typename T>
+		result getFile(const paddedName& filename, T& buf, bool verify = false) {
+			return getFile(filename, &buf, sizeof(buf), verify);
+		}
+		template <typename T>
+		result getFile(const char* filename, T& buf, bool verify = false) {
+			return getFile(padName(filename), &buf, sizeof(buf), verify);
+		}
+
+		result newFile(const paddedName& filename, void* data, unsigned int size, bool overwrite = false,
+			bool compress = false);
+		result newFile(const char* filename, void* data, unsigned int size, bool overwrite = false,
+				bool compress = false) {
+			return newFile(padName(filename), data, size, overwrite, compress);
+		}
+		template <typename T>
+		result newFile(const paddedName& filename, T& buf, bool overwrite = false) {
+			return newFile(filename, &buf, sizeof(buf), overwrite);
+		}
+		template <typename T>
+		result newFile(const char* filename, T& buf, bool overwrite = false) {
+			return newFile(padName(filename), &buf, sizeof(buf), overwrite);
+		}
+
+		result deleteFile(const paddedName& filename);
+		result deleteFile(const char* filename) {
+			return deleteFile(padName(filename));
+		}
+
+		result beginBatch();
+		result commit();
+		void abortBatch();
+
+		// As File::open, with the file on this volume
+		result open(File& file, const paddedName& filename, bool create = false);
+		result open(File& file, const char* filename, bool create = false) {
+			return open(file, padName(filename), create);
+		}
+
+		// As Dir::next, listing this volume if the Dir hasn't started yet
+		result next(Dir& dir, dirEntry& entry);
+
+#if OSFS_FLASH_BLOCK_SIZE == 0
+		// As Log::open, with the log on this volume
+		result open(Log& log, const paddedName& filename, uint8_t recordSize, address_t capacity);
+		result open(Log& log, const char* filename, uint8_t recordSize, address_t capacity) {
+			return open(log, padName(filename), recordSize, capacity);
+		}
+#endif
+
+		result getFsStats(fsStats& stats);
+		result compact();
+		result scrub(unsigned int maxFiles, bool& passComplete, char* corruptFilename = nullptr);
+		result format();
+		result mount();
+		void unmount();
+		bool isMounted();
+		result checkLibVersion(uint16_t& ver);
+		result checkLibVersion() {
+			uint16_t dummy;
+			return checkLibVersion(dummy);
+		}
+		void setAllocPolicy(allocPolicy policy);
+		void setOverwriteInPlace(bool allow);
+		const uint32_t* getWearHistogram();
+		void clearWearHistogram();
+		result sync();
+		cacheStats getCacheStats();
+		void clearCacheStats();
+		opStats getOpStats();
+		void clearOpStats();
+		void setTraceCallback(traceCallback callback);
+		void invalidateDirCache();
+
+	protected:
+		explicit VolumeBase(const storageDevice& device) {
+			state.device = device;
+		}
+
+	private:
+		volumeState state;
+	};
+
+	/**
+	 * @brief      A volume on the storage reached through a backend
+	 *
+	 *             The backend is any class with these methods, which work as
+	 *             readNBytes, writeNBytes and eraseBlock:
+	 *
+	 *             void read(OSFS::address_t address, unsigned int num, byte* output);
+	 *             void write(OSFS::address_t address, unsigned int num, const byte* input);
+	 *             void erase(OSFS::address_t address); // Only with OSFS_FLASH_BLOCK_SIZE
+	 *
+	 *             They're called through a pointer to one small function for
+	 *             each, made for this backend, so they can be inlined into it
+	 *             but not into OSFS. OSFS itself isn't made for each backend,
+	 *             so that each one doesn't cost another copy of it in program
+	 *             memory.
+	 *
+	 * @tparam     Backend  The backend's class
+	 */
+	template <typename Backend>
+	class Volume : public VolumeBase {
+	public:
+		/**
+		 * @brief      Create a volume, which must then be formatted or mounted
+		 *             like the default one
+		 *
+		 * @param[in]  start    The first address OSFS may use
+		 * @param[in]  end      The last address OSFS may use
+		 * @param[in]  backend  The backend, which the volume keeps a copy of
+		 */
+		Volume(address_t start, address_t end, const Backend& backend = Backend())
+			: VolumeBase(device(&storage, start, end)), storage(backend) {}
+
+		Backend& backend() { return storage; }
+
+	private:
+		Backend storage;
+
+		static void read(void* context, address_t address, unsigned int num, byte* output) {
+			static_cast<Backend*>(context)->read(address, num, output);
+		}
+
+		static void write(void* context, address_t address, unsigned int num, const byte* input) {
+			static_cast<Backend*>(context)->write(address, num, input);
+		}
+
+#if OSFS_FLASH_BLOCK_SIZE > 0
+		static void erase(void* context, address_t address) {
+			static_cast<Backend*>(context)->erase(address);
+		}
+#endif
+
+		static storageDevice device(Backend* context, address_t start, address_t end) {
+			storageDevice d;
+			d.context = context;
+			d.read = read;
+			d.write = write;
+#if OSFS_FLASH_BLOCK_SIZE > 0
+			d.erase = erase;
+#endif
+			d.start = start;
+			d.end = end;
+			return d;
+		}
+	};
+#endif
+
 }
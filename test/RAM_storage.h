@@ -4,30 +4,154 @@
 // The arduino_ci mocking library does not cover EEPROM. But that's fine: I'll
 // just point OSFS at a location in RAM instead, and have it treat it create
 // its filesystem there.
+//
+// With 32 bit addresses, the storage pretends to start above 64 KB, so that
+// addresses which don't fit in 16 bits are tested. storage[0] is always the
+// first byte managed by OSFS.
 
-uint16_t OSFS::startOfEEPROM = 0;
-uint16_t OSFS::endOfEEPROM = 1023;
+#if OSFS_ADDRESS_BITS == 32
+const OSFS::address_t STORAGE_BASE = 0x10000;
+#else
+const OSFS::address_t STORAGE_BASE = 0;
+#endif
 
-const size_t SIZE_STORAGE = 1024;
+// The directory index is added on to the storage, so that files have the same
+// room whether or not it's enabled. With flash, files only have half of the
+// storage at a time.
+#if OSFS_FLASH_BLOCK_SIZE > 0
+const size_t SIZE_STORAGE = 2 * 1024;
+#else
+const size_t SIZE_STORAGE = 1024 + OSFS::FIRST_HEADER_OFFSET - sizeof(OSFS::FSInfo);
+#endif
 byte storage[SIZE_STORAGE];
 
-void OSFS::readNBytes(uint16_t address, unsigned int num, byte* output) {
-	for (uint16_t i = address; i < address + num; i++) {
-		*output = *(storage + i);
+OSFS::address_t OSFS::startOfEEPROM = STORAGE_BASE;
+OSFS::address_t OSFS::endOfEEPROM = STORAGE_BASE + SIZE_STORAGE - 1;
+
+// Number of calls made by OSFS to the storage functions, so that tests can
+// check how hard it is working
+unsigned long readCalls = 0;
+unsigned long bytesRead = 0;
+unsigned long writeCalls = 0;
+unsigned long bytesWritten = 0;
+
+#if OSFS_PAGE_SIZE > 0
+// Number of calls to writeNBytes which crossed the boundary between two pages
+unsigned long pageCrossings = 0;
+#endif
+
+// Number of reads OSFS has asked for, including those the page cache answered
+// without calling readNBytes. Reset readCalls and the cache's counts to start.
+unsigned long readRequests() {
+	return readCalls + OSFS::getCacheStats().hits;
+}
+
+void clear_read_counts() {
+	readCalls = 0;
+	OSFS::clearCacheStats();
+}
+
+// Simulate a power cut: if this is not negative, it's the number of calls to
+// writeNBytes, or eraseBlock with flash, which will succeed before all further
+// writes are lost
+long writesUntilPowerLoss = -1;
+
+// If this is not negative, the write which the power cut stops is torn rather
+// than lost: its first tornWriteBytes bytes still reach the storage. Writes no
+// longer than an address are never torn, since OSFS relies on those being
+// atomic.
+long tornWriteBytes = -1;
+
+#if OSFS_FLASH_BLOCK_SIZE > 0
+// With flash, writes can only clear bits, and erasing sets a block back to
+// all ones. Writes which would need to set a bit are counted here, since OSFS
+// should never make them.
+unsigned long eraseCalls = 0;
+unsigned long bitsNotCleared = 0;
+
+void OSFS::eraseBlock(OSFS::address_t address) {
+	eraseCalls++;
+
+	if (writesUntilPowerLoss == 0)
+		return;
+	if (writesUntilPowerLoss > 0)
+		writesUntilPowerLoss--;
+
+	memset(storage + address - STORAGE_BASE, 0xFF, OSFS_FLASH_BLOCK_SIZE);
+}
+#endif
+
+void OSFS::readNBytes(OSFS::address_t address, unsigned int num, byte* output) {
+	readCalls++;
+	bytesRead += num;
+	for (OSFS::address_t i = address; i < address + num; i++) {
+		*output = *(storage + i - STORAGE_BASE);
 		output++;
 	}
 }
 
-void OSFS::writeNBytes(uint16_t address, unsigned int num, const byte* input) {
-	for (uint16_t i = address; i < address + num; i++) {
-    *(storage + i) = *input;
+void OSFS::writeNBytes(OSFS::address_t address, unsigned int num, const byte* input) {
+	writeCalls++;
+	bytesWritten += num;
+#if OSFS_PAGE_SIZE > 0
+	if (num > 0 && address / OSFS_PAGE_SIZE != (address + num - 1) / OSFS_PAGE_SIZE)
+		pageCrossings++;
+#endif
+
+	if (writesUntilPowerLoss == 0) {
+		// Only the first write to be stopped can be torn
+		long torn = tornWriteBytes;
+		tornWriteBytes = -1;
+		if (torn < 0 || num <= sizeof(OSFS::address_t))
+			return;
+		if ((unsigned long)torn < num)
+			num = torn;
+	} else if (writesUntilPowerLoss > 0) {
+		writesUntilPowerLoss--;
+	}
+
+	for (OSFS::address_t i = address; i < address + num; i++) {
+#if OSFS_FLASH_BLOCK_SIZE > 0
+		if ((*(storage + i - STORAGE_BASE) & *input) != *input)
+			bitsNotCleared++;
+		*(storage + i - STORAGE_BASE) &= *input;
+#else
+    *(storage + i - STORAGE_BASE) = *input;
+#endif
 		input++;
 	}
 }
 
+// Where the header of the first file stored after formatting goes. On flash,
+// it comes after the dummy header left by format(), which is never reused.
+const size_t FIRST_FILE_OFFSET = OSFS::FIRST_HEADER_OFFSET
+	+ (OSFS_FLASH_BLOCK_SIZE > 0 ? sizeof(OSFS::fileHeader) : 0);
+
+// Copy num bytes from the storage as OSFS sees them. With flash, it stores the
+// complement of each byte, so that erased bytes read as 0.
+void read_storage(size_t offset, size_t num, void* output) {
+	for (size_t i = 0; i < num; i++)
+		((byte*)output)[i] = OSFS_FLASH_BLOCK_SIZE > 0 ? ~storage[offset + i] : storage[offset + i];
+}
 
 void clear_storage() {
 	for (unsigned int i = 0; i < SIZE_STORAGE; i++) {
-		storage[i] = 0;
+		storage[i] = OSFS_FLASH_BLOCK_SIZE > 0 ? 0xFF : 0;
 	}
+	readCalls = 0;
+	bytesRead = 0;
+	writeCalls = 0;
+	bytesWritten = 0;
+#if OSFS_PAGE_SIZE > 0
+	pageCrossings = 0;
+#endif
+	writesUntilPowerLoss = -1;
+	tornWriteBytes = -1;
+#if OSFS_FLASH_BLOCK_SIZE > 0
+	eraseCalls = 0;
+	bitsNotCleared = 0;
+#endif
+
+	// Anything OSFS remembers about the old contents is now wrong
+	OSFS::invalidateDirCache();
 }
@@ -0,0 +1,96 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Benchmark for the allocation policies: run the same random sequence of
+// creates and deletes under each policy and count how often a file can't be
+// stored because the free space is too fragmented.
+
+const int NUM_NAMES = 40;
+const int NUM_OPERATIONS = 2000;
+
+struct workloadResult {
+	unsigned long failures;
+	unsigned long reads;
+	uint32_t layout; // Hash of where each file was put
+};
+
+workloadResult runWorkload(OSFS::allocPolicy policy, bool mounted) {
+	clear_storage();
+	OSFS::setAllocPolicy(policy);
+	OSFS::format();
+	if (mounted)
+		OSFS::mount();
+
+	bool exists[NUM_NAMES] = {};
+	byte data[80] = {};
+	char name[] = "file00";
+	uint32_t seed = 12345;
+	workloadResult out = {0, 0, 0};
+
+	for (int i = 0; i < NUM_OPERATIONS; i++) {
+		seed = seed * 1103515245 + 12345;
+		int n = (seed >> 16) % NUM_NAMES;
+		name[4] = '0' + n / 10;
+		name[5] = '0' + n % 10;
+
+		if (exists[n]) {
+			auto r = OSFS::deleteFile(name);
+			assertEqual(int(OSFS::result::NO_ERROR), int(r));
+			exists[n] = false;
+		} else {
+			// Mostly small files with the occasional large one
+			unsigned int size = (seed >> 8) % 4 == 0 ? 40 + (seed >> 4) % 40 : 2 + (seed >> 4) % 12;
+			clear_read_counts();
+			auto r = OSFS::newFile(name, (void*)data, size);
+			out.reads += readRequests();
+			if (r == OSFS::result::INSUFFICIENT_SPACE)
+				out.failures++;
+			else {
+				assertEqual(int(OSFS::result::NO_ERROR), int(r));
+				exists[n] = true;
+
+				OSFS::address_t filePointer, fileSize;
+				OSFS::getFileInfo(name, filePointer, fileSize);
+				out.layout = out.layout * 31 + filePointer;
+			}
+		}
+	}
+
+	OSFS::unmount();
+	OSFS::setAllocPolicy(OSFS::allocPolicy::FIRST_FIT);
+	return out;
+}
+
+unittest(bench_fragmentation)
+{
+	workloadResult firstFit = runWorkload(OSFS::allocPolicy::FIRST_FIT, false);
+	workloadResult bestFit = runWorkload(OSFS::allocPolicy::BEST_FIT, false);
+	printf("FIRST_FIT: %lu failures, %lu reads\n", firstFit.failures, firstFit.reads);
+	printf("BEST_FIT: %lu failures, %lu reads\n", bestFit.failures, bestFit.reads);
+	assertLessOrEqual(bestFit.failures, firstFit.failures);
+}
+
+unittest(bench_fragmentation_mounted)
+{
+	for (int policy = 0; policy < 2; policy++) {
+		OSFS::allocPolicy p = policy ? OSFS::allocPolicy::BEST_FIT : OSFS::allocPolicy::FIRST_FIT;
+
+		workloadResult unmounted = runWorkload(p, false);
+		workloadResult mounted = runWorkload(p, true);
+		printf("%s, mounted: %lu reads\n", policy ? "BEST_FIT" : "FIRST_FIT", mounted.reads);
+
+		// Mounting must not change where anything is put
+		assertEqual(unmounted.failures, mounted.failures);
+		assertEqual(unmounted.layout, mounted.layout);
+
+		// On flash, compacting makes a mounted filesystem scan the chain again
+#if OSFS_FLASH_BLOCK_SIZE == 0
+		assertLessOrEqual(mounted.reads, unmounted.reads);
+#endif
+	}
+}
+
+unittest_main()
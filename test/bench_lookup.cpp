@@ -0,0 +1,73 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Benchmark for getFileInfo: count the calls it makes to readNBytes, or
+// answers from the page cache, as the number of files grows. Without the
+// directory index, finding a file costs a read of every header before it. With
+// it, the cost should stay the same for as long as the index has room.
+
+const int FILE_COUNTS[] = {8, 16, 32};
+
+struct lookupCost {
+	float hit; // Average reads to find a file
+	float miss; // Average reads to find that a file doesn't exist
+};
+
+lookupCost measureLookups(int numFiles) {
+	clear_storage();
+	OSFS::format();
+
+	char name[] = "file00";
+	for (int i = 0; i < numFiles; i++) {
+		name[4] = '0' + i / 10;
+		name[5] = '0' + i % 10;
+		auto r = OSFS::newFile(name, i);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	}
+
+	OSFS::address_t filePtr, fileSize;
+	lookupCost cost;
+
+	clear_read_counts();
+	for (int i = 0; i < numFiles; i++) {
+		name[4] = '0' + i / 10;
+		name[5] = '0' + i % 10;
+		auto r = OSFS::getFileInfo(name, filePtr, fileSize);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	}
+	cost.hit = float(readRequests()) / numFiles;
+
+	name[0] = 'x';
+	clear_read_counts();
+	for (int i = 0; i < numFiles; i++) {
+		name[4] = '0' + i / 10;
+		name[5] = '0' + i % 10;
+		auto r = OSFS::getFileInfo(name, filePtr, fileSize);
+		assertEqual(int(OSFS::result::FILE_NOT_FOUND), int(r));
+	}
+	cost.miss = float(readRequests()) / numFiles;
+
+	return cost;
+}
+
+unittest(bench_lookup)
+{
+	for (int numFiles : FILE_COUNTS) {
+		lookupCost cost = measureLookups(numFiles);
+		printf("getFileInfo, %d files, %d slots of index: %.2f reads to find, %.2f to miss\n",
+			numFiles, OSFS_DIR_INDEX_SIZE, cost.hit, cost.miss);
+
+#if OSFS_DIR_INDEX_SIZE > 0
+		// The version check, then a slot or two and a header
+		if (numFiles <= OSFS_DIR_INDEX_SIZE * 3 / 4) {
+			assertLessOrEqual(cost.hit, 4);
+			assertLessOrEqual(cost.miss, 4);
+		}
+#endif
+	}
+}
+
+unittest_main()
@@ -0,0 +1,127 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Benchmarks for newFile: count the calls it makes to readNBytes when the
+// filesystem holds a number of files. One walk of the header chain costs one
+// read per file, plus one for the version check when not mounted, plus one
+// for the name of each file whose name has the same hash. Replacing a file
+// reads its flags once more, to delete the original, and its whole header
+// first if the directory cache found it.
+// Comparing before writing, updating the directory index and checking that
+// flash is blank add reads of their own, so the bounds are only checked
+// without them.
+
+const int NUM_FILES = 20;
+
+void setName(char* name, int i) {
+	name[4] = '0' + i / 10;
+	name[5] = '0' + i % 10;
+}
+
+void fillFilesystem() {
+	char name[] = "file00";
+	for (int i = 0; i < NUM_FILES; i++) {
+		setName(name, i);
+		OSFS::newFile(name, i);
+	}
+}
+
+// Number of files whose names a search for the given name may have to read
+unsigned long nameReads(const char* name) {
+	uint8_t hash = OSFS::padName(name).hash;
+	char fileName[] = "file00";
+	unsigned long reads = 0;
+	for (int i = 0; i < NUM_FILES; i++) {
+		setName(fileName, i);
+		if (OSFS::padName(fileName).hash == hash)
+			reads++;
+	}
+	return reads;
+}
+
+unsigned long readsFor(const char* name, bool overwrite) {
+	int value = 999;
+	readCalls = 0;
+	auto r = OSFS::newFile(name, value, overwrite);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	return readCalls;
+}
+
+void checkReads(const char* name, unsigned long reads, unsigned long bound) {
+#if !OSFS_COMPARE_WRITES && OSFS_DIR_INDEX_SIZE == 0 && OSFS_FLASH_BLOCK_SIZE == 0
+	assertLessOrEqual(reads, bound + nameReads(name));
+#else
+	(void)name;
+	(void)reads;
+	(void)bound;
+#endif
+}
+
+unittest_setup() {
+	clear_storage();
+	OSFS::format();
+	OSFS::setOverwriteInPlace(false);
+	fillFilesystem();
+}
+
+unittest(bench_new_file)
+{
+	unsigned long reads = readsFor("newfile", false);
+	printf("newFile, new name, %d files: %lu reads\n", NUM_FILES, reads);
+	checkReads("newfile", reads, NUM_FILES + 1);
+}
+
+unittest(bench_overwrite_first_file)
+{
+	unsigned long reads = readsFor("file00", true);
+	printf("newFile, overwrite first of %d files: %lu reads\n", NUM_FILES, reads);
+	checkReads("file00", reads, NUM_FILES + 2 + (OSFS_DIR_CACHE_SIZE > 0));
+}
+
+unittest(bench_overwrite_first_file_in_place)
+{
+	OSFS::setOverwriteInPlace(true);
+	unsigned long reads = readsFor("file00", true);
+	printf("newFile, overwrite first of %d files in place: %lu reads\n", NUM_FILES, reads);
+	checkReads("file00", reads, 2);
+}
+
+unittest(bench_overwrite_last_file)
+{
+	unsigned long reads = readsFor("file19", true);
+	printf("newFile, overwrite last of %d files: %lu reads\n", NUM_FILES, reads);
+	checkReads("file19", reads, NUM_FILES + 2 + (OSFS_DIR_CACHE_SIZE > 0));
+}
+
+unittest(bench_new_file_with_holes)
+{
+	OSFS::deleteFile("file05");
+	OSFS::deleteFile("file15");
+
+	unsigned long reads = readsFor("newfile", false);
+	printf("newFile, new name, %d files with holes: %lu reads\n", NUM_FILES, reads);
+	checkReads("newfile", reads, NUM_FILES + 1);
+}
+
+unittest(bench_new_file_mounted)
+{
+	OSFS::mount();
+	unsigned long reads = readsFor("newfile", false);
+	OSFS::unmount();
+	printf("newFile, new name, %d files, mounted: %lu reads\n", NUM_FILES, reads);
+	checkReads("newfile", reads, NUM_FILES);
+}
+
+unittest(bench_overwrite_mounted)
+{
+	OSFS::mount();
+	unsigned long reads = readsFor("file00", true);
+	OSFS::unmount();
+	printf("newFile, overwrite first of %d files, mounted: %lu reads\n", NUM_FILES, reads);
+	checkReads("file00", reads, NUM_FILES + 1);
+}
+
+unittest_main()
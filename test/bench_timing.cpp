@@ -0,0 +1,158 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "sim_storage.h"
+
+
+// Benchmarks of whole workloads on simulated parts: see sim_storage.h. Each
+// workload is replayed from a fixed seed on each kind of part, and reports the
+// simulated time taken, the calls made to readNBytes and writeNBytes, the
+// bytes written and the most any one byte was worn.
+
+// Built for flash, OSFS can only run on flash
+#if OSFS_FLASH_BLOCK_SIZE > 0
+const timingModel* const MODELS[] = {&NOR_FLASH};
+#else
+const timingModel* const MODELS[] = {&AVR_EEPROM, &SPI_EEPROM, &NOR_FLASH};
+#endif
+
+struct benchResult {
+	simTotals totals;
+	uint32_t maxWear;
+	unsigned long operations; // Calls to OSFS which succeeded
+};
+
+uint32_t seed;
+
+uint32_t nextRandom() {
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+void setName(char* name, int n) {
+	name[4] = '0' + n / 10;
+	name[5] = '0' + n % 10;
+}
+
+// A handful of small settings, each rewritten over and over
+unsigned long configChurn() {
+	const int NUM_SETTINGS = 8;
+	char name[] = "conf00";
+	byte value[16] = {};
+	unsigned long done = 0;
+
+	for (int i = 0; i < 400; i++) {
+		int n = nextRandom() % NUM_SETTINGS;
+		setName(name, n);
+		value[0] = i;
+		unsigned int size = 2 + n * 2;
+		auto r = OSFS::newFile(name, (void*)value, size, true);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		done++;
+	}
+
+	return done;
+}
+
+// Records appended to a log, which is started again whenever it fills the
+// storage, alongside a setting which is rewritten now and then
+unsigned long logging() {
+	byte record[12] = {};
+	long counter = 0;
+	unsigned long done = 0;
+
+	OSFS::File log;
+	log.open("log", true);
+
+	for (int i = 0; i < 600; i++) {
+		record[0] = i;
+		auto r = log.append(record, sizeof(record));
+		if (r == OSFS::result::INSUFFICIENT_SPACE) {
+			log.close();
+			OSFS::deleteFile("log");
+			log.open("log", true);
+			r = log.append(record, sizeof(record));
+		}
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		done++;
+
+		if (i % 50 == 0) {
+			counter++;
+			OSFS::newFile("counter", counter, true);
+			done++;
+		}
+	}
+
+	log.close();
+	return done;
+}
+
+// Files of random sizes stored until there's no room left
+unsigned long fillToFull() {
+	char name[] = "fill00";
+	byte data[100] = {};
+	unsigned long done = 0;
+
+	for (int n = 0; n < 100; n++) {
+		setName(name, n);
+		unsigned int size = 4 + nextRandom() % 96;
+		auto r = OSFS::newFile(name, (void*)data, size);
+		if (r == OSFS::result::INSUFFICIENT_SPACE)
+			break;
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		done++;
+	}
+
+	return done;
+}
+
+benchResult runBench(const timingModel& model, unsigned long (*workload)()) {
+	clear_storage(model);
+	seed = 12345;
+	OSFS::format();
+
+	benchResult out;
+	out.operations = workload();
+	OSFS::sync();
+
+	out.totals = sim;
+	out.maxWear = maxWear();
+	return out;
+}
+
+void reportBench(const char* workloadName, unsigned long (*workload)()) {
+	for (const timingModel* model : MODELS) {
+		benchResult result = runBench(*model, workload);
+		printf("%s on %s: %lu ops in %.1f ms, %lu reads, %lu writes, %lu bytes written, max wear %lu\n",
+			workloadName, model->name, result.operations, result.totals.timeUs / 1000,
+			result.totals.reads, result.totals.writes, result.totals.bytesWritten,
+			(unsigned long)result.maxWear);
+
+		assertLess(0, result.operations);
+		assertLess(0, result.totals.bytesWritten);
+
+		// The same workload must give the same results every time
+		benchResult again = runBench(*model, workload);
+		assertEqual(result.operations, again.operations);
+		assertEqual(result.totals.writes, again.totals.writes);
+		assertEqual(result.totals.bytesWritten, again.totals.bytesWritten);
+		assertEqual(result.maxWear, again.maxWear);
+	}
+}
+
+unittest(bench_config_churn)
+{
+	reportBench("config churn", configChurn);
+}
+
+unittest(bench_logging)
+{
+	reportBench("logging", logging);
+}
+
+unittest(bench_fill_to_full)
+{
+	reportBench("fill to full", fillToFull);
+}
+
+unittest_main()
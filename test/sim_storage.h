@@ -0,0 +1,146 @@
+#include <OSFS.h>
+
+
+// Storage for benchmarks which simulates how long a real part would take to
+// do what OSFS asks of it, and how much each byte of it is worn. Like
+// RAM_storage.h, it keeps the bytes in RAM; the two can't be used together.
+//
+// Times are in microseconds and are only rough figures from datasheets: they
+// are meant for comparing one version of OSFS with another, not for
+// predicting how long a sketch will take.
+
+// How a part behaves. Each call to readNBytes or writeNBytes costs a fixed
+// setup time plus a time per byte on the bus. Then:
+// 	- if pageSize is 0, each byte written costs byteWriteUs;
+// 	- otherwise each page touched by a write costs pageWriteUs;
+// 	- if eraseBlock isn't 0, the part is NOR flash. Bits can only be cleared
+// 	  by programming, so a write which needs to set any bit first erases
+// 	  every block it touches, costing eraseUs each, then programs the whole
+// 	  block back. Only erases wear the flash.
+struct timingModel {
+	const char* name;
+	float setupUs; // Per call, e.g. sending a command and address
+	float busByteUs; // Per byte moved, in either direction
+	float byteWriteUs;
+	unsigned int pageSize;
+	float pageWriteUs;
+	unsigned int eraseBlock;
+	float eraseUs;
+};
+
+// The ATmega328P's own EEPROM, written a byte at a time with EEPROM.write
+const timingModel AVR_EEPROM = {"AVR EEPROM", 0, 1, 3300, 0, 0, 0, 0};
+
+// An SPI EEPROM like the 25LC256 at 8 MHz, with 64 byte pages
+const timingModel SPI_EEPROM = {"SPI EEPROM", 4, 1, 0, 64, 5000, 0, 0};
+
+// SPI NOR flash at 8 MHz with 256 byte program pages. Its 4 KB sectors are
+// scaled down to 512 bytes, so that the simulated storage has several, or to
+// the size OSFS erases when it's built for flash.
+#if OSFS_FLASH_BLOCK_SIZE > 0
+const timingModel NOR_FLASH = {"NOR flash", 4, 1, 0, 256, 700, OSFS_FLASH_BLOCK_SIZE, 45000};
+#else
+const timingModel NOR_FLASH = {"NOR flash", 4, 1, 0, 256, 700, 512, 45000};
+#endif
+
+const size_t SIZE_STORAGE = 4096 + OSFS::FIRST_HEADER_OFFSET - sizeof(OSFS::FSInfo);
+byte storage[SIZE_STORAGE];
+uint32_t wear[SIZE_STORAGE]; // Writes, or erases for NOR flash, of each byte
+
+OSFS::address_t OSFS::startOfEEPROM = 0;
+OSFS::address_t OSFS::endOfEEPROM = SIZE_STORAGE - 1;
+
+// What the simulated part has done since clear_storage()
+struct simTotals {
+	double timeUs;
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long bytesWritten;
+	unsigned long erases;
+};
+
+const timingModel* simModel = &AVR_EEPROM;
+simTotals sim = {};
+
+void OSFS::readNBytes(OSFS::address_t address, unsigned int num, byte* output) {
+	sim.reads++;
+	sim.timeUs += simModel->setupUs + simModel->busByteUs * num;
+	memcpy(output, storage + address, num);
+}
+
+// Erase each block touched by a write, then program it back with the new
+// contents
+void eraseAndProgram(OSFS::address_t address, unsigned int num, const byte* input) {
+	unsigned int block = simModel->eraseBlock;
+	unsigned int firstBlock = address / block;
+	unsigned int lastBlock = (address + num - 1) / block;
+
+	memcpy(storage + address, input, num);
+	for (unsigned int b = firstBlock; b <= lastBlock; b++) {
+		sim.erases++;
+		sim.timeUs += simModel->eraseUs;
+		sim.timeUs += simModel->pageWriteUs * ((block + simModel->pageSize - 1) / simModel->pageSize);
+		sim.timeUs += simModel->busByteUs * block;
+		for (unsigned int i = b * block; i < (b + 1) * block && i < SIZE_STORAGE; i++)
+			wear[i]++;
+	}
+}
+
+#if OSFS_FLASH_BLOCK_SIZE > 0
+void OSFS::eraseBlock(OSFS::address_t address) {
+	sim.erases++;
+	sim.timeUs += simModel->setupUs + simModel->eraseUs;
+	memset(storage + address, 0xFF, OSFS_FLASH_BLOCK_SIZE);
+	for (unsigned int i = address; i < address + (unsigned int)OSFS_FLASH_BLOCK_SIZE; i++)
+		wear[i]++;
+}
+#endif
+
+void OSFS::writeNBytes(OSFS::address_t address, unsigned int num, const byte* input) {
+	sim.writes++;
+	sim.bytesWritten += num;
+	sim.timeUs += simModel->setupUs + simModel->busByteUs * num;
+	if (num == 0)
+		return;
+
+	if (simModel->eraseBlock > 0) {
+		for (unsigned int i = 0; i < num; i++) {
+			if ((storage[address + i] & input[i]) != input[i]) {
+				eraseAndProgram(address, num, input);
+				return;
+			}
+		}
+	}
+
+	if (simModel->pageSize > 0) {
+		unsigned int pages = (address + num - 1) / simModel->pageSize - address / simModel->pageSize + 1;
+		sim.timeUs += simModel->pageWriteUs * pages;
+	} else {
+		sim.timeUs += simModel->byteWriteUs * num;
+	}
+
+	memcpy(storage + address, input, num);
+	if (simModel->eraseBlock == 0) {
+		for (unsigned int i = 0; i < num; i++)
+			wear[address + i]++;
+	}
+}
+
+// Start again with a blank part of the given kind. Erased flash reads as 0xFF.
+void clear_storage(const timingModel& model) {
+	simModel = &model;
+	memset(storage, model.eraseBlock > 0 ? 0xFF : 0, sizeof(storage));
+	memset(wear, 0, sizeof(wear));
+	sim = {};
+
+	// Anything OSFS remembers about the old contents is now wrong
+	OSFS::invalidateDirCache();
+}
+
+uint32_t maxWear() {
+	uint32_t most = 0;
+	for (unsigned int i = 0; i < SIZE_STORAGE; i++)
+		if (wear[i] > most)
+			most = wear[i];
+	return most;
+}
@@ -0,0 +1,60 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Unit tests for the width of addresses
+
+unittest_setup() {
+	clear_storage();
+	OSFS::format();
+	OSFS::sync();
+}
+
+unittest(test_layout_version)
+{
+	OSFS::FSInfo info;
+	read_storage(0, sizeof(info), &info);
+	assertEqual(OSFS_VER, info.version);
+
+#if OSFS_ADDRESS_BITS == 32
+	assertEqual(4, sizeof(OSFS::address_t));
+	assertEqual(0x8000, info.version & 0x8000);
+#else
+	assertEqual(2, sizeof(OSFS::address_t));
+	assertEqual(0, info.version & 0x8000);
+#endif
+}
+
+unittest(test_other_layout_is_wrong_version)
+{
+	// Storage formatted with the other width of address must be refused
+	OSFS::FSInfo info;
+	memcpy(&info, storage, sizeof(info));
+	info.version ^= 0x8000;
+	memcpy(storage, &info, sizeof(info));
+	OSFS::invalidateDirCache();
+
+	auto r = OSFS::checkLibVersion();
+	assertEqual(int(OSFS::result::WRONG_VERSION), int(r));
+}
+
+unittest(test_files_at_all_addresses)
+{
+	int testInt = 123;
+	auto r = OSFS::newFile("int1", testInt);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	OSFS::address_t filePointer, fileSize;
+	r = OSFS::getFileInfo("int1", filePointer, fileSize);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(OSFS::startOfEEPROM + FIRST_FILE_OFFSET + sizeof(OSFS::fileHeader), filePointer);
+
+	int readInt;
+	r = OSFS::getFile("int1", readInt);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(testInt, readInt);
+}
+
+unittest_main()
@@ -0,0 +1,350 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Unit tests for the allocation policies and the free index
+
+unittest_setup() {
+	clear_storage();
+	OSFS::setAllocPolicy(OSFS::allocPolicy::FIRST_FIT);
+	OSFS::setOverwriteInPlace(false);
+	OSFS::format();
+}
+
+unittest_teardown() {
+	OSFS::unmount();
+	OSFS::setAllocPolicy(OSFS::allocPolicy::FIRST_FIT);
+}
+
+struct block16 {
+	byte data[16];
+};
+
+struct block64 {
+	byte data[64];
+};
+
+// Leave a large hole followed by a small one
+void makeHoles() {
+	block64 big = {};
+	block16 small = {};
+	int testInt = 123;
+	OSFS::newFile("big", big);
+	OSFS::newFile("int1", testInt);
+	OSFS::newFile("small", small);
+	OSFS::newFile("int2", testInt);
+	OSFS::deleteFile("big");
+	OSFS::deleteFile("small");
+}
+
+OSFS::address_t addressOf(const char* filename) {
+	OSFS::address_t filePointer, fileSize;
+	auto r = OSFS::getFileInfo(filename, filePointer, fileSize);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	return filePointer;
+}
+
+// On flash, files are always appended, so there are no holes to choose from
+#if OSFS_FLASH_BLOCK_SIZE == 0
+
+unittest(test_first_fit_uses_first_hole)
+{
+	makeHoles();
+	block16 small = {};
+	OSFS::newFile("new", small);
+	assertLess(addressOf("new"), addressOf("int1"));
+}
+
+unittest(test_best_fit_uses_smallest_hole)
+{
+	makeHoles();
+	OSFS::setAllocPolicy(OSFS::allocPolicy::BEST_FIT);
+	block16 small = {};
+	OSFS::newFile("new", small);
+	assertMore(addressOf("new"), addressOf("int1"));
+	assertLess(addressOf("new"), addressOf("int2"));
+
+	// The big hole is still there for a big file
+	block64 big = {};
+	auto r = OSFS::newFile("big2", big);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertLess(addressOf("big2"), addressOf("int1"));
+}
+
+unittest(test_best_fit_overwrites_in_place)
+{
+	OSFS::setAllocPolicy(OSFS::allocPolicy::BEST_FIT);
+	OSFS::setOverwriteInPlace(true);
+	int testInt = 123;
+	OSFS::newFile("int1", testInt);
+	OSFS::address_t before = addressOf("int1");
+
+	testInt = 321;
+	auto r = OSFS::newFile("int1", testInt, true);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(before, addressOf("int1"));
+
+	// Unless it's asked for, the file moves instead
+	OSFS::setOverwriteInPlace(false);
+	r = OSFS::newFile("int1", testInt, true);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertNotEqual(before, addressOf("int1"));
+}
+
+#endif
+
+#if OSFS_FREE_INDEX_SIZE > 0 && OSFS_DIR_CACHE_SIZE > 0
+
+unittest(test_free_index_avoids_chain)
+{
+	makeHoles();
+	OSFS::mount();
+
+	for (int policy = 0; policy < 2; policy++) {
+		OSFS::setAllocPolicy(policy ? OSFS::allocPolicy::BEST_FIT : OSFS::allocPolicy::FIRST_FIT);
+
+		// Only the name of the cached file with a matching hash (if any) and
+		// nothing in the chain needs to be read
+		block16 small = {};
+		readCalls = 0;
+		auto r = OSFS::newFile(policy ? "new2" : "new1", small);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+#if !OSFS_COMPARE_WRITES
+		// Comparing before writing reads back what's written
+		assertLessOrEqual(readCalls, 1);
+#endif
+	}
+}
+
+#endif
+
+#if OSFS_FREE_INDEX_SIZE > 0 && OSFS_DIR_CACHE_SIZE > 0 && OSFS_FLASH_BLOCK_SIZE == 0
+
+unittest(test_free_index_after_moving_last_file)
+{
+	// When wear leveling, the last file is moved to the end of the chain
+	// when it's overwritten. The space it leaves stops where the moved file
+	// starts, so a file too large for that space doesn't go there.
+	OSFS::mount();
+	OSFS::setAllocPolicy(OSFS::allocPolicy::WEAR_LEVELING);
+
+	int testInt = 123;
+	block16 small = {};
+	OSFS::newFile("int1", testInt);
+	OSFS::newFile("small", small);
+	OSFS::newFile("small", small, true);
+
+	OSFS::setAllocPolicy(OSFS::allocPolicy::FIRST_FIT);
+	block64 big = {};
+	auto r = OSFS::newFile("int1", big, true);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	block16 readSmall;
+	r = OSFS::getFile("small", readSmall);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	block64 readBig;
+	r = OSFS::getFile("int1", readBig);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+}
+
+unittest(test_free_index_unmerged_run_power_loss)
+{
+	// Deleting "a" and then moving "b" leaves a run of two deleted headers
+	// which the free index knows as one slot, although they aren't merged in
+	// storage. Splitting that slot for a new file must keep the chain intact
+	// whenever the power is cut.
+	for (unsigned int newSize = 5; newSize <= 12; newSize += 7) {
+		for (long writes = 0; ; writes++) {
+			clear_storage();
+			OSFS::format();
+			OSFS::mount();
+
+			long testLong = 456;
+			int testInt = 123;
+			long longs[2] = {1, 2};
+			OSFS::newFile("a", testLong);
+			OSFS::newFile("b", testLong);
+			OSFS::newFile("c", testInt);
+			OSFS::newFile("z", testInt);
+			OSFS::deleteFile("a");
+			OSFS::newFile("b", longs, true);
+			OSFS::sync();
+
+			byte data[12] = {};
+			writesUntilPowerLoss = writes;
+			writeCalls = 0;
+			auto r = OSFS::newFile("new", data, newSize, false);
+			assertEqual(int(OSFS::result::NO_ERROR), int(r));
+			OSFS::sync();
+			bool cut = (unsigned long)writes < writeCalls;
+
+			writesUntilPowerLoss = -1;
+			OSFS::invalidateDirCache();
+			r = OSFS::mount();
+			assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+			int readInt;
+			r = OSFS::getFile("c", readInt);
+			assertEqual(int(OSFS::result::NO_ERROR), int(r));
+			r = OSFS::getFile("z", readInt);
+			assertEqual(int(OSFS::result::NO_ERROR), int(r));
+			long readLongs[2];
+			r = OSFS::getFile("b", readLongs);
+			assertEqual(int(OSFS::result::NO_ERROR), int(r));
+			assertEqual(2, readLongs[1]);
+
+			if (!cut)
+				break;
+		}
+	}
+}
+
+#endif
+
+// Random creates, replacements and deletes of up to CHURN_FILES files, checked
+// against a record of what each should hold. With few enough files, the
+// directory cache knows them all and the free index is used instead of the
+// chain. With cutPower, the power is sometimes cut part way through, after
+// which the file must hold what it did before or after and the others must be
+// untouched.
+const int CHURN_FILES = 12;
+const unsigned int CHURN_MAX_SIZE = 80;
+
+struct churnFile {
+	bool exists;
+	byte fill;
+	OSFS::address_t size;
+};
+
+unsigned long churnSeed;
+
+unsigned int churnRandom(unsigned int range) {
+	churnSeed = churnSeed * 1103515245 + 12345;
+	return (churnSeed >> 8) % range;
+}
+
+// Whether a file is stored as recorded
+bool churnMatches(const char* name, const churnFile& file) {
+	OSFS::address_t filePtr, fileSize;
+	auto r = OSFS::getFileInfo(name, filePtr, fileSize);
+	if (!file.exists)
+		return r == OSFS::result::FILE_NOT_FOUND;
+	if (r != OSFS::result::NO_ERROR || fileSize != file.size)
+		return false;
+
+	byte data[CHURN_MAX_SIZE];
+	if (OSFS::readNBytesChk(filePtr, fileSize, data) != OSFS::result::NO_ERROR)
+		return false;
+	for (unsigned int i = 0; i < fileSize; i++) {
+		if (data[i] != file.fill)
+			return false;
+	}
+	return true;
+}
+
+// Forget everything in RAM, as a reset would
+void churnReset(bool mounted) {
+	OSFS::sync();
+	writesUntilPowerLoss = -1;
+	OSFS::invalidateDirCache();
+	if (mounted)
+		OSFS::mount();
+}
+
+void churn(unsigned long seed, int fileCount, OSFS::allocPolicy policy, bool mounted, bool cutPower) {
+	clear_storage();
+	OSFS::format();
+	OSFS::setAllocPolicy(policy);
+	if (mounted)
+		OSFS::mount();
+
+	churnFile files[CHURN_FILES] = {};
+	char name[] = "churn00";
+	churnSeed = seed;
+
+	for (int step = 0; step < 2000; step++) {
+		int n = churnRandom(fileCount);
+		name[5] = '0' + n / 10;
+		name[6] = '0' + n % 10;
+
+		// Only what's been synced is sure to survive the cut
+		bool cut = cutPower && churnRandom(4) == 0;
+		if (cut) {
+			OSFS::sync();
+			writesUntilPowerLoss = churnRandom(6);
+		}
+
+		churnFile after = files[n];
+		if (churnRandom(3) == 0) {
+			auto r = OSFS::deleteFile(name);
+			if (!cut)
+				assertEqual(int(files[n].exists ? OSFS::result::NO_ERROR : OSFS::result::FILE_NOT_FOUND), int(r));
+			after.exists = false;
+		} else {
+			after.exists = true;
+			after.fill = step;
+			after.size = 1 + churnRandom(CHURN_MAX_SIZE);
+
+			byte data[CHURN_MAX_SIZE];
+			memset(data, after.fill, after.size);
+			auto r = OSFS::newFile(name, data, after.size, true);
+			if (r == OSFS::result::INSUFFICIENT_SPACE) {
+				after = files[n];
+				if (!cut)
+					OSFS::compact();
+			} else if (!cut) {
+				assertEqual(int(OSFS::result::NO_ERROR), int(r));
+			}
+		}
+
+		if (cut) {
+			churnReset(mounted);
+			bool isNew = churnMatches(name, after);
+			assertTrue(isNew || churnMatches(name, files[n]));
+			if (isNew)
+				files[n] = after;
+		} else {
+			files[n] = after;
+			assertTrue(churnMatches(name, files[n]));
+		}
+
+		// Check every file now and then, as they'd be found after a reset
+		if (cut || step % 50 == 0) {
+			churnReset(mounted);
+			for (int i = 0; i < fileCount; i++) {
+				name[5] = '0' + i / 10;
+				name[6] = '0' + i % 10;
+				assertTrue(churnMatches(name, files[i]));
+			}
+		}
+	}
+}
+
+unittest(test_churn)
+{
+	for (unsigned long seed = 1; seed <= 4; seed++) {
+		for (int policy = 0; policy < 3; policy++) {
+			for (int mounted = 0; mounted < 2; mounted++) {
+				churn(seed, 4, OSFS::allocPolicy(policy), mounted, false);
+				churn(seed, CHURN_FILES, OSFS::allocPolicy(policy), mounted, false);
+			}
+		}
+	}
+}
+
+
+unittest(test_churn_power_loss)
+{
+	for (unsigned long seed = 1; seed <= 4; seed++) {
+		for (int policy = 0; policy < 3; policy++) {
+			for (int mounted = 0; mounted < 2; mounted++) {
+				churn(seed, 4, OSFS::allocPolicy(policy), mounted, true);
+				churn(seed, CHURN_FILES, OSFS::allocPolicy(policy), mounted, true);
+			}
+		}
+	}
+}
+
+unittest_main()
@@ -0,0 +1,222 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Unit tests for batches of files. These only run on platforms which enable
+// them: see .arduino-ci.yaml
+
+#if OSFS_BATCH_SIZE > 0
+
+unittest_setup() {
+	clear_storage();
+	OSFS::format();
+}
+
+long valueOf(const char* name) {
+	long readLong;
+	auto r = OSFS::getFile(name, readLong);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	return readLong;
+}
+
+bool exists(const char* name) {
+	OSFS::address_t filePtr, fileSize;
+	return OSFS::getFileInfo(name, filePtr, fileSize) == OSFS::result::NO_ERROR;
+}
+
+unittest(test_batch_invisible_until_commit)
+{
+	long one = 1, two = 2;
+
+	auto r = OSFS::beginBatch();
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	OSFS::newFile("long1", one);
+	OSFS::newFile("long2", two);
+
+	assertFalse(exists("long1"));
+	assertFalse(exists("long2"));
+
+	r = OSFS::commit();
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(1, valueOf("long1"));
+	assertEqual(2, valueOf("long2"));
+
+	// Files stored after the batch go after it
+	long three = 3;
+	OSFS::newFile("long3", three);
+	assertEqual(3, valueOf("long3"));
+	assertEqual(1, valueOf("long1"));
+}
+
+unittest(test_batch_replaces_files)
+{
+	long one = 1, two = 2;
+	OSFS::newFile("long1", one);
+	OSFS::newFile("long2", one);
+
+	OSFS::beginBatch();
+	OSFS::newFile("long1", two, true);
+	OSFS::newFile("long3", two);
+	auto r = OSFS::commit();
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	assertEqual(2, valueOf("long1"));
+	assertEqual(1, valueOf("long2"));
+	assertEqual(2, valueOf("long3"));
+
+	// The original is gone
+	OSFS::deleteFile("long1");
+	assertFalse(exists("long1"));
+}
+
+unittest(test_batch_refuses_existing_file)
+{
+	long one = 1, two = 2;
+	OSFS::newFile("long1", one);
+
+	OSFS::beginBatch();
+	OSFS::newFile("long2", two);
+	auto r = OSFS::newFile("long1", two);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	// Nothing of the batch takes effect
+	r = OSFS::commit();
+	assertEqual(int(OSFS::result::FILE_ALREADY_EXISTS), int(r));
+	assertEqual(1, valueOf("long1"));
+	assertFalse(exists("long2"));
+}
+
+unittest(test_batch_limits)
+{
+	long one = 1;
+	OSFS::beginBatch();
+
+	auto r = OSFS::newFile("long1", one);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	r = OSFS::newFile("long1", one, true);
+	assertEqual(int(OSFS::result::FILE_ALREADY_EXISTS), int(r));
+
+	char name[] = "fileA";
+	for (int i = 1; i < OSFS_BATCH_SIZE; i++) {
+		name[4] = 'A' + i;
+		r = OSFS::newFile(name, one);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	}
+	r = OSFS::newFile("onetoomany", one);
+	assertEqual(int(OSFS::result::INSUFFICIENT_SPACE), int(r));
+
+	r = OSFS::commit();
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertTrue(exists("fileB"));
+	assertFalse(exists("onetoomany"));
+}
+
+unittest(test_abort_batch)
+{
+	long one = 1;
+	OSFS::beginBatch();
+	OSFS::newFile("long1", one);
+	OSFS::abortBatch();
+
+	// With no batch, files are stored straight away
+	OSFS::newFile("long2", one);
+	assertTrue(exists("long2"));
+
+	auto r = OSFS::commit();
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertFalse(exists("long1"));
+}
+
+unittest(test_batch_power_loss)
+{
+	// Cut the power after every possible number of writes while a batch is
+	// stored and committed: afterwards, either all of the batch has taken
+	// effect or none of it has
+	for (long writes = 0; ; writes++) {
+		clear_storage();
+		OSFS::format();
+
+		long one = 1, two = 2;
+		OSFS::newFile("long1", one);
+		OSFS::newFile("long2", one);
+		OSFS::deleteFile("long2");
+		OSFS::newFile("long3", one);
+		OSFS::sync();
+
+		writesUntilPowerLoss = writes;
+		writeCalls = 0;
+		OSFS::beginBatch();
+		OSFS::newFile("long1", two, true);
+		OSFS::newFile("long2", two);
+		OSFS::newFile("long3", two, true);
+		auto r = OSFS::commit();
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		OSFS::sync();
+		unsigned long writesNeeded = writeCalls;
+		writesUntilPowerLoss = -1;
+
+		// RAM doesn't survive a power cut
+		OSFS::invalidateDirCache();
+
+		if (exists("long2")) {
+			assertEqual(2, valueOf("long1"));
+			assertEqual(2, valueOf("long2"));
+			assertEqual(2, valueOf("long3"));
+		} else {
+			assertEqual(1, valueOf("long1"));
+			assertEqual(1, valueOf("long3"));
+		}
+
+		// Only one copy of each is left
+		OSFS::deleteFile("long1");
+		OSFS::deleteFile("long3");
+		assertFalse(exists("long1"));
+		assertFalse(exists("long3"));
+
+		if ((unsigned long)writes >= writesNeeded)
+			break;
+	}
+}
+
+unittest(test_batch_saves_reads)
+{
+	// Store the same files with and without a batch, on a filesystem which
+	// already holds some
+	char name[] = "fileA";
+	unsigned long reads[2];
+
+	for (int batch = 0; batch < 2; batch++) {
+		clear_storage();
+		OSFS::format();
+		for (int i = 0; i < 8; i++) {
+			name[4] = 'A' + i;
+			OSFS::newFile(name, i);
+		}
+
+		clear_read_counts();
+		if (batch)
+			OSFS::beginBatch();
+		for (int i = 0; i < OSFS_BATCH_SIZE; i++) {
+			name[4] = 'a' + i;
+			OSFS::newFile(name, i);
+		}
+		if (batch)
+			OSFS::commit();
+		reads[batch] = readRequests();
+
+		name[4] = 'a' + OSFS_BATCH_SIZE - 1;
+		int readInt;
+		auto r = OSFS::getFile(name, readInt);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		assertEqual(OSFS_BATCH_SIZE - 1, readInt);
+	}
+
+	printf("%d files: %lu reads alone, %lu in a batch\n", OSFS_BATCH_SIZE, reads[0], reads[1]);
+	assertLess(reads[1], reads[0]);
+}
+
+#endif
+
+unittest_main()
@@ -0,0 +1,146 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Unit tests for the page cache. These only run on platforms which enable it:
+// see .arduino-ci.yaml
+
+#if OSFS_CACHE_PAGES > 0
+
+unittest_setup() {
+	clear_storage();
+	OSFS::format();
+	OSFS::sync();
+	OSFS::clearCacheStats();
+	OSFS::setOverwriteInPlace(false);
+}
+
+unittest(test_repeated_reads_hit_cache)
+{
+	int testInt = 123;
+	OSFS::newFile("int1", testInt);
+
+	int readInt;
+	auto r = OSFS::getFile("int1", readInt);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	clear_read_counts();
+	r = OSFS::getFile("int1", readInt);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(testInt, readInt);
+	assertEqual(0, readCalls);
+	assertLess(0, OSFS::getCacheStats().hits);
+	assertEqual(0, OSFS::getCacheStats().misses);
+}
+
+unittest(test_writes_wait_for_sync)
+{
+	int testInt = 123;
+	OSFS::newFile("int1", testInt);
+	OSFS::sync();
+
+	writeCalls = 0;
+	auto r = OSFS::deleteFile("int1");
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(0, writeCalls);
+
+	OSFS::fileHeader header;
+	read_storage(FIRST_FILE_OFFSET, sizeof(header), &header);
+	assertFalse(OSFS::isDeletedFile(header));
+
+	// OSFS sees its own change even before it's written
+	OSFS::address_t filePtr, fileSize;
+	r = OSFS::getFileInfo("int1", filePtr, fileSize);
+	assertEqual(int(OSFS::result::FILE_NOT_FOUND), int(r));
+
+	// The file's slot in the directory index changes too, perhaps in another
+	// page
+	const unsigned long pagesChanged = OSFS_DIR_INDEX_SIZE > 0 ? 2 : 1;
+
+	OSFS::clearCacheStats();
+	OSFS::sync();
+	assertMore(writeCalls, 0);
+	assertLessOrEqual(writeCalls, pagesChanged);
+	assertEqual(writeCalls, OSFS::getCacheStats().flushes);
+	read_storage(FIRST_FILE_OFFSET, sizeof(header), &header);
+	assertTrue(OSFS::isDeletedFile(header));
+}
+
+// On flash, each rewrite moves the file
+#if OSFS_FLASH_BLOCK_SIZE == 0
+unittest(test_rewrites_are_combined)
+{
+	// A single byte, so that it can't straddle two pages
+	OSFS::setOverwriteInPlace(true);
+	byte testByte = 123;
+	OSFS::newFile("byte1", testByte);
+	OSFS::sync();
+
+	writeCalls = 0;
+	for (testByte = 0; testByte < 10; testByte++) {
+		auto r = OSFS::newFile("byte1", testByte, true);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	}
+	OSFS::sync();
+	assertEqual(1, writeCalls);
+
+	byte readByte;
+	OSFS::invalidateDirCache();
+	OSFS::getFile("byte1", readByte);
+	assertEqual(9, readByte);
+}
+#endif
+
+unittest(test_sync_survives_power_loss)
+{
+	// Files written before a power cut during sync() must be there in full,
+	// up to the point at which the writes stopped
+	const char* names[] = {"file1", "file2", "file3", "file4"};
+	const int numFiles = sizeof(names) / sizeof(names[0]);
+
+	for (long writes = 0; ; writes++) {
+		clear_storage();
+		OSFS::format();
+		OSFS::sync();
+
+		for (int i = 0; i < numFiles; i++) {
+			long value = 1000 + i;
+			OSFS::newFile(names[i], value);
+			OSFS::deleteFile(names[0]);
+			OSFS::newFile(names[0], value, true);
+		}
+
+		writesUntilPowerLoss = writes;
+		writeCalls = 0;
+		OSFS::sync();
+		unsigned long writesNeeded = writeCalls;
+		writesUntilPowerLoss = -1;
+
+		// RAM doesn't survive a power cut
+		OSFS::invalidateDirCache();
+
+		bool missing = false;
+		for (int i = 1; i < numFiles; i++) {
+			long readValue;
+			auto r = OSFS::getFile(names[i], readValue);
+			if (r == OSFS::result::FILE_NOT_FOUND) {
+				missing = true;
+				continue;
+			}
+			assertEqual(int(OSFS::result::NO_ERROR), int(r));
+			assertFalse(missing);
+			assertEqual(1000 + i, readValue);
+		}
+
+		if ((unsigned long)writes >= writesNeeded) {
+			assertFalse(missing);
+			break;
+		}
+	}
+}
+
+#endif
+
+unittest_main()
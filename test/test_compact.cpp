@@ -0,0 +1,183 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Unit tests for reclaiming the space of deleted files
+
+unittest_setup() {
+	clear_storage();
+	OSFS::format();
+}
+
+struct block {
+	byte data[60];
+};
+
+int numBlocks;
+
+// Fill the storage with blocks, then delete every other one, leaving holes
+// too small for anything larger than a block
+void fragment() {
+	char name[] = "blockA";
+	block b;
+
+	for (numBlocks = 0; ; numBlocks++) {
+		name[5] = 'A' + numBlocks;
+		memset(b.data, numBlocks, sizeof(b.data));
+		if (OSFS::newFile(name, b) != OSFS::result::NO_ERROR)
+			break;
+	}
+
+	for (int i = 0; i < numBlocks; i += 2) {
+		name[5] = 'A' + i;
+		OSFS::deleteFile(name);
+	}
+}
+
+// Check that every odd block is intact
+void checkBlocks() {
+	char name[] = "blockA";
+	block b;
+
+	for (int i = 1; i < numBlocks; i += 2) {
+		name[5] = 'A' + i;
+		auto r = OSFS::getFile(name, b);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		for (unsigned int j = 0; j < sizeof(b.data); j++)
+			assertEqual(i, b.data[j]);
+	}
+}
+
+// On flash, deleted files are only reclaimed by compacting
+#if OSFS_FLASH_BLOCK_SIZE == 0
+unittest(test_deleted_neighbours_merge)
+{
+	block b = {};
+	OSFS::newFile("a", b);
+	OSFS::newFile("b", b);
+	OSFS::newFile("c", b);
+	OSFS::newFile("d", b);
+
+	OSFS::deleteFile("a");
+	OSFS::deleteFile("c");
+	OSFS::deleteFile("b");
+
+	// a, b and c now form one free slot
+	byte big[3 * sizeof(block)];
+	OSFS::address_t filePointer, fileSize;
+	auto r = OSFS::newFile("big", big);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	OSFS::getFileInfo("big", filePointer, fileSize);
+	assertEqual(OSFS::startOfEEPROM + OSFS::FIRST_HEADER_OFFSET + sizeof(OSFS::fileHeader), filePointer);
+}
+#endif
+
+unittest(test_compact_reclaims_holes)
+{
+	fragment();
+
+	byte big[5 * sizeof(block)];
+	auto r = OSFS::newFile("big", big);
+#if OSFS_FLASH_BLOCK_SIZE > 0
+	// On flash, newFile compacts by itself when it runs out of room
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+#else
+	assertEqual(int(OSFS::result::INSUFFICIENT_SPACE), int(r));
+
+	r = OSFS::compact();
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	checkBlocks();
+
+	r = OSFS::newFile("big", big);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+#endif
+	checkBlocks();
+}
+
+// On flash, compacting always copies the files to the other half
+#if OSFS_FLASH_BLOCK_SIZE == 0
+unittest(test_compact_twice_writes_nothing)
+{
+	fragment();
+	OSFS::compact();
+	OSFS::sync();
+
+	writeCalls = 0;
+	auto r = OSFS::compact();
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(0, writeCalls);
+}
+#endif
+
+unittest(test_compact_mounted)
+{
+	fragment();
+	OSFS::mount();
+
+	auto r = OSFS::compact();
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	checkBlocks();
+
+	byte big[5 * sizeof(block)];
+	r = OSFS::newFile("big", big);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	checkBlocks();
+
+	OSFS::unmount();
+}
+
+unittest(test_compact_survives_power_loss)
+{
+	fragment();
+
+	byte fragmented[SIZE_STORAGE];
+	memcpy(fragmented, storage, SIZE_STORAGE);
+
+	writeCalls = 0;
+#if OSFS_FLASH_BLOCK_SIZE > 0
+	eraseCalls = 0;
+#endif
+	OSFS::compact();
+	OSFS::sync();
+	long totalWrites = writeCalls;
+#if OSFS_FLASH_BLOCK_SIZE > 0
+	// Erases can be cut short too
+	totalWrites += eraseCalls;
+#endif
+	assertMore(totalWrites, 0);
+
+	// Cut the power after each write in turn and check that nothing is lost.
+	// The write which the power cut stops is lost, or torn at each point up
+	// to the end of a header. The page cache relies on its page writes not
+	// being torn, so with it they're only lost.
+#if OSFS_FLASH_BLOCK_SIZE == 0 && OSFS_CACHE_PAGES == 0
+	const long maxTorn = sizeof(OSFS::fileHeader);
+#else
+	const long maxTorn = -1;
+#endif
+	for (long n = 0; n < totalWrites; n++) {
+		for (long torn = -1; torn <= maxTorn; torn++) {
+			memcpy(storage, fragmented, SIZE_STORAGE);
+			OSFS::invalidateDirCache();
+
+			writesUntilPowerLoss = n;
+			tornWriteBytes = torn;
+			OSFS::compact();
+			OSFS::sync();
+			writesUntilPowerLoss = -1;
+			tornWriteBytes = -1;
+
+			OSFS::invalidateDirCache();
+			checkBlocks();
+
+			// Finishing the job should work too
+			auto r = OSFS::compact();
+			assertEqual(int(OSFS::result::NO_ERROR), int(r));
+			checkBlocks();
+		}
+	}
+}
+
+unittest_main()
@@ -0,0 +1,90 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Unit tests for comparing before writing. These only run on platforms which
+// enable it: see .arduino-ci.yaml
+
+#if OSFS_COMPARE_WRITES
+
+unittest_setup() {
+	clear_storage();
+	OSFS::format();
+	OSFS::sync();
+	OSFS::setOverwriteInPlace(true);
+}
+
+unittest_teardown() {
+	OSFS::setOverwriteInPlace(false);
+}
+
+// Files are only compared with what they overwrite in place, which never
+// happens on flash
+#if OSFS_FLASH_BLOCK_SIZE == 0
+unittest(test_unchanged_write_is_skipped)
+{
+	long testLong = 123456;
+	OSFS::newFile("long1", testLong);
+	OSFS::sync();
+
+	writeCalls = 0;
+	auto r = OSFS::newFile("long1", testLong, true);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	OSFS::sync();
+	assertEqual(0, writeCalls);
+}
+
+unittest(test_only_changed_bytes_are_written)
+{
+	long testLong = 0x11223344;
+	OSFS::newFile("long1", testLong);
+	OSFS::sync();
+
+	// Change only the lowest byte
+	writeCalls = 0;
+	bytesWritten = 0;
+	testLong = 0x11223345;
+	auto r = OSFS::newFile("long1", testLong, true);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	OSFS::sync();
+#if OSFS_CRC
+	// The CRC changes too
+	assertLessOrEqual(writeCalls, 2);
+	assertLessOrEqual(bytesWritten, 1 + sizeof(uint16_t));
+#else
+	assertEqual(1, writeCalls);
+	assertEqual(1, bytesWritten);
+#endif
+
+	long readLong;
+	OSFS::getFile("long1", readLong);
+	assertEqual(testLong, readLong);
+}
+#endif
+
+unittest(test_delete_writes_one_byte)
+{
+	int testInt = 123;
+	OSFS::newFile("int1", testInt);
+	OSFS::newFile("int2", testInt);
+	OSFS::sync();
+
+	bytesWritten = 0;
+	auto r = OSFS::deleteFile("int2");
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	OSFS::sync();
+
+#if OSFS_DIR_INDEX_SIZE > 0
+	// So does some of the file's slot in the directory index, which is
+	// marked as removed
+	assertLessOrEqual(bytesWritten, 1 + sizeof(OSFS::address_t));
+#else
+	assertEqual(1, bytesWritten);
+#endif
+}
+
+#endif
+
+unittest_main()
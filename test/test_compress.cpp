@@ -0,0 +1,289 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Unit tests for compressed files. These only run on platforms which enable
+// them: see .arduino-ci.yaml
+
+#if OSFS_COMPRESS
+
+unittest_setup() {
+	clear_storage();
+	OSFS::format();
+}
+
+// A table of the sort which compresses well: a few values which repeat with
+// small changes, then a long run of zeros
+struct table {
+	uint16_t steps[64];
+	char labels[96];
+	byte padding[200];
+};
+
+void fillTable(table& t) {
+	memset(&t, 0, sizeof(t));
+	for (int i = 0; i < 64; i++)
+		t.steps[i] = (i % 8) * 100;
+	const char label[] = "Setting ";
+	for (unsigned int i = 0; i < sizeof(t.labels); i++)
+		t.labels[i] = i % 12 < 8 ? label[i % 12] : '0' + i / 12;
+}
+
+// Bytes which don't compress at all
+void fillNoise(byte* data, unsigned int size) {
+	uint32_t seed = 12345;
+	for (unsigned int i = 0; i < size; i++) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = seed >> 16;
+	}
+}
+
+OSFS::address_t storedSize(const char* name) {
+	OSFS::address_t filePtr, fileSize;
+	auto r = OSFS::getFileInfo(name, filePtr, fileSize);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	return fileSize;
+}
+
+unittest(test_compressed_round_trip)
+{
+	table t;
+	fillTable(t);
+
+	bytesWritten = 0;
+	auto r = OSFS::newFile("table", &t, sizeof(t), false, true);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	OSFS::sync();
+
+	// It takes a fraction of the space, and of the writes
+	assertLess(storedSize("table"), sizeof(t) / 4);
+	assertLess(bytesWritten, sizeof(t) / 2);
+
+	table readT;
+	memset(&readT, 0xAA, sizeof(readT));
+	r = OSFS::getFile("table", readT, true);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(0, memcmp(&t, &readT, sizeof(t)));
+
+	// The buffer must still be the size of the file before compression
+	byte small[sizeof(t) / 4];
+	r = OSFS::getFile("table", small);
+	assertEqual(int(OSFS::result::BUFFER_WRONG_SIZE), int(r));
+}
+
+unittest(test_only_when_smaller)
+{
+	byte noise[100];
+	fillNoise(noise, sizeof(noise));
+
+	auto r = OSFS::newFile("noise", &noise, sizeof(noise), false, true);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(sizeof(noise), storedSize("noise"));
+
+	byte readNoise[sizeof(noise)];
+	r = OSFS::getFile("noise", readNoise);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(0, memcmp(noise, readNoise, sizeof(noise)));
+
+	// Nor unless asked for
+	table t;
+	fillTable(t);
+	OSFS::newFile("table", t);
+	assertEqual(sizeof(t), storedSize("table"));
+}
+
+unittest(test_many_shapes)
+{
+	// Runs and repeats of every length, near and far, and at either end
+	byte data[600];
+	byte readData[sizeof(data)];
+	for (int shape = 0; shape < 12; shape++) {
+		fillNoise(data, sizeof(data));
+		for (unsigned int i = 0; i < sizeof(data); i++) {
+			unsigned int period = 1 + shape * 7;
+			if ((i / 150) % 2 == unsigned(shape % 2))
+				data[i] = data[i % period];
+		}
+
+		unsigned int size = sizeof(data) - shape * 41;
+		auto r = OSFS::newFile("shape", (void*)data, size, true, true);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+		r = OSFS::getFile("shape", (void*)readData, size);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		assertEqual(0, memcmp(data, readData, size));
+	}
+}
+
+unittest(test_file_reads)
+{
+	table t;
+	fillTable(t);
+	OSFS::newFile("table", &t, sizeof(t), false, true);
+
+	OSFS::File file;
+	auto r = file.open("table");
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(sizeof(t), file.size());
+
+	// Reads from anywhere, in pieces of any size
+	const byte* expected = (const byte*)&t;
+	byte buf[37];
+	for (OSFS::address_t offset = 0; offset < sizeof(t); offset += sizeof(buf)) {
+		unsigned int len = sizeof(t) - offset < sizeof(buf) ? sizeof(t) - offset : sizeof(buf);
+		r = file.read(offset, buf, len);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		assertEqual(0, memcmp(expected + offset, buf, len));
+	}
+
+	r = file.read(buf, 1);
+	assertEqual(int(OSFS::result::END_OF_FILE), int(r));
+
+	// But not written to
+	file.seek(0);
+	r = file.write(buf, 1);
+	assertEqual(int(OSFS::result::READ_ONLY), int(r));
+	r = file.append(buf, 1);
+	assertEqual(int(OSFS::result::READ_ONLY), int(r));
+}
+
+unittest(test_file_reads_carry_on)
+{
+	table t;
+	fillTable(t);
+	OSFS::newFile("table", &t, sizeof(t), false, true);
+
+	OSFS::File file;
+	auto r = file.open("table");
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	// A byte at a time, each read carrying on from the last rather than
+	// uncompressing everything before it again
+	const byte* expected = (const byte*)&t;
+	bool same = true;
+	clear_read_counts();
+	for (unsigned int i = 0; i < sizeof(t); i++) {
+		byte b;
+		r = file.read(&b, 1);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		same = same && b == expected[i];
+	}
+	assertTrue(same);
+	assertTrue(readRequests() <= 2 * sizeof(t));
+
+	// Going back starts again from the beginning
+	byte buf[5];
+	r = file.read(300, buf, sizeof(buf));
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(0, memcmp(expected + 300, buf, sizeof(buf)));
+	r = file.read(10, buf, sizeof(buf));
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(0, memcmp(expected + 10, buf, sizeof(buf)));
+}
+
+unittest(test_dir_reports_size)
+{
+	table t;
+	fillTable(t);
+	OSFS::newFile("table", &t, sizeof(t), false, true);
+
+	OSFS::Dir dir;
+	OSFS::dirEntry entry;
+	auto r = dir.next(entry);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(0, strcmp("table", entry.name));
+	assertEqual(sizeof(t), entry.size);
+}
+
+unittest(test_overwrite_changes_kind)
+{
+	table t;
+	fillTable(t);
+	byte noise[sizeof(t)];
+	fillNoise(noise, sizeof(noise));
+	table readT;
+
+	// Compressed, then not, then compressed again, each over the last
+	OSFS::newFile("table", &t, sizeof(t), false, true);
+	OSFS::newFile("table", &noise, sizeof(noise), true, true);
+	auto r = OSFS::getFile("table", readT);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(0, memcmp(noise, &readT, sizeof(t)));
+
+	t.steps[3] = 12345;
+	OSFS::newFile("table", &t, sizeof(t), true, true);
+	r = OSFS::getFile("table", readT);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(0, memcmp(&t, &readT, sizeof(t)));
+
+	// Likewise in place, where it fits
+	t.steps[4] = 54321;
+	OSFS::newFile("table", &t, sizeof(t), true, true);
+	r = OSFS::getFile("table", readT);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(0, memcmp(&t, &readT, sizeof(t)));
+}
+
+unittest(test_compact_keeps_compression)
+{
+	int testInt = 123;
+	OSFS::newFile("int1", testInt);
+	table t;
+	fillTable(t);
+	OSFS::newFile("table", &t, sizeof(t), false, true);
+
+	OSFS::deleteFile("int1");
+	auto r = OSFS::compact();
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	table readT;
+	r = OSFS::getFile("table", readT);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(0, memcmp(&t, &readT, sizeof(t)));
+}
+
+#if OSFS_CRC
+unittest(test_corruption_detected)
+{
+	table t;
+	fillTable(t);
+	OSFS::newFile("table", &t, sizeof(t), false, true);
+
+	OSFS::address_t filePtr, fileSize;
+	OSFS::getFileInfo("table", filePtr, fileSize);
+	OSFS::sync();
+	storage[filePtr - OSFS::startOfEEPROM + fileSize - 1] ^= 0x10;
+	OSFS::invalidateDirCache();
+
+	table readT;
+	auto r = OSFS::getFile("table", readT, true);
+	assertEqual(int(OSFS::result::CORRUPT_FILE), int(r));
+}
+#endif
+
+#if OSFS_BATCH_SIZE > 0
+unittest(test_compressed_in_batch)
+{
+	table t;
+	fillTable(t);
+	int testInt = 123;
+
+	OSFS::beginBatch();
+	OSFS::newFile("table", &t, sizeof(t), false, true);
+	OSFS::newFile("int1", testInt);
+	auto r = OSFS::commit();
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertLess(storedSize("table"), sizeof(t) / 4);
+
+	table readT;
+	r = OSFS::getFile("table", readT, true);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(0, memcmp(&t, &readT, sizeof(t)));
+}
+#endif
+
+#endif
+
+unittest_main()
@@ -0,0 +1,202 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Unit tests for CRCs. Apart from the first, these only run on platforms which
+// enable them: see .arduino-ci.yaml
+
+unittest_setup() {
+	clear_storage();
+	OSFS::format();
+}
+
+unittest(test_crc16_check_value)
+{
+	// The standard check value for CRC-16/CCITT-FALSE
+	const char digits[] = "123456789";
+	assertEqual(0x29B1, OSFS::crc16(OSFS::CRC_INIT, digits, 9));
+
+	// Adding bytes in pieces gives the same answer
+	uint16_t crc = OSFS::crc16(OSFS::CRC_INIT, digits, 4);
+	assertEqual(0x29B1, OSFS::crc16(crc, digits + 4, 5));
+}
+
+#if OSFS_CRC
+
+// Flip a bit of a file's contents behind OSFS's back
+void corruptFile(const char* name, unsigned int offset) {
+	OSFS::address_t filePtr, fileSize;
+	auto r = OSFS::getFileInfo(name, filePtr, fileSize);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	OSFS::sync();
+	storage[filePtr - OSFS::startOfEEPROM + offset] ^= 0x10;
+	OSFS::invalidateDirCache();
+}
+
+// Scrub until a pass is complete, returning the number of corrupt files found
+int scrubPass(unsigned int maxFiles) {
+	int corrupt = 0;
+	bool passComplete = false;
+
+	while (!passComplete) {
+		auto r = OSFS::scrub(maxFiles, passComplete);
+		if (r == OSFS::result::CORRUPT_FILE)
+			corrupt++;
+		else
+			assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	}
+
+	return corrupt;
+}
+
+unittest(test_verify_detects_corruption)
+{
+	long testLong = 123456;
+	OSFS::newFile("long1", testLong);
+
+	long readLong;
+	auto r = OSFS::getFile("long1", readLong, true);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(testLong, readLong);
+
+	corruptFile("long1", 1);
+
+	// Unless asked to verify, the corrupt contents are returned
+	r = OSFS::getFile("long1", readLong);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertNotEqual(testLong, readLong);
+
+	r = OSFS::getFile("long1", readLong, true);
+	assertEqual(int(OSFS::result::CORRUPT_FILE), int(r));
+}
+
+unittest(test_crc_follows_changes)
+{
+	int testInt = 123;
+	long testLong = 456;
+	OSFS::newFile("int1", testInt);
+	OSFS::newFile("int2", testInt);
+
+	// In place, then moved
+	OSFS::newFile("int1", testInt, true);
+	OSFS::newFile("int2", testLong, true);
+	OSFS::deleteFile("int1");
+	OSFS::compact();
+
+	// Appended to, in place and by moving, then rewritten in the middle
+	OSFS::File file;
+	file.open("log", true);
+	for (int i = 0; i < 10; i++)
+		file.append(&testLong, sizeof(testLong));
+	file.seek(4);
+	file.write(&testInt, sizeof(testInt));
+	file.close();
+
+	long readLong;
+	auto r = OSFS::getFile("int2", readLong, true);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	assertEqual(0, scrubPass(1));
+}
+
+unittest(test_scrub_spreads_work)
+{
+	char name[] = "fileA";
+	for (int i = 0; i < 6; i++) {
+		name[4] = 'A' + i;
+		OSFS::newFile(name, i);
+	}
+	corruptFile("fileD", 0);
+
+	// Two files per call: the corrupt one is found by the second
+	bool passComplete;
+	char corruptName[OSFS::FILE_NAME_LENGTH + 1];
+
+	auto r = OSFS::scrub(2, passComplete, corruptName);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertFalse(passComplete);
+
+	r = OSFS::scrub(2, passComplete, corruptName);
+	assertEqual(int(OSFS::result::CORRUPT_FILE), int(r));
+	assertEqual(0, strcmp("fileD", corruptName));
+	assertFalse(passComplete);
+
+	r = OSFS::scrub(2, passComplete, corruptName);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertTrue(passComplete);
+
+	// Then the next pass starts again
+	assertEqual(1, scrubPass(4));
+}
+
+unittest(test_scrub_carries_on_without_rewalking)
+{
+	char name[] = "fileA";
+	for (int i = 0; i < 10; i++) {
+		name[4] = 'A' + i;
+		OSFS::newFile(name, i);
+	}
+
+	bool passComplete;
+	for (int i = 0; i < 7; i++) {
+		auto r = OSFS::scrub(1, passComplete);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	}
+
+	// The eighth file costs the same as the first: the version, the header
+	// where the last call stopped, then the file's header and contents
+	clear_read_counts();
+	auto r = OSFS::scrub(1, passComplete);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertFalse(passComplete);
+	assertTrue(readRequests() <= 4);
+
+	// Once that file is gone, the chain is walked to find where to carry on
+	OSFS::deleteFile("fileH");
+	corruptFile("fileI", 0);
+	char corruptName[OSFS::FILE_NAME_LENGTH + 1];
+	r = OSFS::scrub(1, passComplete, corruptName);
+	assertEqual(int(OSFS::result::CORRUPT_FILE), int(r));
+	assertEqual(0, strcmp("fileI", corruptName));
+
+	r = OSFS::scrub(1, passComplete);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertTrue(passComplete);
+}
+
+unittest(test_scrub_detects_bad_size)
+{
+	int testInt = 123;
+	OSFS::newFile("int1", testInt);
+	OSFS::newFile("int2", testInt);
+
+	// Make int1 run into int2's header
+	OSFS::address_t filePtr, fileSize;
+	OSFS::getFileInfo("int1", filePtr, fileSize);
+	OSFS::sync();
+	OSFS::address_t badSize = fileSize + 1;
+	memcpy(&storage[filePtr - OSFS::startOfEEPROM - sizeof(OSFS::fileHeader) + offsetof(OSFS::fileHeader, fileSize)],
+		&badSize, sizeof(badSize));
+	OSFS::invalidateDirCache();
+
+	char corruptName[OSFS::FILE_NAME_LENGTH + 1];
+	bool passComplete;
+	auto r = OSFS::scrub(2, passComplete, corruptName);
+	assertEqual(int(OSFS::result::CORRUPT_FILE), int(r));
+	assertEqual(0, strcmp("int1", corruptName));
+}
+
+unittest(test_crc_in_version)
+{
+	OSFS::sync();
+	OSFS::FSInfo info;
+	read_storage(0, sizeof(info), &info);
+	assertNotEqual(0, info.version & 0x4000);
+}
+
+#endif
+
+unittest_main()
@@ -0,0 +1,140 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Unit tests for listing files and getting statistics
+
+unittest_setup() {
+	clear_storage();
+	OSFS::format();
+}
+
+// On flash, files only have one half of the storage
+#if OSFS_FLASH_BLOCK_SIZE > 0
+const OSFS::address_t TOTAL_SPACE = SIZE_STORAGE / 2 - 1 - OSFS::FIRST_HEADER_OFFSET;
+#else
+const OSFS::address_t TOTAL_SPACE = OSFS::endOfEEPROM - (OSFS::startOfEEPROM + OSFS::FIRST_HEADER_OFFSET);
+#endif
+const OSFS::address_t INT_FILE_SPACE = sizeof(OSFS::fileHeader) + sizeof(int);
+
+void checkEntry(OSFS::Dir& dir, const char* name) {
+	OSFS::dirEntry entry;
+	auto r = dir.next(entry);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(0, strcmp(name, entry.name));
+
+	OSFS::address_t filePtr, fileSize;
+	OSFS::getFileInfo(name, filePtr, fileSize);
+	assertEqual(filePtr, entry.filePointer);
+	assertEqual(fileSize, entry.size);
+}
+
+unittest(test_list_empty)
+{
+	OSFS::Dir dir;
+	OSFS::dirEntry entry;
+	auto r = dir.next(entry);
+	assertEqual(int(OSFS::result::END_OF_FILE), int(r));
+}
+
+unittest(test_list_unformatted)
+{
+	clear_storage();
+
+	OSFS::Dir dir;
+	OSFS::dirEntry entry;
+	auto r = dir.next(entry);
+	assertEqual(int(OSFS::result::UNFORMATTED), int(r));
+}
+
+unittest(test_list_files)
+{
+	int testInt = 123;
+	long testLong = 456;
+	OSFS::newFile("int1", testInt);
+	OSFS::newFile("long1", testLong);
+	OSFS::newFile("int2", testInt);
+	OSFS::deleteFile("long1");
+
+	OSFS::Dir dir;
+	checkEntry(dir, "int1");
+	checkEntry(dir, "int2");
+
+	OSFS::dirEntry entry;
+	auto r = dir.next(entry);
+	assertEqual(int(OSFS::result::END_OF_FILE), int(r));
+	r = dir.next(entry);
+	assertEqual(int(OSFS::result::END_OF_FILE), int(r));
+
+	dir.rewind();
+	checkEntry(dir, "int1");
+}
+
+unittest(test_stats_empty)
+{
+	OSFS::fsStats stats;
+	auto r = OSFS::getFsStats(stats);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	// Just the dummy header
+	assertEqual(0, stats.files);
+	assertEqual(0, stats.deletedFiles);
+	assertEqual(1, stats.chainLength);
+	assertEqual(0, stats.used);
+	assertEqual(TOTAL_SPACE, stats.free);
+#if OSFS_FLASH_BLOCK_SIZE > 0
+	// The dummy header is never reused on flash
+	assertEqual(TOTAL_SPACE - sizeof(OSFS::fileHeader), stats.largestFree);
+#else
+	assertEqual(TOTAL_SPACE, stats.largestFree);
+#endif
+}
+
+unittest(test_stats_count_files_and_holes)
+{
+	int testInt = 123;
+	OSFS::newFile("int1", testInt);
+	OSFS::newFile("int2", testInt);
+	OSFS::newFile("int3", testInt);
+	OSFS::deleteFile("int2");
+
+	OSFS::fsStats stats;
+	clear_read_counts();
+	auto r = OSFS::getFsStats(stats);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	// One read of each header, after the version check
+	assertLessOrEqual(readRequests(), 1 + stats.chainLength);
+
+	assertEqual(2, stats.files);
+	assertEqual(2 * INT_FILE_SPACE, stats.used);
+	assertEqual(TOTAL_SPACE - 2 * INT_FILE_SPACE, stats.free);
+
+#if OSFS_FLASH_BLOCK_SIZE > 0
+	// On flash, the dummy header is deleted once there's a file after it,
+	// and no deleted space can be used until the storage is compacted
+	const OSFS::address_t CHAIN_SPACE = sizeof(OSFS::fileHeader) + 3 * INT_FILE_SPACE;
+	assertEqual(2, stats.deletedFiles);
+	assertEqual(4, stats.chainLength);
+	assertEqual(TOTAL_SPACE - CHAIN_SPACE, stats.largestFree);
+
+	OSFS::deleteFile("int3");
+	OSFS::getFsStats(stats);
+	assertEqual(1, stats.files);
+	assertEqual(TOTAL_SPACE - CHAIN_SPACE, stats.largestFree);
+#else
+	assertEqual(1, stats.deletedFiles);
+	assertEqual(3, stats.chainLength);
+	assertEqual(TOTAL_SPACE - 3 * INT_FILE_SPACE, stats.largestFree);
+
+	// Deleting the last file joins the hole to the space after the chain
+	OSFS::deleteFile("int3");
+	OSFS::getFsStats(stats);
+	assertEqual(1, stats.files);
+	assertEqual(TOTAL_SPACE - INT_FILE_SPACE, stats.largestFree);
+#endif
+}
+
+unittest_main()
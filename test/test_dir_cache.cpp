@@ -0,0 +1,128 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Unit tests for the directory cache. These only run on platforms which
+// enable it: see .arduino-ci.yaml
+
+#if OSFS_DIR_CACHE_SIZE > 0
+
+unittest_setup() {
+	clear_storage();
+	OSFS::format();
+}
+
+unittest(test_cached_lookup_avoids_chain)
+{
+	int testInt = 123;
+	OSFS::newFile("int1", testInt);
+	OSFS::newFile("int2", testInt);
+	OSFS::newFile("int3", testInt);
+
+	OSFS::address_t filePtr, fileSize;
+	clear_read_counts();
+	auto r = OSFS::getFileInfo("int3", filePtr, fileSize);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(sizeof(int), fileSize);
+
+	// Only the version check reads storage: the name is held in the cache
+	assertEqual(1, readRequests());
+
+	// A missing file costs nothing more than the version check
+	clear_read_counts();
+	r = OSFS::getFileInfo("nothere", filePtr, fileSize);
+	assertEqual(int(OSFS::result::FILE_NOT_FOUND), int(r));
+	assertEqual(1, readRequests());
+}
+
+unittest(test_mounted_cache_hit_reads_nothing)
+{
+	int testInt = 123;
+	OSFS::newFile("int1", testInt);
+	OSFS::newFile("int2", testInt);
+	assertEqual(int(OSFS::result::NO_ERROR), int(OSFS::mount()));
+
+	// Load the cache
+	OSFS::address_t filePtr, fileSize;
+	auto r = OSFS::getFileInfo("int1", filePtr, fileSize);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	clear_read_counts();
+	OSFS::address_t filePtr2, fileSize2;
+	r = OSFS::getFileInfo("int1", filePtr2, fileSize2);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(filePtr, filePtr2);
+	assertEqual(sizeof(int), fileSize2);
+	assertEqual(0, readRequests());
+
+	OSFS::unmount();
+}
+
+unittest(test_cache_tracks_delete_and_overwrite)
+{
+	int testInt = 123;
+	OSFS::newFile("int1", testInt);
+	OSFS::newFile("int2", testInt);
+
+	auto r = OSFS::deleteFile("int1");
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	OSFS::address_t filePtr, fileSize;
+	r = OSFS::getFileInfo("int1", filePtr, fileSize);
+	assertEqual(int(OSFS::result::FILE_NOT_FOUND), int(r));
+
+	long testLong = 456;
+	r = OSFS::newFile("int2", testLong, true);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	long readLong;
+	r = OSFS::getFile("int2", readLong);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(testLong, readLong);
+}
+
+unittest(test_cache_overflow_falls_back_to_storage)
+{
+	char name[] = "fileA";
+	for (int i = 0; i < OSFS_DIR_CACHE_SIZE + 3; i++) {
+		name[4] = 'A' + i;
+		auto r = OSFS::newFile(name, i);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	}
+
+	for (int i = 0; i < OSFS_DIR_CACHE_SIZE + 3; i++) {
+		name[4] = 'A' + i;
+		int readInt;
+		auto r = OSFS::getFile(name, readInt);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		assertEqual(i, readInt);
+	}
+}
+
+unittest(test_cache_reloads_after_invalidate)
+{
+	int testInt = 123;
+	OSFS::newFile("int1", testInt);
+
+	int readInt;
+	auto r = OSFS::getFile("int1", readInt);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	// Delete the file behind OSFS's back
+	OSFS::sync();
+#if OSFS_FLASH_BLOCK_SIZE > 0
+	storage[FIRST_FILE_OFFSET + offsetof(OSFS::fileHeader, flags)] &= ~(1 << OSFS::DELBIT);
+#else
+	storage[FIRST_FILE_OFFSET + offsetof(OSFS::fileHeader, flags)] |= 1 << OSFS::DELBIT;
+#endif
+	OSFS::invalidateDirCache();
+
+	r = OSFS::getFile("int1", readInt);
+	assertEqual(int(OSFS::result::FILE_NOT_FOUND), int(r));
+}
+
+#endif
+
+unittest_main()
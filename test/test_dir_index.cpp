@@ -0,0 +1,270 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Unit tests for the directory index. These only run on platforms which
+// enable it: see .arduino-ci.yaml
+
+#if OSFS_DIR_INDEX_SIZE > 0
+
+unittest_setup() {
+	clear_storage();
+	OSFS::format();
+}
+
+// Create files named fileA, fileB, ... each holding its own number
+void makeFiles(int count) {
+	char name[] = "fileA";
+	for (int i = 0; i < count; i++) {
+		name[4] = 'A' + i;
+		auto r = OSFS::newFile(name, i);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	}
+}
+
+void checkFiles(int count) {
+	char name[] = "fileA";
+	for (int i = 0; i < count; i++) {
+		name[4] = 'A' + i;
+		int readInt;
+		auto r = OSFS::getFile(name, readInt);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		assertEqual(i, readInt);
+	}
+}
+
+OSFS::dirIndexEntry indexSlot(unsigned int slot) {
+	OSFS::dirIndexEntry entry;
+	OSFS::sync();
+	memcpy(&entry, storage + sizeof(OSFS::FSInfo) + slot * sizeof(OSFS::dirIndexEntry), sizeof(entry));
+	return entry;
+}
+
+unittest(test_index_is_in_version)
+{
+	OSFS::sync();
+	OSFS::FSInfo info;
+	memcpy(&info, storage, sizeof(info));
+	assertNotEqual(0, info.version & 0x0F00);
+
+	// Storage with a different size of index must be refused
+	info.version += 0x100;
+	memcpy(storage, &info, sizeof(info));
+	OSFS::invalidateDirCache();
+
+	auto r = OSFS::checkLibVersion();
+	assertEqual(int(OSFS::result::WRONG_VERSION), int(r));
+}
+
+unittest(test_lookup_avoids_chain)
+{
+	int numFiles = OSFS_DIR_INDEX_SIZE / 2;
+	makeFiles(numFiles);
+
+	// Each lookup costs the version check, then a slot or two and a header.
+	// Without the index, it would cost a read of every header before the
+	// file's, or of every header if the file is missing.
+	OSFS::address_t filePtr, fileSize;
+	char name[] = "fileA";
+
+	clear_read_counts();
+	for (int i = 0; i < numFiles; i++) {
+		name[4] = 'A' + i;
+		auto r = OSFS::getFileInfo(name, filePtr, fileSize);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	}
+	assertLessOrEqual(readRequests(), 4 * numFiles);
+
+	clear_read_counts();
+	for (int i = 0; i < numFiles; i++) {
+		name[4] = 'a' + i;
+		auto r = OSFS::getFileInfo(name, filePtr, fileSize);
+		assertEqual(int(OSFS::result::FILE_NOT_FOUND), int(r));
+	}
+	assertLessOrEqual(readRequests(), 4 * numFiles);
+}
+
+unittest(test_index_tracks_delete_and_overwrite)
+{
+	makeFiles(4);
+
+	auto r = OSFS::deleteFile("fileB");
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	OSFS::address_t filePtr, fileSize;
+	r = OSFS::getFileInfo("fileB", filePtr, fileSize);
+	assertEqual(int(OSFS::result::FILE_NOT_FOUND), int(r));
+
+	// Too large to overwrite in place, so the file moves
+	long testLong = 456;
+	r = OSFS::newFile("fileA", testLong, true);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	long readLong;
+	r = OSFS::getFile("fileA", readLong);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(testLong, readLong);
+
+	int readInt;
+	r = OSFS::getFile("fileD", readInt);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(3, readInt);
+}
+
+unittest(test_index_follows_compact)
+{
+	makeFiles(6);
+	OSFS::deleteFile("fileA");
+	OSFS::deleteFile("fileC");
+
+	auto r = OSFS::compact();
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	OSFS::address_t filePtr, fileSize;
+	r = OSFS::getFileInfo("fileB", filePtr, fileSize);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(OSFS::startOfEEPROM + OSFS::FIRST_HEADER_OFFSET + sizeof(OSFS::fileHeader), filePtr);
+
+	int readInt;
+	r = OSFS::getFile("fileF", readInt);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(5, readInt);
+}
+
+unittest(test_full_index_falls_back_to_chain)
+{
+	int numFiles = OSFS_DIR_INDEX_SIZE + 3;
+	makeFiles(numFiles);
+	checkFiles(numFiles);
+
+	OSFS::deleteFile("fileA");
+
+	OSFS::address_t filePtr, fileSize;
+	auto r = OSFS::getFileInfo("fileA", filePtr, fileSize);
+	assertEqual(int(OSFS::result::FILE_NOT_FOUND), int(r));
+
+	char name[] = "fileA";
+	name[4] = 'A' + numFiles - 1;
+	int readInt;
+	r = OSFS::getFile(name, readInt);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(numFiles - 1, readInt);
+}
+
+unittest(test_mount_repairs_index)
+{
+	makeFiles(4);
+
+	// Lose the whole index, as if the power was cut before it was written
+	OSFS::sync();
+	memset(storage + sizeof(OSFS::FSInfo), 0, OSFS_DIR_INDEX_SIZE * sizeof(OSFS::dirIndexEntry));
+	OSFS::invalidateDirCache();
+
+	auto r = OSFS::mount();
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	OSFS::unmount();
+	OSFS::invalidateDirCache();
+
+	checkFiles(4);
+}
+
+unittest(test_mount_repairs_abandoned_slot)
+{
+	makeFiles(2);
+
+	// Point fileB's slot at a copy of its header outside the chain, as a
+	// compact() cut short after moving the file would leave it
+	OSFS::address_t filePtr, fileSize;
+	OSFS::getFileInfo("fileB", filePtr, fileSize);
+	OSFS::address_t header = filePtr - sizeof(OSFS::fileHeader);
+	OSFS::address_t copy = OSFS::endOfEEPROM - 40;
+
+	OSFS::sync();
+	memcpy(storage + (copy - OSFS::startOfEEPROM), storage + (header - OSFS::startOfEEPROM),
+		sizeof(OSFS::fileHeader) + fileSize);
+	for (unsigned int slot = 0; slot < OSFS_DIR_INDEX_SIZE; slot++) {
+		OSFS::dirIndexEntry entry = indexSlot(slot);
+		if (entry.headerAddress == header) {
+			entry.headerAddress = copy;
+			memcpy(storage + sizeof(OSFS::FSInfo) + slot * sizeof(OSFS::dirIndexEntry), &entry, sizeof(entry));
+		}
+	}
+	OSFS::invalidateDirCache();
+
+	OSFS::mount();
+	OSFS::unmount();
+	OSFS::invalidateDirCache();
+
+	OSFS::address_t foundPtr;
+	auto r = OSFS::getFileInfo("fileB", foundPtr, fileSize);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(filePtr, foundPtr);
+}
+
+unittest(test_recover_removes_slots_of_deleted_files)
+{
+	makeFiles(2);
+	OSFS::address_t filePtr, fileSize;
+	OSFS::getFileInfo("fileA", filePtr, fileSize);
+	OSFS::address_t header = filePtr - sizeof(OSFS::fileHeader);
+
+	// Cut the power after fileA is marked as deleted, before its slot is.
+	// Once its space is reused, the header the slot points to might no
+	// longer look deleted.
+	OSFS::sync();
+	writesUntilPowerLoss = 1;
+	OSFS::deleteFile("fileA");
+	OSFS::sync();
+	writesUntilPowerLoss = -1;
+	OSFS::invalidateDirCache();
+
+	auto r = OSFS::getFileInfo("fileA", filePtr, fileSize);
+	assertEqual(int(OSFS::result::FILE_NOT_FOUND), int(r));
+	for (unsigned int slot = 0; slot < OSFS_DIR_INDEX_SIZE; slot++)
+		assertNotEqual(header, indexSlot(slot).headerAddress);
+
+	int readInt;
+	r = OSFS::getFile("fileB", readInt);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(1, readInt);
+}
+
+unittest(test_mount_clears_removed_slots)
+{
+	// Delete three files in every four, leaving more than a quarter of the
+	// slots marked as removed
+	makeFiles(OSFS_DIR_INDEX_SIZE / 2);
+	char name[] = "fileA";
+	for (int i = 0; i < OSFS_DIR_INDEX_SIZE / 2; i++) {
+		name[4] = 'A' + i;
+		if (i % 4 != 0)
+			OSFS::deleteFile(name);
+	}
+
+	auto r = OSFS::mount();
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	OSFS::unmount();
+
+	unsigned int used = 0;
+	for (unsigned int slot = 0; slot < OSFS_DIR_INDEX_SIZE; slot++) {
+		OSFS::dirIndexEntry entry = indexSlot(slot);
+		assertNotEqual(1, entry.headerAddress);
+		if (entry.headerAddress != 0)
+			used++;
+	}
+	assertEqual(OSFS_DIR_INDEX_SIZE / 8, used);
+
+	for (int i = 0; i < OSFS_DIR_INDEX_SIZE / 2; i += 4) {
+		name[4] = 'A' + i;
+		int readInt;
+		r = OSFS::getFile(name, readInt);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		assertEqual(i, readInt);
+	}
+}
+
+#endif
+
+unittest_main()
@@ -0,0 +1,330 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Unit tests for File handles
+
+unittest_setup() {
+	clear_storage();
+	OSFS::format();
+}
+
+unittest_teardown() {
+	OSFS::unmount();
+}
+
+OSFS::address_t addressOf(const char* filename) {
+	OSFS::address_t filePointer, fileSize;
+	auto r = OSFS::getFileInfo(filename, filePointer, fileSize);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	return filePointer;
+}
+
+// Append count bytes, 0, 1, 2... starting from first, a few at a time
+void appendSequence(OSFS::File& file, int first, int count) {
+	byte chunk[8];
+	for (int i = 0; i < count; i += sizeof(chunk)) {
+		int len = count - i < (int)sizeof(chunk) ? count - i : sizeof(chunk);
+		for (int j = 0; j < len; j++)
+			chunk[j] = first + i + j;
+		auto r = file.append(chunk, len);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	}
+}
+
+// Check that a file holds count bytes 0, 1, 2..., reading a few at a time
+void checkSequence(const char* filename, int count) {
+	OSFS::File file;
+	auto r = file.open(filename);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(count, file.size());
+
+	byte chunk[8];
+	for (int i = 0; i < count; i += sizeof(chunk)) {
+		int len = count - i < (int)sizeof(chunk) ? count - i : sizeof(chunk);
+		r = file.read(chunk, len);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		for (int j = 0; j < len; j++)
+			assertEqual(byte(i + j), chunk[j]);
+	}
+
+	r = file.read(chunk, 1);
+	assertEqual(int(OSFS::result::END_OF_FILE), int(r));
+}
+
+unittest(test_open_missing_file)
+{
+	OSFS::File file;
+	auto r = file.open("nothere");
+	assertEqual(int(OSFS::result::FILE_NOT_FOUND), int(r));
+	assertFalse(file.isOpen());
+
+	byte b;
+	r = file.read(&b, 1);
+	assertEqual(int(OSFS::result::FILE_NOT_FOUND), int(r));
+
+	r = file.open("nothere", true);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertTrue(file.isOpen());
+	assertEqual(0, file.size());
+}
+
+unittest(test_read_part_of_file)
+{
+	long values[4] = {1, 2, 3, 4};
+	OSFS::newFile("values", values);
+
+	OSFS::File file;
+	file.open("values");
+	assertEqual(sizeof(values), file.size());
+
+	long value;
+	auto r = file.read(2 * sizeof(long), &value, sizeof(long));
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(3, value);
+
+	r = file.read(&value, sizeof(long));
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(4, value);
+
+	r = file.read(&value, sizeof(long));
+	assertEqual(int(OSFS::result::END_OF_FILE), int(r));
+
+	r = file.seek(sizeof(values) + 1);
+	assertEqual(int(OSFS::result::END_OF_FILE), int(r));
+}
+
+unittest(test_write_in_middle)
+{
+	long values[4] = {1, 2, 3, 4};
+	OSFS::newFile("values", values);
+
+	OSFS::File file;
+	file.open("values");
+	file.seek(sizeof(long));
+	long value = 20;
+	auto r = file.write(&value, sizeof(long));
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	file.close();
+
+	long readValues[4];
+	OSFS::getFile("values", readValues);
+	assertEqual(1, readValues[0]);
+	assertEqual(20, readValues[1]);
+	assertEqual(3, readValues[2]);
+}
+
+unittest(test_append_large_file)
+{
+	// Larger than we'd want to hold in RAM at once. On flash, each append
+	// moves the file, so it can't take much more than half of the space.
+#if OSFS_FLASH_BLOCK_SIZE > 0
+	const int LOG_SIZE = 384;
+#else
+	const int LOG_SIZE = 512;
+#endif
+	OSFS::File file;
+	file.open("log", true);
+#if OSFS_FLASH_BLOCK_SIZE == 0
+	OSFS::address_t before = addressOf("log");
+#endif
+	appendSequence(file, 0, LOG_SIZE);
+	file.close();
+
+	// The log is the last file, so it grows in place
+#if OSFS_FLASH_BLOCK_SIZE == 0
+	assertEqual(before, addressOf("log"));
+#endif
+	checkSequence("log", LOG_SIZE);
+}
+
+// On flash, files never grow in place
+#if OSFS_FLASH_BLOCK_SIZE == 0
+unittest(test_append_into_deleted_file)
+{
+	long values[16] = {};
+	int testInt = 123;
+	OSFS::File file;
+	file.open("log", true);
+	OSFS::newFile("values", values);
+	OSFS::newFile("int2", testInt);
+	OSFS::deleteFile("values");
+
+	// The log grows into the deleted file after it
+	OSFS::address_t before = addressOf("log");
+	appendSequence(file, 0, 16);
+	assertEqual(before, addressOf("log"));
+
+	// Space is taken ahead of time, so most chunks cost only one write for
+	// the data and one for the size, rather than two more to extend the slot
+	unsigned long writesBefore = writeCalls;
+	appendSequence(file, 16, 48);
+	file.close();
+
+	assertLess(writeCalls - writesBefore, 6 * 3);
+	checkSequence("log", 64);
+
+	int readInt;
+	auto r = OSFS::getFile("int2", readInt);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(testInt, readInt);
+
+	// The space that wasn't needed can still be used
+	r = OSFS::newFile("int3", testInt);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertLess(addressOf("int3"), addressOf("int2"));
+}
+
+unittest(test_append_into_unmerged_files_power_loss)
+{
+	// Moving "long1" leaves its slot deleted but not merged with the deleted
+	// file after it. Growing the log into them must keep the chain intact
+	// whenever the power is cut.
+	for (unsigned int count = 8; count <= 24; count += 4) {
+		for (long writes = 0; ; writes++) {
+			clear_storage();
+			OSFS::format();
+
+			long testLong = 456;
+			long values[4] = {};
+			long moreValues[8] = {};
+			int testInt = 123;
+			OSFS::File file;
+			file.open("log", true);
+			OSFS::newFile("long1", testLong);
+			OSFS::newFile("values", values);
+			OSFS::newFile("int1", testInt);
+			OSFS::deleteFile("values");
+			OSFS::newFile("long1", moreValues, true);
+			OSFS::sync();
+
+			byte data[24] = {};
+			writesUntilPowerLoss = writes;
+			writeCalls = 0;
+			file.append(data, count);
+			OSFS::sync();
+			unsigned long writesNeeded = writeCalls;
+			writesUntilPowerLoss = -1;
+			OSFS::invalidateDirCache();
+
+			int readInt;
+			auto r = OSFS::getFile("int1", readInt);
+			assertEqual(int(OSFS::result::NO_ERROR), int(r));
+			assertEqual(testInt, readInt);
+			r = OSFS::getFile("long1", moreValues);
+			assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+			if ((unsigned long)writes >= writesNeeded)
+				break;
+		}
+	}
+}
+#endif
+
+unittest(test_append_moves_file)
+{
+	int testInt = 123;
+	OSFS::File file;
+	file.open("log", true);
+	appendSequence(file, 0, 8);
+	OSFS::newFile("int1", testInt);
+
+	// No space after the log now, so it has to move
+	OSFS::address_t before = addressOf("log");
+	appendSequence(file, 8, 40);
+	file.close();
+
+	assertNotEqual(before, addressOf("log"));
+	checkSequence("log", 48);
+
+	int readInt;
+	OSFS::getFile("int1", readInt);
+	assertEqual(testInt, readInt);
+
+	// Its old space can be reused
+#if OSFS_FLASH_BLOCK_SIZE == 0
+	OSFS::newFile("int2", testInt);
+	assertEqual(before, addressOf("int2"));
+#endif
+}
+
+unittest(test_append_insufficient_space)
+{
+	OSFS::File file;
+	file.open("log", true);
+	appendSequence(file, 0, 8);
+	int testInt = 123;
+	OSFS::newFile("int1", testInt);
+
+	byte big[1000] = {};
+	auto r = file.append(big, sizeof(big));
+	assertEqual(int(OSFS::result::INSUFFICIENT_SPACE), int(r));
+	file.close();
+	checkSequence("log", 8);
+}
+
+unittest(test_append_mounted)
+{
+	OSFS::mount();
+
+	OSFS::File file;
+	file.open("log", true);
+	appendSequence(file, 0, 100);
+	file.close();
+
+	// A new file must go after the grown log
+	int testInt = 123;
+	OSFS::newFile("int1", testInt);
+	checkSequence("log", 100);
+
+	file.open("log");
+	appendSequence(file, 100, 20);
+	file.close();
+	checkSequence("log", 120);
+
+	int readInt;
+	OSFS::getFile("int1", readInt);
+	assertEqual(testInt, readInt);
+}
+
+unittest(test_append_power_loss)
+{
+	// Cut the power after every possible number of writes while a file is
+	// being moved: afterwards, the file must hold either its old or its new
+	// contents
+	for (long writes = 0; ; writes++) {
+		clear_storage();
+		OSFS::format();
+
+		int testInt = 123;
+		OSFS::File file;
+		file.open("log", true);
+		appendSequence(file, 0, 8);
+		OSFS::newFile("int1", testInt);
+		OSFS::sync();
+
+		writesUntilPowerLoss = writes;
+		writeCalls = 0;
+		appendSequence(file, 8, 8);
+		OSFS::sync();
+		unsigned long writesNeeded = writeCalls;
+		writesUntilPowerLoss = -1;
+
+		// RAM doesn't survive a power cut
+		OSFS::invalidateDirCache();
+
+		OSFS::File reopened;
+		reopened.open("log");
+		if (reopened.size() == 8)
+			checkSequence("log", 8);
+		else
+			checkSequence("log", 16);
+
+		if ((unsigned long)writes >= writesNeeded)
+			break;
+	}
+}
+
+unittest_main()
@@ -0,0 +1,213 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Unit tests for flash, where writes can only clear bits. These only run on
+// platforms which enable it: see .arduino-ci.yaml
+
+#if OSFS_FLASH_BLOCK_SIZE > 0
+
+unittest_setup() {
+	clear_storage();
+	OSFS::format();
+}
+
+long valueOf(const char* name) {
+	long readLong;
+	auto r = OSFS::getFile(name, readLong);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	return readLong;
+}
+
+bool exists(const char* name) {
+	OSFS::address_t filePtr, fileSize;
+	return OSFS::getFileInfo(name, filePtr, fileSize) == OSFS::result::NO_ERROR;
+}
+
+// How many longs fit in one half of the storage, after the dummy header
+const int LONGS_PER_HALF = (SIZE_STORAGE / 2 - 1 - OSFS::FIRST_HEADER_OFFSET - sizeof(OSFS::fileHeader))
+	/ (sizeof(OSFS::fileHeader) + sizeof(long));
+
+// Rewrite four settings over and over, so that the storage fills up many
+// times. Setting n ends up holding the last i < times with i % 4 == n.
+void churn(int times) {
+	char name[] = "long0";
+	for (long i = 0; i < times; i++) {
+		name[4] = '0' + i % 4;
+		auto r = OSFS::newFile(name, i, true);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	}
+}
+
+unittest(test_format_erases)
+{
+	// Both halves are erased, and only the first is written
+	assertEqual(2 * SIZE_STORAGE / 2 / OSFS_FLASH_BLOCK_SIZE, eraseCalls);
+	assertEqual(0, bitsNotCleared);
+	for (unsigned int i = SIZE_STORAGE / 2; i < SIZE_STORAGE; i++)
+		assertEqual(0xFF, storage[i]);
+}
+
+unittest(test_only_clears_bits)
+{
+	int testInt = 123;
+	long testLong = 456;
+	OSFS::newFile("int1", testInt);
+	OSFS::newFile("long1", testLong);
+	OSFS::newFile("int2", testInt);
+	OSFS::deleteFile("long1");
+	OSFS::newFile("int1", testLong, true);
+
+	OSFS::File file;
+	file.open("log", true);
+	for (int i = 0; i < 20; i++)
+		file.append(&testLong, sizeof(long));
+	file.seek(sizeof(long));
+	file.write(&testInt, sizeof(int));
+	file.close();
+
+	OSFS::compact();
+	churn(200);
+	OSFS::sync();
+
+	assertEqual(0, bitsNotCleared);
+	assertEqual(testLong, valueOf("int1"));
+}
+
+unittest(test_erases_only_when_full)
+{
+	eraseCalls = 0;
+	churn(LONGS_PER_HALF);
+	assertEqual(0, eraseCalls);
+
+	// Then a half is erased each time it fills up
+	churn(400);
+	assertMore(eraseCalls, 0);
+	assertLessOrEqual(eraseCalls, (400 / (LONGS_PER_HALF - 4) + 1) * SIZE_STORAGE / 2 / OSFS_FLASH_BLOCK_SIZE);
+
+	// The latest of each survived
+	assertEqual(396, valueOf("long0"));
+	assertEqual(399, valueOf("long3"));
+}
+
+unittest(test_compact_keeps_files)
+{
+	int testInt = 123;
+	long testLong = 456;
+	OSFS::newFile("int1", testInt);
+	OSFS::newFile("long1", testLong);
+	OSFS::deleteFile("int1");
+
+	// Twice, so that the files end up back in the first half
+	for (int i = 0; i < 2; i++) {
+		auto r = OSFS::compact();
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		OSFS::invalidateDirCache();
+
+		assertFalse(exists("int1"));
+		assertEqual(testLong, valueOf("long1"));
+	}
+
+	auto r = OSFS::newFile("int2", testInt);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(0, bitsNotCleared);
+}
+
+unittest(test_write_inside_file)
+{
+	long values[4] = {1, 2, 3, 4};
+	OSFS::newFile("values", values);
+
+	OSFS::File file;
+	file.open("values");
+	file.seek(sizeof(long));
+	long value = 20;
+	auto r = file.write(&value, sizeof(long));
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	file.close();
+
+	// The file was moved, keeping what came after the new data
+	long readValues[4];
+	r = OSFS::getFile("values", readValues);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(1, readValues[0]);
+	assertEqual(20, readValues[1]);
+	assertEqual(3, readValues[2]);
+	assertEqual(4, readValues[3]);
+}
+
+unittest(test_power_loss)
+{
+	// Cut the power after every possible number of writes and erases while
+	// a file is replaced in a full storage, which has to be compacted first.
+	// Either the replacement took effect or it didn't, and the storage can
+	// still be used afterwards.
+	for (long writes = 0; ; writes++) {
+		clear_storage();
+		OSFS::format();
+		churn(LONGS_PER_HALF);
+		OSFS::sync();
+
+		writesUntilPowerLoss = writes;
+		writeCalls = 0;
+		eraseCalls = 0;
+		long newValue = 1000;
+		OSFS::newFile("long1", newValue, true);
+		OSFS::sync();
+		unsigned long writesNeeded = writeCalls + eraseCalls;
+		writesUntilPowerLoss = -1;
+
+		// RAM doesn't survive a power cut
+		OSFS::invalidateDirCache();
+
+		long value = valueOf("long1");
+		if (value != newValue)
+			assertEqual((LONGS_PER_HALF - 2) / 4 * 4 + 1, value);
+		assertEqual((LONGS_PER_HALF - 1) / 4 * 4, valueOf("long0"));
+
+		// Only one copy is left, and nothing left over gets in the way
+		OSFS::deleteFile("long1");
+		assertFalse(exists("long1"));
+		churn(100);
+		assertEqual(0, bitsNotCleared);
+
+		if ((unsigned long)writes >= writesNeeded)
+			break;
+	}
+}
+
+#if OSFS_BATCH_SIZE > 0
+unittest(test_abandoned_batch)
+{
+	long one = 1, two = 2;
+	OSFS::newFile("long1", one);
+
+	// A batch which was never committed leaves its files at the end of the
+	// chain, which must be compacted away before anything else goes there
+	OSFS::beginBatch();
+	OSFS::newFile("long1", two, true);
+	OSFS::newFile("long2", two);
+	OSFS::abortBatch();
+
+	auto r = OSFS::newFile("long3", one);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(1, valueOf("long1"));
+	assertFalse(exists("long2"));
+	assertEqual(1, valueOf("long3"));
+
+	OSFS::beginBatch();
+	OSFS::newFile("long1", two, true);
+	OSFS::newFile("long2", two);
+	r = OSFS::commit();
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(2, valueOf("long1"));
+	assertEqual(2, valueOf("long2"));
+	assertEqual(0, bitsNotCleared);
+}
+#endif
+
+#endif
+
+unittest_main()
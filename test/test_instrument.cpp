@@ -0,0 +1,139 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Unit tests for the counts and trace of storage accesses. These only run on
+// platforms which enable them: see .arduino-ci.yaml
+
+#if OSFS_INSTRUMENT
+
+unittest_setup() {
+	clear_storage();
+	OSFS::format();
+	OSFS::sync();
+	OSFS::clearOpStats();
+}
+
+// Accesses seen by the trace callback
+unsigned long tracedReads = 0;
+unsigned long tracedWrites = 0;
+bool tracedOutOfRange = false;
+
+void recordAccess(OSFS::traceOp op, OSFS::address_t address, unsigned int num) {
+	if (op == OSFS::traceOp::READ)
+		tracedReads++;
+	else
+		tracedWrites++;
+
+	if (address < OSFS::startOfEEPROM || (unsigned long)address + num > (unsigned long)OSFS::endOfEEPROM + 1)
+		tracedOutOfRange = true;
+}
+
+void storeSomeFiles() {
+	int testInt = 123;
+	long testLong = 456;
+	OSFS::newFile("int1", testInt);
+	OSFS::newFile("long1", testLong);
+	OSFS::newFile("int1", testLong, true);
+	OSFS::deleteFile("long1");
+	OSFS::getFile("int1", testLong);
+	OSFS::sync();
+}
+
+unittest(test_counts_match_storage)
+{
+	readCalls = 0;
+	writeCalls = 0;
+	bytesWritten = 0;
+
+	storeSomeFiles();
+
+	OSFS::opStats stats = OSFS::getOpStats();
+	assertEqual(readCalls, stats.reads);
+	assertEqual(writeCalls, stats.writes);
+	assertEqual(bytesWritten, stats.writeBytes);
+	assertLessOrEqual(stats.reads, stats.readBytes);
+
+	OSFS::clearOpStats();
+	stats = OSFS::getOpStats();
+	assertEqual(0, stats.reads);
+	assertEqual(0, stats.writeBytes);
+}
+
+unittest(test_trace_callback)
+{
+	tracedReads = tracedWrites = 0;
+	tracedOutOfRange = false;
+	readCalls = 0;
+	writeCalls = 0;
+
+	OSFS::setTraceCallback(recordAccess);
+	storeSomeFiles();
+	OSFS::setTraceCallback(nullptr);
+
+	assertEqual(readCalls, tracedReads);
+	assertEqual(writeCalls, tracedWrites);
+	assertFalse(tracedOutOfRange);
+
+	// Once removed, it isn't called
+	int readInt;
+	OSFS::getFile("int1", readInt);
+	assertEqual(writeCalls, tracedWrites);
+}
+
+unittest(test_lookup_hops)
+{
+	char name[] = "fileA";
+	for (int i = 0; i < 4; i++) {
+		name[4] = 'A' + i;
+		OSFS::newFile(name, i);
+	}
+
+	OSFS::clearOpStats();
+	OSFS::address_t filePtr, fileSize;
+	OSFS::getFileInfo("fileD", filePtr, fileSize);
+	OSFS::getFileInfo("fileE", filePtr, fileSize);
+	OSFS::opStats stats = OSFS::getOpStats();
+
+	// Each search reads every header, including the dummy one on flash
+	const unsigned long chainHops = OSFS_FLASH_BLOCK_SIZE > 0 ? 10 : 8;
+#if OSFS_DIR_CACHE_SIZE == 0 && OSFS_DIR_INDEX_SIZE == 0
+	assertEqual(2, stats.lookups);
+	assertEqual(chainHops, stats.chainHops);
+#else
+	assertLessOrEqual(stats.chainHops, chainHops);
+#endif
+}
+
+// On flash, files are always appended, so there are no holes to try
+#if OSFS_FLASH_BLOCK_SIZE == 0
+unittest(test_alloc_retries)
+{
+	int testInt = 123;
+	long testLong = 456;
+	OSFS::newFile("int1", testInt);
+	OSFS::newFile("int2", testInt);
+	OSFS::newFile("int3", testInt);
+	OSFS::deleteFile("int2");
+
+	// The hole left by int2 is too small
+	OSFS::clearOpStats();
+	OSFS::newFile("long1", testLong);
+	OSFS::opStats stats = OSFS::getOpStats();
+	assertEqual(1, stats.allocations);
+	assertEqual(1, stats.allocRetries);
+
+	// But it fits another int
+	OSFS::clearOpStats();
+	OSFS::newFile("int4", testInt);
+	stats = OSFS::getOpStats();
+	assertEqual(1, stats.allocations);
+	assertEqual(0, stats.allocRetries);
+}
+#endif
+
+#endif
+
+unittest_main()
@@ -0,0 +1,328 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Unit tests for logs, which hold a fixed number of records and drop the
+// oldest as new ones are appended. They aren't available on flash.
+
+#if OSFS_FLASH_BLOCK_SIZE == 0
+
+unittest_setup() {
+	clear_storage();
+	OSFS::format();
+}
+
+void openLog(OSFS::Log& log, OSFS::address_t capacity = 5) {
+	auto r = log.open("log", sizeof(long), capacity);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+}
+
+void appendRange(OSFS::Log& log, long from, long to) {
+	for (long i = from; i < to; i++) {
+		auto r = log.append(&i);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	}
+}
+
+// Read the whole log, checking that it holds the records from first to last
+void checkRecords(OSFS::Log& log, long first, long last) {
+	assertEqual(last - first + 1, long(log.count()));
+
+	log.rewind();
+	long record;
+	for (long i = first; i <= last; i++) {
+		auto r = log.read(&record);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		assertEqual(i, record);
+	}
+
+	auto r = log.read(&record);
+	assertEqual(int(OSFS::result::END_OF_FILE), int(r));
+}
+
+unittest(test_log_empty)
+{
+	OSFS::Log log;
+	openLog(log);
+	assertEqual(5, log.capacity());
+	assertEqual(0, log.count());
+
+	long record;
+	auto r = log.read(&record);
+	assertEqual(int(OSFS::result::END_OF_FILE), int(r));
+}
+
+unittest(test_log_wraps_around)
+{
+	OSFS::Log log;
+	openLog(log);
+
+	appendRange(log, 0, 3);
+	checkRecords(log, 0, 2);
+
+	// Once full, each record replaces the oldest
+	appendRange(log, 3, 12);
+	checkRecords(log, 7, 11);
+}
+
+unittest(test_log_reopen)
+{
+	OSFS::Log log;
+	openLog(log);
+	appendRange(log, 0, 3);
+
+	// RAM doesn't survive a reset
+	log.close();
+	OSFS::sync();
+	OSFS::invalidateDirCache();
+	openLog(log);
+	checkRecords(log, 0, 2);
+
+	for (long last = 3; last < 12; last++) {
+		appendRange(log, last, last + 1);
+		log.close();
+		OSFS::sync();
+		OSFS::invalidateDirCache();
+
+		// The capacity asked for doesn't matter once the log exists
+		openLog(log, 100);
+		assertEqual(5, log.capacity());
+		checkRecords(log, last < 4 ? 0 : last - 4, last);
+	}
+}
+
+unittest(test_log_sequence_wraps)
+{
+	// Sequence numbers are 16 bits, so they wrap around many times over
+	OSFS::Log log;
+	openLog(log, 3);
+	for (long i = 0; i < 140000; i += 997) {
+		appendRange(log, i, i + 997);
+		log.close();
+		openLog(log, 3);
+		checkRecords(log, i + 994, i + 996);
+	}
+}
+
+unittest(test_log_read_while_appending)
+{
+	OSFS::Log log;
+	openLog(log);
+	appendRange(log, 0, 5);
+
+	long record;
+	log.read(&record);
+	log.read(&record);
+	assertEqual(1, record);
+
+	// The record dropped was already read, so reading carries on from 2
+	appendRange(log, 5, 6);
+	auto r = log.read(&record);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(2, record);
+}
+
+unittest(test_log_append_writes_record_only)
+{
+	OSFS::Log log;
+	openLog(log);
+	appendRange(log, 0, 7);
+	OSFS::sync();
+
+	OSFS::address_t filePtr, fileSize;
+	OSFS::getFileInfo("log", filePtr, fileSize);
+	byte headerBefore[sizeof(OSFS::fileHeader)];
+	read_storage(filePtr - sizeof(OSFS::fileHeader) - STORAGE_BASE, sizeof(OSFS::fileHeader), headerBefore);
+
+#if OSFS_PAGE_SIZE > 0
+	int singleWrites = 0;
+#endif
+	for (long i = 7; i < 20; i++) {
+		writeCalls = 0;
+		bytesWritten = 0;
+		appendRange(log, i, i + 1);
+		OSFS::sync();
+
+		// The record and its sequence number, and nothing else. The page
+		// cache writes back the whole of each page they're in.
+#if OSFS_CACHE_PAGES == 0
+		assertEqual(sizeof(long) + sizeof(uint16_t), bytesWritten);
+#endif
+#if OSFS_PAGE_SIZE > 0
+		// In one write, or one per page if the slot is split between two
+		assertLessOrEqual(writeCalls, 2);
+		if (writeCalls == 1)
+			singleWrites++;
+#else
+		assertEqual(2, writeCalls);
+#endif
+	}
+
+#if OSFS_PAGE_SIZE > 0
+	assertMore(singleWrites, 0);
+#endif
+
+	byte headerAfter[sizeof(OSFS::fileHeader)];
+	read_storage(filePtr - sizeof(OSFS::fileHeader) - STORAGE_BASE, sizeof(OSFS::fileHeader), headerAfter);
+	assertEqual(0, memcmp(headerBefore, headerAfter, sizeof(OSFS::fileHeader)));
+}
+
+unittest(test_log_append_power_loss)
+{
+	// Cut the power after every possible number of writes while a record
+	// is appended to a full log. Afterwards, it holds the records before the
+	// new one, with or without it, and carries on as normal.
+	for (long writes = 0; ; writes++) {
+		clear_storage();
+		OSFS::format();
+
+		OSFS::Log log;
+		openLog(log);
+		appendRange(log, 0, 7);
+		OSFS::sync();
+
+		writesUntilPowerLoss = writes;
+		writeCalls = 0;
+		appendRange(log, 7, 8);
+		OSFS::sync();
+		unsigned long writesNeeded = writeCalls;
+		writesUntilPowerLoss = -1;
+
+		log.close();
+		OSFS::invalidateDirCache();
+		openLog(log);
+
+		bool appended = (unsigned long)writes >= writesNeeded;
+		if (appended) {
+			checkRecords(log, 3, 7);
+		} else {
+			// The slot the record was going into is the spare, so only the
+			// new record was lost
+			checkRecords(log, 2, 6);
+		}
+
+		appendRange(log, 8, 9);
+		if (appended) {
+			checkRecords(log, 4, 8);
+		} else {
+			const long expected[] = {3, 4, 5, 6, 8};
+			assertEqual(5, log.count());
+			log.rewind();
+			for (long e : expected) {
+				long record;
+				log.read(&record);
+				assertEqual(e, record);
+			}
+		}
+
+		if (appended)
+			break;
+	}
+}
+
+unittest(test_log_create_power_loss)
+{
+	// However far creating the log got, opening it again gives an empty log
+	for (long writes = 0; ; writes++) {
+		clear_storage();
+		OSFS::format();
+		OSFS::sync();
+
+		writesUntilPowerLoss = writes;
+		writeCalls = 0;
+		OSFS::Log log;
+		log.open("log", sizeof(long), 5);
+		OSFS::sync();
+		unsigned long writesNeeded = writeCalls;
+		writesUntilPowerLoss = -1;
+
+		log.close();
+		OSFS::invalidateDirCache();
+		openLog(log);
+		assertEqual(0, log.count());
+		appendRange(log, 0, 2);
+		checkRecords(log, 0, 1);
+
+		if ((unsigned long)writes >= writesNeeded)
+			break;
+	}
+}
+
+unittest(test_log_wrong_file)
+{
+	int testInt = 123;
+	OSFS::newFile("int1", testInt);
+
+	OSFS::Log log;
+	auto r = log.open("int1", sizeof(long), 5);
+	assertEqual(int(OSFS::result::FILE_ALREADY_EXISTS), int(r));
+	assertFalse(log.isOpen());
+
+	r = log.open("log", sizeof(long), 0);
+	assertEqual(int(OSFS::result::BUFFER_WRONG_SIZE), int(r));
+
+	r = log.open("log", sizeof(long), SIZE_STORAGE);
+	assertEqual(int(OSFS::result::INSUFFICIENT_SPACE), int(r));
+
+	openLog(log);
+	log.close();
+	r = log.open("log", sizeof(int), 5);
+	assertEqual(int(OSFS::result::BUFFER_WRONG_SIZE), int(r));
+
+	// Storing a file over a log makes it an ordinary file, even though it
+	// would fit in the log's space
+	OSFS::newFile("log", testInt, true);
+	r = log.open("log", sizeof(long), 5);
+	assertEqual(int(OSFS::result::FILE_ALREADY_EXISTS), int(r));
+
+	int readInt;
+	r = OSFS::getFile("log", readInt);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(testInt, readInt);
+}
+
+unittest(test_log_survives_compact)
+{
+	int testInt = 123;
+	OSFS::newFile("int1", testInt);
+
+	OSFS::Log log;
+	openLog(log);
+	appendRange(log, 0, 8);
+	log.close();
+
+	OSFS::deleteFile("int1");
+	auto r = OSFS::compact();
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	openLog(log);
+	checkRecords(log, 3, 7);
+}
+
+#if OSFS_CRC
+unittest(test_log_skipped_by_scrub)
+{
+	int testInt = 123;
+	OSFS::newFile("int1", testInt);
+
+	OSFS::Log log;
+	openLog(log);
+	appendRange(log, 0, 8);
+	OSFS::newFile("int2", testInt);
+
+	// One file per call: the log is passed over without being counted
+	bool passComplete;
+	auto r = OSFS::scrub(1, passComplete);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertFalse(passComplete);
+	r = OSFS::scrub(1, passComplete);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertTrue(passComplete);
+}
+#endif
+
+#endif
+
+unittest_main()
@@ -0,0 +1,92 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Unit tests for mounting
+
+unittest_setup() {
+	clear_storage();
+}
+
+unittest(test_mount_unformatted)
+{
+	auto r = OSFS::mount();
+	assertEqual(int(OSFS::result::UNFORMATTED), int(r));
+	assertFalse(OSFS::isMounted());
+}
+
+unittest(test_mount_and_unmount)
+{
+	OSFS::format();
+	assertFalse(OSFS::isMounted());
+
+	auto r = OSFS::mount();
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertTrue(OSFS::isMounted());
+
+	OSFS::unmount();
+	assertFalse(OSFS::isMounted());
+
+	OSFS::mount();
+	OSFS::format();
+	assertFalse(OSFS::isMounted());
+}
+
+unittest(test_mounted_skips_version_check)
+{
+	OSFS::format();
+	int testInt = 123;
+	OSFS::newFile("testInt", testInt);
+
+	OSFS::address_t filePtr, fileSize;
+
+	clear_read_counts();
+	OSFS::getFileInfo("testInt", filePtr, fileSize);
+	unsigned long unmountedReads = readRequests();
+
+	OSFS::mount();
+
+	clear_read_counts();
+	OSFS::getFileInfo("testInt", filePtr, fileSize);
+	unsigned long mountedReads = readRequests();
+
+	assertLess(mountedReads, unmountedReads);
+
+	OSFS::unmount();
+}
+
+unittest(test_mounted_writes_match_unmounted)
+{
+	// Perform the same operations with and without mounting and check that
+	// the storage ends up the same
+	byte unmountedStorage[SIZE_STORAGE];
+
+	for (int mounted = 0; mounted < 2; mounted++) {
+		clear_storage();
+		OSFS::format();
+		if (mounted)
+			OSFS::mount();
+
+		int testInt = 123;
+		long testLong = 456;
+		OSFS::newFile("int1", testInt);
+		OSFS::newFile("long1", testLong);
+		OSFS::newFile("int2", testInt);
+		OSFS::deleteFile("long1");
+		OSFS::newFile("int3", testInt);
+		OSFS::newFile("long2", testLong);
+		OSFS::newFile("int1", testLong, true);
+
+		if (mounted) {
+			OSFS::unmount();
+			assertEqual(0, memcmp(unmountedStorage, storage, SIZE_STORAGE));
+		} else {
+			OSFS::sync();
+			memcpy(unmountedStorage, storage, SIZE_STORAGE);
+		}
+	}
+}
+
+unittest_main()
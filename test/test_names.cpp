@@ -0,0 +1,99 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Unit tests for names padded and hashed at compile time
+
+unittest_setup() {
+	clear_storage();
+	OSFS::format();
+}
+
+constexpr OSFS::paddedName INT1("int1");
+constexpr OSFS::paddedName LONG_NAME("longer_than_11");
+
+// Worked out by the compiler
+static_assert(INT1.id[3] == '1' && INT1.id[4] == ' ' && INT1.id[10] == ' ', "int1 is padded with spaces");
+static_assert(LONG_NAME.id[10] == 'n', "Names are cut to FILE_NAME_LENGTH chars");
+
+void checkSameName(const OSFS::paddedName& compiled, const char* name) {
+	OSFS::paddedName padded = OSFS::padName(name);
+	assertEqual(0, memcmp(padded.id, compiled.id, OSFS::FILE_NAME_LENGTH));
+	assertEqual(padded.hash, compiled.hash);
+	assertEqual(OSFS::hashFilename(padded.id), padded.hash);
+}
+
+unittest(test_compiled_names_match)
+{
+	checkSameName(INT1, "int1");
+	checkSameName(LONG_NAME, "longer_than_11");
+	checkSameName(OSFS::paddedName(""), "");
+	checkSameName(OSFS::paddedName("12345678.ab"), "12345678.ab");
+
+	// A char array is padded at its null terminator, not its size
+	char buffer[16] = "int1";
+	checkSameName(OSFS::paddedName(buffer), "int1");
+	checkSameName(OSFS::padName(buffer), "int1");
+}
+
+unittest(test_either_name_finds_file)
+{
+	int testInt = 123;
+	auto r = OSFS::newFile(INT1, testInt);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	int readInt;
+	r = OSFS::getFile("int1", readInt);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(testInt, readInt);
+
+	long testLong = 456;
+	OSFS::newFile("long1", testLong);
+	long readLong;
+	r = OSFS::getFile(OSFS::padName("long1"), readLong);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(testLong, readLong);
+
+	r = OSFS::deleteFile(INT1);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	r = OSFS::getFile("int1", readInt);
+	assertEqual(int(OSFS::result::FILE_NOT_FOUND), int(r));
+}
+
+// Without a cache or index, a search walks the chain
+#if OSFS_DIR_CACHE_SIZE == 0 && OSFS_DIR_INDEX_SIZE == 0 && OSFS_CACHE_PAGES == 0
+unittest(test_search_skips_names)
+{
+	char name[] = "fileA";
+	for (int i = 0; i < 8; i++) {
+		name[4] = 'A' + i;
+		OSFS::newFile(name, i);
+	}
+
+	// Only the part of each header from its size to its hash is read, unless
+	// the hash matches
+	bytesRead = 0;
+	OSFS::address_t filePtr, fileSize;
+	auto r = OSFS::getFileInfo("missing", filePtr, fileSize);
+	assertEqual(int(OSFS::result::FILE_NOT_FOUND), int(r));
+
+	const unsigned long chainLength = OSFS_FLASH_BLOCK_SIZE > 0 ? 9 : 8;
+	const unsigned long partSize = offsetof(OSFS::fileHeader, hash) + 1 - offsetof(OSFS::fileHeader, fileSize);
+	assertLessOrEqual(bytesRead, sizeof(OSFS::FSInfo) + chainLength * partSize + OSFS::FILE_NAME_LENGTH);
+	assertLess(bytesRead, chainLength * sizeof(OSFS::fileHeader) / 2);
+
+	// The same goes for the walks made to store and delete files, which between
+	// them read less than one whole chain of headers
+	int testInt = 123;
+	bytesRead = 0;
+	r = OSFS::newFile("missing", testInt);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	r = OSFS::deleteFile("fileH");
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertLess(bytesRead, (chainLength + 1) * sizeof(OSFS::fileHeader));
+}
+#endif
+
+unittest_main()
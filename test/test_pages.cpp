@@ -0,0 +1,69 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Unit tests for paged writes. These only run on platforms which enable them:
+// see .arduino-ci.yaml
+
+#if OSFS_PAGE_SIZE > 0
+
+unittest_setup() {
+	clear_storage();
+	OSFS::format();
+}
+
+unittest(test_new_file_is_written_in_pages)
+{
+	byte data[3 * OSFS_PAGE_SIZE];
+	for (unsigned int i = 0; i < sizeof(data); i++)
+		data[i] = i;
+
+	writeCalls = 0;
+	pageCrossings = 0;
+	auto r = OSFS::newFile("paged", data, sizeof(data));
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	// The header and the contents share page writes, and none of them spans
+	// two pages. Only the file's flags, which are written before and after
+	// them, and its slot in the directory index are written separately, and
+	// only the slot may span two pages.
+	const unsigned long indexWrites = OSFS_DIR_INDEX_SIZE > 0 ? 1 : 0;
+	unsigned int bytes = sizeof(OSFS::fileHeader) + sizeof(data);
+	assertLessOrEqual(writeCalls, bytes / OSFS_PAGE_SIZE + 2 + 2 + indexWrites);
+	assertLessOrEqual(pageCrossings, indexWrites);
+
+	byte readData[sizeof(data)];
+	r = OSFS::getFile("paged", readData);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(0, memcmp(data, readData, sizeof(data)));
+}
+
+unittest(test_compact_copies_in_pages)
+{
+	byte data[2 * OSFS_PAGE_SIZE];
+	for (unsigned int i = 0; i < sizeof(data); i++)
+		data[i] = 255 - i;
+
+	int testInt = 123;
+	OSFS::newFile("gap", testInt);
+	OSFS::newFile("moved", data, sizeof(data));
+	OSFS::deleteFile("gap");
+
+	pageCrossings = 0;
+	auto r = OSFS::compact();
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	// Only the header and link updates, of a few bytes each, may cross a page
+	assertLessOrEqual(pageCrossings, 2);
+
+	byte readData[sizeof(data)];
+	r = OSFS::getFile("moved", readData);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(0, memcmp(data, readData, sizeof(data)));
+}
+
+#endif
+
+unittest_main()
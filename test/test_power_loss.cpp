@@ -0,0 +1,369 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Unit tests for surviving a power cut part way through writing a file. Each
+// test cuts the power after every possible number of writes, then checks the
+// files as they'd be found after a reset.
+
+unittest_setup() {
+	clear_storage();
+	OSFS::format();
+	OSFS::setAllocPolicy(OSFS::allocPolicy::FIRST_FIT);
+}
+
+// Let the next writes succeed, then lose all the rest. Returns false once
+// writes is enough for everything to succeed, which ends the test.
+bool cutPowerAfter(long writes, unsigned long writesNeeded) {
+	writesUntilPowerLoss = -1;
+	return (unsigned long)writes < writesNeeded;
+}
+
+// After a power cut, the file must hold either its old or its new contents,
+// and there must be only one copy of it left
+void checkOldOrNew(const char* name, const void* oldData, unsigned int oldSize,
+		const void* newData, unsigned int newSize) {
+	OSFS::address_t filePtr, fileSize;
+	auto r = OSFS::getFileInfo(name, filePtr, fileSize);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertTrue(fileSize == oldSize || fileSize == newSize);
+
+	byte readData[sizeof(long)];
+	r = OSFS::readNBytesChk(filePtr, fileSize, readData);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	bool isOld = fileSize == oldSize && 0 == memcmp(readData, oldData, oldSize);
+	bool isNew = fileSize == newSize && 0 == memcmp(readData, newData, newSize);
+	assertTrue(isOld || isNew);
+
+	r = OSFS::deleteFile(name);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	r = OSFS::getFileInfo(name, filePtr, fileSize);
+	assertEqual(int(OSFS::result::FILE_NOT_FOUND), int(r));
+}
+
+unittest(test_replace_power_loss)
+{
+	for (long writes = 0; ; writes++) {
+		clear_storage();
+		OSFS::format();
+
+		// Too small for the new contents, so the file moves
+		int testInt = 123;
+		long testLong = 456;
+		OSFS::newFile("file1", testInt);
+		OSFS::newFile("file2", testInt);
+		OSFS::sync();
+
+		writesUntilPowerLoss = writes;
+		writeCalls = 0;
+		auto r = OSFS::newFile("file1", testLong, true);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		OSFS::sync();
+		unsigned long writesNeeded = writeCalls;
+
+		// RAM doesn't survive a power cut
+		bool cut = cutPowerAfter(writes, writesNeeded);
+		OSFS::invalidateDirCache();
+
+		checkOldOrNew("file1", &testInt, sizeof(testInt), &testLong, sizeof(testLong));
+
+		int readInt;
+		r = OSFS::getFile("file2", readInt);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		assertEqual(testInt, readInt);
+
+		if (!cut)
+			break;
+	}
+}
+
+unittest(test_replace_power_loss_mounted)
+{
+	for (long writes = 0; ; writes++) {
+		clear_storage();
+		OSFS::format();
+
+		long testLong = 456;
+		long newLong = 789;
+		OSFS::setAllocPolicy(OSFS::allocPolicy::WEAR_LEVELING);
+		OSFS::newFile("file1", testLong);
+		OSFS::newFile("file2", testLong);
+		OSFS::mount();
+		OSFS::sync();
+
+		// With WEAR_LEVELING, the file moves even though it would fit
+		writesUntilPowerLoss = writes;
+		writeCalls = 0;
+		auto r = OSFS::newFile("file1", newLong, true);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		OSFS::unmount();
+		unsigned long writesNeeded = writeCalls;
+
+		bool cut = cutPowerAfter(writes, writesNeeded);
+		OSFS::invalidateDirCache();
+
+		r = OSFS::mount();
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		checkOldOrNew("file1", &testLong, sizeof(testLong), &newLong, sizeof(newLong));
+		OSFS::unmount();
+
+		if (!cut)
+			break;
+	}
+}
+
+unittest(test_new_file_power_loss)
+{
+	for (long writes = 0; ; writes++) {
+		clear_storage();
+		OSFS::format();
+
+		// Leave a hole for the new file to go in
+		long testLong = 456;
+		OSFS::newFile("file1", testLong);
+		OSFS::newFile("file2", testLong);
+		OSFS::newFile("file3", testLong);
+		OSFS::deleteFile("file2");
+		OSFS::sync();
+
+		long newLong = 789;
+		writesUntilPowerLoss = writes;
+		writeCalls = 0;
+		auto r = OSFS::newFile("file4", newLong);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		OSFS::sync();
+		unsigned long writesNeeded = writeCalls;
+
+		bool cut = cutPowerAfter(writes, writesNeeded);
+		OSFS::invalidateDirCache();
+
+		// The new file must be complete if it's there at all
+		long readLong;
+		r = OSFS::getFile("file4", readLong);
+		if (r != OSFS::result::FILE_NOT_FOUND) {
+			assertEqual(int(OSFS::result::NO_ERROR), int(r));
+			assertEqual(newLong, readLong);
+		}
+
+		r = OSFS::getFile("file3", readLong);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		assertEqual(testLong, readLong);
+
+		if (!cut)
+			break;
+	}
+}
+
+#if OSFS_PAGE_SIZE > 0 && OSFS_FLASH_BLOCK_SIZE == 0
+// A header which spans two pages is written in two parts, so a power cut can
+// leave a replacement marked as pending without its hash, the byte after its
+// flags. It must still be found to be a copy of the original.
+unittest(test_replace_power_loss_before_hash)
+{
+	for (long writes = 0; ; writes++) {
+		clear_storage();
+		OSFS::format();
+
+		// Leave a hole whose header's hash starts a page
+		OSFS::address_t hashAt = OSFS::startOfEEPROM + OSFS::FIRST_HEADER_OFFSET +
+			sizeof(OSFS::fileHeader) + offsetof(OSFS::fileHeader, hash);
+		byte pad[OSFS_PAGE_SIZE] = {};
+		long values[4] = {};
+		int testInt = 123;
+		OSFS::newFile("pad", pad, (OSFS_PAGE_SIZE - hashAt % OSFS_PAGE_SIZE) % OSFS_PAGE_SIZE, false);
+		OSFS::newFile("hole", values);
+		OSFS::newFile("file1", testInt);
+		OSFS::newFile("file2", testInt);
+		OSFS::deleteFile("hole");
+		OSFS::sync();
+
+		long testLong = 456;
+		writesUntilPowerLoss = writes;
+		writeCalls = 0;
+		auto r = OSFS::newFile("file1", testLong, true);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		OSFS::sync();
+		unsigned long writesNeeded = writeCalls;
+
+		bool cut = cutPowerAfter(writes, writesNeeded);
+		OSFS::invalidateDirCache();
+
+		checkOldOrNew("file1", &testInt, sizeof(testInt), &testLong, sizeof(testLong));
+
+		if (!cut)
+			break;
+	}
+}
+#endif
+
+// Count the files which can be listed, checking that each can be found by name
+int countFiles() {
+	OSFS::Dir dir;
+	OSFS::dirEntry entry;
+	int count = 0;
+	while (dir.next(entry) == OSFS::result::NO_ERROR) {
+		OSFS::address_t filePtr, fileSize;
+		auto r = OSFS::getFileInfo(entry.name, filePtr, fileSize);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		count++;
+	}
+	return count;
+}
+
+// A header takes more than one write when it crosses a page boundary. The
+// first file goes over the dummy header, which is live, so a power cut
+// between the writes mustn't leave the first part looking like a file.
+unittest(test_first_file_power_loss)
+{
+	for (long writes = 0; ; writes++) {
+		clear_storage();
+		OSFS::format();
+		OSFS::sync();
+
+		long testLong = 456;
+		writesUntilPowerLoss = writes;
+		writeCalls = 0;
+		auto r = OSFS::newFile("file1", testLong);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		OSFS::sync();
+		unsigned long writesNeeded = writeCalls;
+
+		bool cut = cutPowerAfter(writes, writesNeeded);
+		OSFS::invalidateDirCache();
+
+		long readLong;
+		r = OSFS::getFile("file1", readLong);
+		if (r != OSFS::result::FILE_NOT_FOUND) {
+			assertEqual(int(OSFS::result::NO_ERROR), int(r));
+			assertEqual(testLong, readLong);
+		}
+		assertEqual(r == OSFS::result::NO_ERROR ? 1 : 0, countFiles());
+
+		if (!cut)
+			break;
+	}
+}
+
+// The page cache combines the writes within a page into one, so it relies on
+// page writes not being torn
+#if OSFS_FLASH_BLOCK_SIZE == 0 && OSFS_CACHE_PAGES == 0
+// As above, but the write the power cut stops is torn part way through, as
+// it can be on a part without page writes. Tries every way of tearing each
+// write up to the end of the new file's contents.
+void checkTornNewFile(bool intoHole) {
+	for (long writes = 0; ; writes++) {
+		bool cut = false;
+		for (long torn = 0; torn <= long(sizeof(OSFS::fileHeader) + sizeof(long)); torn++) {
+			clear_storage();
+			OSFS::format();
+
+			// The hole is larger than the new file, so it's split
+			long testLong = 456;
+			long values[4] = {1, 2, 3, 4};
+			if (intoHole) {
+				OSFS::newFile("file1", testLong);
+				OSFS::newFile("file2", values);
+				OSFS::newFile("file3", testLong);
+				OSFS::deleteFile("file2");
+			}
+			OSFS::sync();
+
+			long newLong = 789;
+			writesUntilPowerLoss = writes;
+			tornWriteBytes = torn;
+			writeCalls = 0;
+			auto r = OSFS::newFile("file4", newLong);
+			assertEqual(int(OSFS::result::NO_ERROR), int(r));
+			OSFS::sync();
+			unsigned long writesNeeded = writeCalls;
+
+			cut = cutPowerAfter(writes, writesNeeded);
+			OSFS::invalidateDirCache();
+
+			long readLong;
+			r = OSFS::getFile("file4", readLong);
+			if (r != OSFS::result::FILE_NOT_FOUND) {
+				assertEqual(int(OSFS::result::NO_ERROR), int(r));
+				assertEqual(newLong, readLong);
+			}
+
+			int expected = r == OSFS::result::NO_ERROR ? 1 : 0;
+			if (intoHole) {
+				assertEqual(int(OSFS::result::NO_ERROR), int(OSFS::getFile("file1", readLong)));
+				assertEqual(testLong, readLong);
+				assertEqual(int(OSFS::result::NO_ERROR), int(OSFS::getFile("file3", readLong)));
+				assertEqual(testLong, readLong);
+				expected += 2;
+			}
+			assertEqual(expected, countFiles());
+
+			// Whatever was left behind can be reused
+			r = OSFS::newFile("file5", values);
+			assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+			if (!cut)
+				break;
+		}
+		if (!cut)
+			break;
+	}
+}
+
+unittest(test_first_file_torn_power_loss)
+{
+	checkTornNewFile(false);
+}
+
+unittest(test_new_file_torn_power_loss)
+{
+	checkTornNewFile(true);
+}
+
+// Rewriting a file with contents of the same size, which fit where the old
+// ones are, still leaves either the old or the new contents
+unittest(test_rewrite_torn_power_loss)
+{
+	for (long writes = 0; ; writes++) {
+		bool cut = false;
+		for (long torn = 0; torn <= long(sizeof(OSFS::fileHeader) + sizeof(long)); torn++) {
+			clear_storage();
+			OSFS::format();
+
+			long testLong = 456;
+			OSFS::newFile("file1", testLong);
+			OSFS::newFile("file2", testLong);
+			OSFS::sync();
+
+			long newLong = 789;
+			writesUntilPowerLoss = writes;
+			tornWriteBytes = torn;
+			writeCalls = 0;
+			auto r = OSFS::newFile("file1", newLong, true);
+			assertEqual(int(OSFS::result::NO_ERROR), int(r));
+			OSFS::sync();
+			unsigned long writesNeeded = writeCalls;
+
+			cut = cutPowerAfter(writes, writesNeeded);
+			OSFS::invalidateDirCache();
+
+			assertEqual(2, countFiles());
+			checkOldOrNew("file1", &testLong, sizeof(testLong), &newLong, sizeof(newLong));
+
+			long readLong;
+			r = OSFS::getFile("file2", readLong);
+			assertEqual(int(OSFS::result::NO_ERROR), int(r));
+			assertEqual(testLong, readLong);
+
+			if (!cut)
+				break;
+		}
+		if (!cut)
+			break;
+	}
+}
+#endif
+
+unittest_main()
@@ -0,0 +1,236 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Unit tests for volumes, each on a storage device of its own, alongside the
+// default volume in RAM_storage.h. These only run on platforms which enable
+// them: see .arduino-ci.yaml
+
+#if OSFS_VOLUMES
+
+// A backend over an array of its own, which counts its writes. Like
+// RAM_storage.h, with flash it only clears bits until a block is erased.
+struct ramBackend {
+	static const OSFS::address_t BASE = 0x100;
+	static const size_t SIZE = 1024;
+
+	byte data[SIZE];
+	unsigned long writes = 0;
+
+	void read(OSFS::address_t address, unsigned int num, byte* output) {
+		memcpy(output, data + address - BASE, num);
+	}
+
+	void write(OSFS::address_t address, unsigned int num, const byte* input) {
+		writes++;
+		for (unsigned int i = 0; i < num; i++) {
+#if OSFS_FLASH_BLOCK_SIZE > 0
+			data[address - BASE + i] &= input[i];
+#else
+			data[address - BASE + i] = input[i];
+#endif
+		}
+	}
+
+#if OSFS_FLASH_BLOCK_SIZE > 0
+	void erase(OSFS::address_t address) {
+		memset(data + address - BASE, 0xFF, OSFS_FLASH_BLOCK_SIZE);
+	}
+#endif
+};
+
+typedef OSFS::Volume<ramBackend> ramVolume;
+
+ramVolume* volA;
+ramVolume* volB;
+
+unittest_setup() {
+	clear_storage();
+	OSFS::format();
+
+	volA = new ramVolume(ramBackend::BASE, ramBackend::BASE + ramBackend::SIZE - 1);
+	volB = new ramVolume(ramBackend::BASE, ramBackend::BASE + ramBackend::SIZE - 1);
+	volA->format();
+	volB->format();
+}
+
+unittest_teardown() {
+	delete volA;
+	delete volB;
+}
+
+long valueOf(OSFS::VolumeBase& volume, const char* name) {
+	long readLong = -1;
+	auto r = volume.getFile(name, readLong);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	return readLong;
+}
+
+unittest(test_volumes_hold_their_own_files)
+{
+	long one = 1, two = 2, three = 3;
+	OSFS::newFile("long1", one);
+	volA->newFile("long1", two);
+	volB->newFile("long1", three);
+	volB->newFile("long2", three);
+
+	long readLong;
+	assertEqual(int(OSFS::result::NO_ERROR), int(OSFS::getFile("long1", readLong)));
+	assertEqual(1, readLong);
+	assertEqual(2, valueOf(*volA, "long1"));
+	assertEqual(3, valueOf(*volB, "long1"));
+
+	assertEqual(int(OSFS::result::FILE_NOT_FOUND), int(OSFS::getFile("long2", readLong)));
+	assertEqual(int(OSFS::result::FILE_NOT_FOUND), int(volA->getFile("long2", readLong)));
+
+	// Deleting from one leaves the others alone
+	auto r = volA->deleteFile("long1");
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(int(OSFS::result::FILE_NOT_FOUND), int(volA->getFile("long1", readLong)));
+	assertEqual(int(OSFS::result::NO_ERROR), int(OSFS::getFile("long1", readLong)));
+	assertEqual(3, valueOf(*volB, "long1"));
+
+	// Addresses are those of the volume's own storage
+	OSFS::address_t filePtr, fileSize;
+	volB->getFileInfo("long1", filePtr, fileSize);
+	assertMoreOrEqual(filePtr, ramBackend::BASE);
+	assertLess(filePtr, ramBackend::BASE + ramBackend::SIZE);
+}
+
+unittest(test_volumes_keep_their_own_state)
+{
+	volA->mount();
+	assertTrue(volA->isMounted());
+	assertFalse(volB->isMounted());
+	assertFalse(OSFS::isMounted());
+
+	// Writes to a volume go to its backend, and are counted by it alone
+	long value = 123;
+	volA->sync();
+	OSFS::sync();
+	writeCalls = 0;
+	unsigned long writesB = volB->backend().writes;
+	volA->clearOpStats();
+	OSFS::clearOpStats();
+
+	volA->newFile("long1", value);
+	volA->sync();
+
+	assertEqual(0, writeCalls);
+	assertEqual(writesB, volB->backend().writes);
+#if OSFS_INSTRUMENT
+	assertMore(volA->getOpStats().writes, 0);
+	assertEqual(0, OSFS::getOpStats().writes);
+#endif
+
+	volA->unmount();
+	assertFalse(volA->isMounted());
+}
+
+unittest(test_unformatted_volume)
+{
+	ramVolume volC(ramBackend::BASE, ramBackend::BASE + ramBackend::SIZE - 1);
+	memset(volC.backend().data, OSFS_FLASH_BLOCK_SIZE > 0 ? 0xFF : 0, ramBackend::SIZE);
+
+	long value = 123;
+	auto r = volC.newFile("long1", value);
+	assertEqual(int(OSFS::result::UNFORMATTED), int(r));
+
+	// The others are unaffected
+	r = volA->newFile("long1", value);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+}
+
+unittest(test_handles_stay_on_their_volume)
+{
+	long values[3] = {1, 2, 3};
+	volA->newFile("values", values);
+	OSFS::newFile("other", values);
+
+	// A file opened on a volume is read and written there
+	OSFS::File file;
+	auto r = volA->open(file, "values");
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	long value = 20;
+	file.seek(sizeof(long));
+	r = file.write(&value, sizeof(long));
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	r = file.append(&value, sizeof(long));
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	long readValues[4];
+	r = volA->getFile("values", readValues);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(20, readValues[1]);
+	assertEqual(20, readValues[3]);
+	r = OSFS::getFile("values", readValues);
+	assertEqual(int(OSFS::result::FILE_NOT_FOUND), int(r));
+
+	// A listing carries on with the volume it started on
+	volA->newFile("long1", value);
+	OSFS::Dir dir;
+	OSFS::dirEntry entry;
+	r = volA->next(dir, entry);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(0, strcmp("values", entry.name));
+	r = dir.next(entry);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(0, strcmp("long1", entry.name));
+	r = dir.next(entry);
+	assertEqual(int(OSFS::result::END_OF_FILE), int(r));
+
+	// Until it's rewound
+	dir.rewind();
+	r = dir.next(entry);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(0, strcmp("other", entry.name));
+}
+
+#if OSFS_FLASH_BLOCK_SIZE == 0
+unittest(test_log_on_volume)
+{
+	OSFS::Log log;
+	auto r = volB->open(log, "log", sizeof(long), 3);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	for (long i = 0; i < 5; i++)
+		log.append(&i);
+
+	OSFS::address_t filePtr, fileSize;
+	r = OSFS::getFileInfo("log", filePtr, fileSize);
+	assertEqual(int(OSFS::result::FILE_NOT_FOUND), int(r));
+
+	long record;
+	for (long i = 2; i < 5; i++) {
+		r = log.read(&record);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+		assertEqual(i, record);
+	}
+}
+#endif
+
+#if OSFS_BATCH_SIZE > 0
+unittest(test_batches_are_per_volume)
+{
+	long one = 1, two = 2;
+	volA->beginBatch();
+	volA->newFile("long1", one);
+
+	// Outside the batch, so stored straight away
+	OSFS::newFile("long1", two);
+	volB->newFile("long1", two);
+	assertEqual(2, valueOf(*volB, "long1"));
+
+	long readLong;
+	assertEqual(int(OSFS::result::FILE_NOT_FOUND), int(volA->getFile("long1", readLong)));
+	auto r = volA->commit();
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(1, valueOf(*volA, "long1"));
+	assertEqual(2, valueOf(*volB, "long1"));
+}
+#endif
+
+#endif
+
+unittest_main()
@@ -0,0 +1,148 @@
+#include <ArduinoUnitTests.h>
+#include <OSFS.h>
+
+#include "RAM_storage.h"
+
+
+// Unit tests for the wear leveling allocator
+
+unittest_setup() {
+	clear_storage();
+	OSFS::setAllocPolicy(OSFS::allocPolicy::FIRST_FIT);
+	OSFS::format();
+}
+
+unittest_teardown() {
+	OSFS::setAllocPolicy(OSFS::allocPolicy::FIRST_FIT);
+	OSFS::setOverwriteInPlace(false);
+}
+
+// Store a few files, then overwrite one of them many times
+void rewriteCalibration(int times) {
+	long fixed = 0;
+	OSFS::newFile("fixed1", fixed);
+	OSFS::newFile("fixed2", fixed);
+
+	struct calibration {
+		long values[4];
+	} cal = {};
+
+	for (int i = 0; i < times; i++) {
+		cal.values[0] = i;
+		auto r = OSFS::newFile("cal", cal, true);
+		assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	}
+
+	calibration readCal;
+	auto r = OSFS::getFile("cal", readCal);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+	assertEqual(times - 1, readCal.values[0]);
+
+	r = OSFS::getFile("fixed2", fixed);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+}
+
+unittest(test_wear_leveling_moves_files)
+{
+	OSFS::setAllocPolicy(OSFS::allocPolicy::WEAR_LEVELING);
+
+	int testInt = 123;
+	OSFS::newFile("testInt", testInt);
+
+	OSFS::address_t filePointer, fileSize;
+	OSFS::getFileInfo("testInt", filePointer, fileSize);
+
+	testInt = 321;
+	auto r = OSFS::newFile("testInt", testInt, true);
+	assertEqual(int(OSFS::result::NO_ERROR), int(r));
+
+	OSFS::address_t filePointer_after;
+	OSFS::getFileInfo("testInt", filePointer_after, fileSize);
+	assertNotEqual(filePointer, filePointer_after);
+
+	int test_read;
+	OSFS::getFile("testInt", test_read);
+	assertEqual(testInt, test_read);
+}
+
+unittest(test_wear_leveling_wraps_around)
+{
+	OSFS::setAllocPolicy(OSFS::allocPolicy::WEAR_LEVELING);
+
+	// Enough rewrites to go round the storage several times
+	rewriteCalibration(200);
+}
+
+unittest(test_wear_leveling_mounted)
+{
+	OSFS::setAllocPolicy(OSFS::allocPolicy::WEAR_LEVELING);
+	OSFS::mount();
+	rewriteCalibration(200);
+	OSFS::unmount();
+}
+
+#if OSFS_WEAR_BUCKETS > 0
+
+uint32_t maxWear() {
+	const uint32_t* histogram = OSFS::getWearHistogram();
+	uint32_t most = 0;
+	for (int i = 0; i < OSFS_WEAR_BUCKETS; i++) {
+		if (histogram[i] > most)
+			most = histogram[i];
+	}
+	return most;
+}
+
+unittest(test_wear_histogram_counts_writes)
+{
+	OSFS::sync();
+	OSFS::clearWearHistogram();
+
+	// Unlike anything already there, so that none of it is skipped by
+	// OSFS_COMPARE_WRITES
+	byte data[10];
+	memset(data, 0xA5, sizeof(data));
+	OSFS::writeNBytesChk(OSFS::startOfEEPROM, sizeof(data), data);
+	OSFS::sync();
+
+	const uint32_t* histogram = OSFS::getWearHistogram();
+	assertEqual(10, histogram[0]);
+	for (int i = 1; i < OSFS_WEAR_BUCKETS; i++)
+		assertEqual(0, histogram[i]);
+}
+
+unittest(test_wear_leveling_spreads_writes)
+{
+	// First fit at its worst, rewriting the file where it is
+	OSFS::setOverwriteInPlace(true);
+	OSFS::clearWearHistogram();
+	rewriteCalibration(500);
+	uint32_t firstFitWear = maxWear();
+
+	clear_storage();
+	OSFS::setOverwriteInPlace(false);
+	OSFS::setAllocPolicy(OSFS::allocPolicy::WEAR_LEVELING);
+	OSFS::format();
+
+	OSFS::clearWearHistogram();
+	rewriteCalibration(500);
+	uint32_t wearLevelingWear = maxWear();
+
+	printf("Most bytes written to one bucket: first fit %lu, wear leveling %lu\n",
+		(unsigned long)firstFitWear, (unsigned long)wearLevelingWear);
+
+#if OSFS_FLASH_BLOCK_SIZE > 0
+	// On flash, files are always appended, whatever the policy
+	assertEqual(firstFitWear, wearLevelingWear);
+#elif OSFS_COMPARE_WRITES
+	// Overwriting in place now only writes the bytes of the calibration which
+	// change, which beats moving the whole file every time
+	assertLess(firstFitWear, wearLevelingWear);
+#else
+	assertLess(wearLevelingWear * 4, firstFitWear);
+#endif
+}
+
+#endif
+
+unittest_main()
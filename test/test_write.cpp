@@ -8,6 +8,7 @@
 
 unittest_setup() {
 	clear_storage();
+	OSFS::setOverwriteInPlace(false);
 }
 
 unittest(test_nothing)
@@ -30,10 +31,14 @@ unittest(test_write_int)
 unittest(test_storage_header)
 {
 	OSFS::format();
-	assertEqual(storage[0], 'O');
-	assertEqual(storage[1], 'S');
-	assertEqual(storage[2], 'F');
-	assertEqual(storage[3], 'S');
+	OSFS::sync();
+
+	char idStr[4];
+	read_storage(0, sizeof(idStr), idStr);
+	assertEqual(idStr[0], 'O');
+	assertEqual(idStr[1], 'S');
+	assertEqual(idStr[2], 'F');
+	assertEqual(idStr[3], 'S');
 }
 
 unittest(test_file_header)
@@ -42,35 +47,44 @@ unittest(test_file_header)
 
 	int testInt = 123;
 	OSFS::newFile("testInt", testInt);
+	OSFS::sync();
 
-	for (int i=6; i<=21; i++) {
-		printf("[%i],", (int)storage[i]);
+	// The first header comes straight after the FSInfo and directory index,
+	// unless it's the dummy header on flash
+	byte header[sizeof(OSFS::fileHeader)];
+	read_storage(FIRST_FILE_OFFSET, sizeof(header), header);
+
+	for (int i=0; i<=15; i++) {
+		printf("[%i],", (int)header[i]);
 	}
 	putchar('\n');
 
 	// File name
-	assertEqual(storage[6],  't');
-	assertEqual(storage[7],  'e');
-	assertEqual(storage[8],  's');
-	assertEqual(storage[9],  't');
-	assertEqual(storage[10], 'I');
-	assertEqual(storage[11], 'n');
-	assertEqual(storage[12], 't');
-	assertEqual(storage[13], ' ');
-	assertEqual(storage[14], ' ');
-	assertEqual(storage[15], ' ');
-	assertEqual(storage[16], ' ');
+	assertEqual(header[0], 't');
+	assertEqual(header[1], 'e');
+	assertEqual(header[2], 's');
+	assertEqual(header[3], 't');
+	assertEqual(header[4], 'I');
+	assertEqual(header[5], 'n');
+	assertEqual(header[6], 't');
+	assertEqual(header[7], ' ');
+	assertEqual(header[8], ' ');
+	assertEqual(header[9], ' ');
+	assertEqual(header[10], ' ');
 
 	// File size
-	assertEqual(storage[17], 0);
-	assertEqual(storage[18], sizeof(int));
+	assertEqual(header[11], 0);
+	assertEqual(header[12], sizeof(int));
 
 	// Pointer to next file
-	assertEqual(storage[19], 0);
-	assertEqual(storage[20], 0);
+	assertEqual(header[13], 0);
+	assertEqual(header[14], 0);
 
 	// Flags
-	assertEqual(storage[21], 0);
+	assertEqual(header[15], 0);
+
+	// Hash of the padded name
+	assertEqual(OSFS::hashFilename("testInt    "), header[offsetof(OSFS::fileHeader, hash)]);
 }
 
 unittest(test_recall_int)
@@ -79,7 +93,7 @@ unittest(test_recall_int)
 	int test_write = 123;
 	OSFS::newFile("testInt", test_write);
 
-	uint16_t filePtr, fileSize;
+	OSFS::address_t filePtr, fileSize;
 	auto r = OSFS::getFileInfo("testInt", filePtr, fileSize);
 
 	assertEqual((int)OSFS::result::NO_ERROR, (int)r);
@@ -136,9 +150,9 @@ unittest(test_overwrite_size_change)
 
 	int testInt = 123;
 
-	uint16_t filePointer, fileSize;
-	uint16_t filePointer_smaller, fileSize_smaller;
-	uint16_t filePointer_bigger, fileSize_bigger;
+	OSFS::address_t filePointer, fileSize;
+	OSFS::address_t filePointer_smaller, fileSize_smaller;
+	OSFS::address_t filePointer_bigger, fileSize_bigger;
 
 	obj o_write;
 
@@ -174,10 +188,91 @@ unittest(test_overwrite_size_change)
 	assertEqual(fileSize_smaller, sizeof(obj_smaller));
 	assertEqual(fileSize_bigger, sizeof(obj_bigger));
 
-	assertEqual(filePointer, filePointer_smaller);
+	// Files are only overwritten in place when that's asked for
+	assertNotEqual(filePointer, filePointer_smaller);
 	assertNotEqual(filePointer, filePointer_bigger);
 }
 
+#if OSFS_FLASH_BLOCK_SIZE == 0
+unittest(test_overwrite_in_place)
+{
+	OSFS::format();
+	OSFS::setOverwriteInPlace(true);
+
+	int testInt = 123;
+	OSFS::newFile("int1", testInt);
+	OSFS::newFile("int2", testInt);
+
+	OSFS::address_t filePointer, fileSize;
+	OSFS::getFileInfo("int1", filePointer, fileSize);
+
+	// Same size: only the contents should be written, and the CRC if there
+	// is one
+	testInt = 321;
+	OSFS::sync();
+	writeCalls = 0;
+	auto r = OSFS::newFile("int1", testInt, true);
+	assertEqual(int(r), int(OSFS::result::NO_ERROR));
+	OSFS::sync();
+#if OSFS_CRC
+	assertLessOrEqual(writeCalls, 2);
+#else
+	assertEqual(1, writeCalls);
+#endif
+
+	OSFS::address_t filePointer_after, fileSize_after;
+	OSFS::getFileInfo("int1", filePointer_after, fileSize_after);
+	assertEqual(filePointer, filePointer_after);
+
+	int test_read;
+	OSFS::getFile("int1", test_read);
+	assertEqual(testInt, test_read);
+
+	// Smaller: the contents and the size field
+	char testChar = 'a';
+	OSFS::sync();
+	writeCalls = 0;
+	r = OSFS::newFile("int1", testChar, true);
+	assertEqual(int(r), int(OSFS::result::NO_ERROR));
+	OSFS::sync();
+#if OSFS_CACHE_PAGES > 0
+	// The page cache writes them together if they're in the same page
+	assertLessOrEqual(writeCalls, 2);
+#else
+	assertEqual(2, writeCalls);
+#endif
+
+	OSFS::getFileInfo("int1", filePointer_after, fileSize_after);
+	assertEqual(filePointer, filePointer_after);
+	assertEqual(sizeof(char), fileSize_after);
+
+	// And back to the original size, which still fits
+	r = OSFS::newFile("int1", testInt, true);
+	assertEqual(int(r), int(OSFS::result::NO_ERROR));
+	OSFS::getFileInfo("int1", filePointer_after, fileSize_after);
+	assertEqual(filePointer, filePointer_after);
+	assertEqual(sizeof(int), fileSize_after);
+}
+#endif
+
+unittest(test_failed_overwrite_keeps_original)
+{
+	OSFS::format();
+
+	int testInt = 123;
+	OSFS::newFile("int1", testInt);
+	OSFS::newFile("int2", testInt);
+
+	byte tooBig[SIZE_STORAGE];
+	auto r = OSFS::newFile("int1", tooBig, true);
+	assertEqual(int(r), int(OSFS::result::INSUFFICIENT_SPACE));
+
+	int test_read;
+	r = OSFS::getFile("int1", test_read);
+	assertEqual(int(r), int(OSFS::result::NO_ERROR));
+	assertEqual(testInt, test_read);
+}
+
 
 unittest_main()
 